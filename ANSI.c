@@ -56,10 +56,24 @@
 
   v1.31, 13 November, 2010:
     fix multibyte conversion problems.
+
+  v1.40, 16 October, 2026:
+    move the interpreter to ansiesc.c and the console calls to wincon.c;
+    hook the functions that invalidate the interpreter's console shadow;
+    flush the print buffer before reading, creating a process and exiting;
+    decode UTF-8 output ourselves (see widen.c);
+    widen single-byte code pages with a table;
+    flush before the console mode changes and before exiting (for the
+    renderer thread of ANSICON_ASYNC);
+    count the writes and console calls in shared memory (see stats.c);
+    record the writes (ANSICON_TRACE, see trace.c);
+    find the functions to hook by hash and make each page of an import
+    table writable once (see iat.c).
 */
 
 #define UNICODE
 #define _UNICODE
+#define _WIN32_WINNT 0x0501	// MinGW wants this defined for GetModuleHandleEx
 #include <tchar.h>
 
 #define lenof(str) (sizeof(str)/sizeof(TCHAR))
@@ -69,8 +83,10 @@
 #include <ImageHlp.h>
 #include <tlhelp32.h>
 #include "injdll.h"
-
-#define isdigit(c) ('0' <= (c) && (c) <= '9')
+#include "ansiesc.h"
+#include "iat.h"
+#include "stats.h"
+#include "trace.h"
 
 // ========== Auxiliary debug function
 
@@ -147,10 +163,6 @@ void DEBUGSTR( LPTSTR szFormat, ... )	// sort of OutputDebugStringf
 
 // ========== Global variables and constants
 
-// Macro for adding pointers/DWORDs together without C arithmetic interfering
-#define MakePtr( cast, ptr, addValue ) (cast)((DWORD_PTR)(ptr)+(DWORD)(addValue))
-
-
 const char APIKernel[]		   = "kernel32.dll";
 const char APIKernelBase[]	   = "kernelbase.dll";
 const char APIConsole[] 	   = "API-MS-Win-Core-Console-L1-1-0.dll";
@@ -173,61 +185,6 @@ PCSTR APIs[] =
 
 HMODULE   hKernel;		// Kernel32 module handle
 HINSTANCE hDllInstance; 	// Dll instance handle
-HANDLE	  hConOut;		// handle to CONOUT$
-
-#define ESC	'\x1B'	        // ESCape character
-
-#define MAX_ARG 16		// max number of args in an escape sequence
-int   state;			// automata state
-//TCHAR prefix; 		// escape sequence prefix ( '[' or '(' );
-TCHAR suffix;			// escape sequence suffix
-int   es_argc;			// escape sequence args count
-int   es_argv[MAX_ARG]; 	// escape sequence args
-
-// color constants
-
-#define FOREGROUND_BLACK 0
-#define FOREGROUND_WHITE FOREGROUND_RED|FOREGROUND_GREEN|FOREGROUND_BLUE
-
-#define BACKGROUND_BLACK 0
-#define BACKGROUND_WHITE BACKGROUND_RED|BACKGROUND_GREEN|BACKGROUND_BLUE
-
-WORD foregroundcolor[8] =
-{
-  FOREGROUND_BLACK,			// black foreground
-  FOREGROUND_RED,			// red foreground
-  FOREGROUND_GREEN,			// green foreground
-  FOREGROUND_RED | FOREGROUND_GREEN,	// yellow foreground
-  FOREGROUND_BLUE,			// blue foreground
-  FOREGROUND_BLUE | FOREGROUND_RED,	// magenta foreground
-  FOREGROUND_BLUE | FOREGROUND_GREEN,	// cyan foreground
-  FOREGROUND_WHITE			// white foreground
-};
-
-WORD backgroundcolor[8] =
-{
-  BACKGROUND_BLACK,			// black background
-  BACKGROUND_RED,			// red background
-  BACKGROUND_GREEN,			// green background
-  BACKGROUND_RED | BACKGROUND_GREEN,	// yellow background
-  BACKGROUND_BLUE,			// blue background
-  BACKGROUND_BLUE | BACKGROUND_RED,	// magenta background
-  BACKGROUND_BLUE | BACKGROUND_GREEN,	// cyan background
-  BACKGROUND_WHITE,			// white background
-};
-
-
-// screen attributes
-WORD org_fg, org_bg, org_bold, org_ul;	// original attributes
-WORD foreground;
-WORD background;
-WORD bold;
-WORD underline;
-WORD rvideo	= 0;
-WORD concealed	= 0;
-
-// saved cursor position
-COORD SavePos = { 0, 0 };
 
 
 // ========== Hooking API functions
@@ -247,6 +204,67 @@ typedef struct
 
 HookFn Hooks[];
 
+// The addresses to replace (see iat.c): hooking replaces the original
+// functions (of kernel32 or an API set) with ours; restoring replaces ours
+// with kernel32's in its own table and the API set's in the others.
+AddrMap HookMap, RestoreKernel, RestoreAPI;
+BOOL	MapsMade;
+
+//-----------------------------------------------------------------------------
+//   MakeMaps
+// Fill the address maps from the hooks.
+// Return FALSE if a map is full (so nothing is hooked, rather than some).
+//-----------------------------------------------------------------------------
+
+BOOL MakeMaps( PHookFn Hooks )
+{
+  PHookFn hook;
+
+  for (hook = Hooks; hook->name; ++hook)
+  {
+    if (!AddrAdd( &HookMap, (ULONG_PTR)hook->oldfunc,
+			    (ULONG_PTR)hook->newfunc ) ||
+	!AddrAdd( &HookMap, (ULONG_PTR)hook->apifunc,
+			    (ULONG_PTR)hook->newfunc ) ||
+	!AddrAdd( &RestoreKernel, (ULONG_PTR)hook->newfunc,
+				  (ULONG_PTR)hook->oldfunc ) ||
+	!AddrAdd( &RestoreAPI, (ULONG_PTR)hook->newfunc,
+			       (ULONG_PTR)hook->apifunc ))
+    {
+      DEBUGSTR( TEXT("error: no room to hook %hs (ADDR_SLOTS)"), hook->name );
+      return FALSE;
+    }
+  }
+  MapsMade = TRUE;
+  return TRUE;
+}
+
+// VirtualProtect, without its calling convention.
+BOOL Protect( LPVOID addr, size_t size, DWORD prot, LPDWORD old )
+{
+  return VirtualProtect( addr, size, prot, old );
+}
+
+// Patch the import address table of one of the APIs.
+BOOL PatchTable( const ImportTable* it, LPVOID restore )
+{
+  const AddrMap* map;
+  int n;
+
+  map = (!*(BOOL*)restore) ? &HookMap
+	: (it->lib == 0)   ? &RestoreKernel
+			   : &RestoreAPI;
+  n = PatchImports( it, map, Protect );
+  if (n < 0)
+  {
+    DEBUGSTR( TEXT("error: %s(%d)"), TEXT(__FILE__), __LINE__ );
+    return FALSE;
+  }
+  if (n > 0)
+    DEBUGSTR( TEXT("  %d from %hs"), n, it->name );
+  return TRUE;
+}
+
 //-----------------------------------------------------------------------------
 //   HookAPIOneMod
 // Substitute a new function in the Import Address Table (IAT) of the
@@ -260,116 +278,19 @@ BOOL HookAPIOneMod(
     BOOL    restore		// Restore the original functions
     )
 {
-  PIMAGE_DOS_HEADER	   pDosHeader;
-  PIMAGE_NT_HEADERS	   pNTHeader;
-  PIMAGE_IMPORT_DESCRIPTOR pImportDesc;
-  PIMAGE_THUNK_DATA	   pThunk;
-  PHookFn		   hook;
-
-  // Tests to make sure we're looking at a module image (the 'MZ' header)
-  pDosHeader = (PIMAGE_DOS_HEADER)hFromModule;
-  if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE)
-  {
-    DEBUGSTR( TEXT("error: %s(%d)"), TEXT(__FILE__), __LINE__ );
+  if (!MapsMade && !MakeMaps( Hooks ))
     return FALSE;
-  }
-
-  // The MZ header has a pointer to the PE header
-  pNTHeader = MakePtr( PIMAGE_NT_HEADERS, pDosHeader, pDosHeader->e_lfanew );
 
-  // One more test to make sure we're looking at a "PE" image
-  if (pNTHeader->Signature != IMAGE_NT_SIGNATURE)
+  // Patch the tables of the APIs the module imports.
+  if (!ImportTables( hFromModule, APIs, PatchTable, &restore ))
   {
     DEBUGSTR( TEXT("error: %s(%d)"), TEXT(__FILE__), __LINE__ );
     return FALSE;
   }
-
-  // We now have a valid pointer to the module's PE header.
-  // Get a pointer to its imports section.
-  pImportDesc = MakePtr( PIMAGE_IMPORT_DESCRIPTOR,
-			 pDosHeader,
-			 pNTHeader->OptionalHeader.
-			  DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].
-			   VirtualAddress );
-
-  // Bail out if the RVA of the imports section is 0 (it doesn't exist)
-  if (pImportDesc == (PIMAGE_IMPORT_DESCRIPTOR)pDosHeader)
-  {
-    return TRUE;
-  }
-
-  // Iterate through the array of imported module descriptors, looking
-  // for the module whose name matches the pszFunctionModule parameter.
-  for (; pImportDesc->Name; pImportDesc++)
-  {
-    PCSTR* lib;
-    PSTR pszModName = MakePtr( PSTR, pDosHeader, pImportDesc->Name );
-    for (lib = APIs; *lib; ++lib)
-      if (stricmp( pszModName, *lib ) == 0)
-	break;
-    if (*lib == NULL)
-      continue;
-
-    // Get a pointer to the found module's import address table (IAT).
-    pThunk = MakePtr( PIMAGE_THUNK_DATA, pDosHeader, pImportDesc->FirstThunk );
-
-    // Blast through the table of import addresses, looking for the ones
-    // that match the original addresses.
-    while (pThunk->u1.Function)
-    {
-      for (hook = Hooks; hook->name; ++hook)
-      {
-	PROC patch = 0;
-	if (restore)
-	{
-	  if ((PROC)pThunk->u1.Function == hook->newfunc)
-	    patch = (lib == APIs) ? hook->oldfunc : hook->apifunc;
-	}
-	else if ((PROC)pThunk->u1.Function == hook->oldfunc ||
-		 (PROC)pThunk->u1.Function == hook->apifunc)
-	{
-	  patch = hook->newfunc;
-	}
-	if (patch)
-	{
-	  DWORD flOldProtect, flNewProtect, flDummy;
-	  MEMORY_BASIC_INFORMATION mbi;
-
-	  DEBUGSTR( TEXT("  %hs"), hook->name );
-	  // Get the current protection attributes.
-	  VirtualQuery( &pThunk->u1.Function, &mbi, sizeof(mbi) );
-	  // Take the access protection flags.
-	  flNewProtect = mbi.Protect;
-	  // Remove ReadOnly and ExecuteRead flags.
-	  flNewProtect &= ~(PAGE_READONLY | PAGE_EXECUTE_READ);
-	  // Add on ReadWrite flag
-	  flNewProtect |= (PAGE_READWRITE);
-	  // Change the access protection on the region of committed pages in the
-	  // virtual address space of the current process.
-	  VirtualProtect( &pThunk->u1.Function, sizeof(PVOID),
-			  flNewProtect, &flOldProtect );
-
-	  // Overwrite the original address with the address of the new function.
-	  if (!WriteProcessMemory( GetCurrentProcess(),
-				   &pThunk->u1.Function,
-				   &patch, sizeof(patch), NULL ))
-	  {
-	    DEBUGSTR( TEXT("error: %s(%d)"), TEXT(__FILE__), __LINE__ );
-	    return FALSE;
-	  }
-
-	  // Put the page attributes back the way they were.
-	  VirtualProtect( &pThunk->u1.Function, sizeof(PVOID),
-			  flOldProtect, &flDummy );
-	}
-      }
-      pThunk++; // Advance to next imported function address
-    }
-  }
-
-  return TRUE;	// Function not found
+  return TRUE;
 }
 
+
 //-----------------------------------------------------------------------------
 //   HookAPIAllMod
 // Substitute a new function in the Import Address Table (IAT) of all
@@ -417,461 +338,6 @@ BOOL HookAPIAllMod( PHookFn Hooks, BOOL restore )
   return TRUE;
 }
 
-// ========== Print Buffer functions
-
-#define BUFFER_SIZE 256
-
-int   nCharInBuffer = 0;
-TCHAR ChBuffer[BUFFER_SIZE];
-
-//-----------------------------------------------------------------------------
-//   FlushBuffer()
-// Writes the buffer to the console and empties it.
-//-----------------------------------------------------------------------------
-
-void FlushBuffer( void )
-{
-  DWORD nWritten;
-  if (nCharInBuffer <= 0) return;
-  WriteConsole( hConOut, ChBuffer, nCharInBuffer, &nWritten, NULL );
-  nCharInBuffer = 0;
-}
-
-//-----------------------------------------------------------------------------
-//   PushBuffer( char c )
-// Adds a character in the buffer and flushes the buffer if it is full.
-//-----------------------------------------------------------------------------
-
-void PushBuffer( TCHAR c )
-{
-  ChBuffer[nCharInBuffer++] = c;
-  if (nCharInBuffer >= BUFFER_SIZE)
-  {
-    FlushBuffer();
-    DEBUGSTR( TEXT("flush") );
-  }
-}
-
-// ========== Print functions
-
-//-----------------------------------------------------------------------------
-//   InterpretEscSeq()
-// Interprets the last escape sequence scanned by ParseAndPrintString
-//   prefix             escape sequence prefix
-//   es_argc            escape sequence args count
-//   es_argv[]          escape sequence args array
-//   suffix             escape sequence suffix
-//
-// for instance, with \e[33;45;1m we have
-// prefix = '[',
-// es_argc = 3, es_argv[0] = 33, es_argv[1] = 45, es_argv[2] = 1
-// suffix = 'm'
-//-----------------------------------------------------------------------------
-
-void InterpretEscSeq( void )
-{
-  int  i;
-  WORD attribut;
-  CONSOLE_SCREEN_BUFFER_INFO Info;
-  DWORD len, NumberOfCharsWritten;
-  COORD Pos;
-  SMALL_RECT Rect;
-  CHAR_INFO  CharInfo;
-
-  //if (prefix == '[')
-  {
-    GetConsoleScreenBufferInfo( hConOut, &Info );
-    switch (suffix)
-    {
-      case 'm':
-	if (es_argc == 0) es_argv[es_argc++] = 0;
-	for (i = 0; i < es_argc; i++)
-	{
-	  switch (es_argv[i])
-	  {
-	    case 0:
-	      foreground = org_fg;
-	      background = org_bg;
-	      bold	 = (es_argc == 1) ? org_bold : 0;
-	      underline  = (es_argc == 1) ? org_ul   : 0;
-	      rvideo	 = 0;
-	      concealed  = 0;
-	    break;
-	    case  1: bold      = FOREGROUND_INTENSITY; break;
-	    case  5: /* blink */
-	    case  4: underline = BACKGROUND_INTENSITY; break;
-	    case  7: rvideo    = 1; break;
-	    case  8: concealed = 1; break;
-	    case 21: bold      = 0; break;
-	    case 25:
-	    case 24: underline = 0; break;
-	    case 27: rvideo    = 0; break;
-	    case 28: concealed = 0; break;
-	  }
-	  if (30 <= es_argv[i] && es_argv[i] <= 37) foreground = es_argv[i]-30;
-	  if (40 <= es_argv[i] && es_argv[i] <= 47) background = es_argv[i]-40;
-	}
-	if (concealed)
-	{
-	  if (rvideo)
-	  {
-	    attribut = foregroundcolor[foreground]
-		     | backgroundcolor[foreground];
-	    if (bold)
-	      attribut |= FOREGROUND_INTENSITY | BACKGROUND_INTENSITY;
-	  }
-	  else
-	  {
-	    attribut = foregroundcolor[background]
-		     | backgroundcolor[background];
-	    if (underline)
-	      attribut |= FOREGROUND_INTENSITY | BACKGROUND_INTENSITY;
-	  }
-	}
-	else if (rvideo)
-	{
-	  attribut = foregroundcolor[background] | backgroundcolor[foreground];
-	  if (bold)
-	    attribut |= BACKGROUND_INTENSITY;
-	  if (underline)
-	    attribut |= FOREGROUND_INTENSITY;
-	}
-	else
-	  attribut = foregroundcolor[foreground] | backgroundcolor[background]
-		   | bold | underline;
-	SetConsoleTextAttribute( hConOut, attribut );
-      return;
-
-      case 'J':
-	if (es_argc == 0) es_argv[es_argc++] = 0; // ESC[J == ESC[0J
-	if (es_argc != 1) return;
-	switch (es_argv[0])
-	{
-	  case 0:		// ESC[0J erase from cursor to end of display
-	    len = (Info.dwSize.Y - Info.dwCursorPosition.Y - 1) * Info.dwSize.X
-		  + Info.dwSize.X - Info.dwCursorPosition.X - 1;
-	    FillConsoleOutputCharacter( hConOut, ' ', len,
-					Info.dwCursorPosition,
-					&NumberOfCharsWritten );
-	    FillConsoleOutputAttribute( hConOut, Info.wAttributes, len,
-					Info.dwCursorPosition,
-					&NumberOfCharsWritten );
-	  return;
-
-	  case 1:		// ESC[1J erase from start to cursor.
-	    Pos.X = 0;
-	    Pos.Y = 0;
-	    len   = Info.dwCursorPosition.Y * Info.dwSize.X
-		    + Info.dwCursorPosition.X + 1;
-	    FillConsoleOutputCharacter( hConOut, ' ', len, Pos,
-					&NumberOfCharsWritten );
-	    FillConsoleOutputAttribute( hConOut, Info.wAttributes, len, Pos,
-					&NumberOfCharsWritten );
-	    return;
-
-	  case 2:		// ESC[2J Clear screen and home cursor
-	    Pos.X = 0;
-	    Pos.Y = 0;
-	    len   = Info.dwSize.X * Info.dwSize.Y;
-	    FillConsoleOutputCharacter( hConOut, ' ', len, Pos,
-					&NumberOfCharsWritten );
-	    FillConsoleOutputAttribute( hConOut, Info.wAttributes, len, Pos,
-					&NumberOfCharsWritten );
-	    SetConsoleCursorPosition( hConOut, Pos );
-	  return;
-
-	  default:
-	  return;
-	}
-
-      case 'K':
-	if (es_argc == 0) es_argv[es_argc++] = 0; // ESC[K == ESC[0K
-	if (es_argc != 1) return;
-	switch (es_argv[0])
-	{
-	  case 0:		// ESC[0K Clear to end of line
-	    len = Info.srWindow.Right - Info.dwCursorPosition.X + 1;
-	    FillConsoleOutputCharacter( hConOut, ' ', len,
-					Info.dwCursorPosition,
-					&NumberOfCharsWritten );
-	    FillConsoleOutputAttribute( hConOut, Info.wAttributes, len,
-					Info.dwCursorPosition,
-					&NumberOfCharsWritten );
-	  return;
-
-	  case 1:		// ESC[1K Clear from start of line to cursor
-	    Pos.X = 0;
-	    Pos.Y = Info.dwCursorPosition.Y;
-	    FillConsoleOutputCharacter( hConOut, ' ',
-					Info.dwCursorPosition.X + 1, Pos,
-					&NumberOfCharsWritten );
-	    FillConsoleOutputAttribute( hConOut, Info.wAttributes,
-					Info.dwCursorPosition.X + 1, Pos,
-					&NumberOfCharsWritten );
-	  return;
-
-	  case 2:		// ESC[2K Clear whole line.
-	    Pos.X = 0;
-	    Pos.Y = Info.dwCursorPosition.Y;
-	    FillConsoleOutputCharacter( hConOut, ' ', Info.dwSize.X, Pos,
-					&NumberOfCharsWritten );
-	    FillConsoleOutputAttribute( hConOut, Info.wAttributes,
-					Info.dwSize.X, Pos,
-					&NumberOfCharsWritten );
-	  return;
-
-	  default:
-	  return;
-	}
-
-      case 'L':                 // ESC[#L Insert # blank lines.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[L == ESC[1L
-	if (es_argc != 1) return;
-	Rect.Left   = 0;
-	Rect.Top    = Info.dwCursorPosition.Y;
-	Rect.Right  = Info.dwSize.X - 1;
-	Rect.Bottom = Info.dwSize.Y - 1;
-	Pos.X = 0;
-	Pos.Y = Info.dwCursorPosition.Y + es_argv[0];
-	CharInfo.Char.UnicodeChar = ' ';
-	CharInfo.Attributes = Info.wAttributes;
-	ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
-      return;
-
-      case 'M':                 // ESC[#M Delete # lines.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[M == ESC[1M
-	if (es_argc != 1) return;
-	if (es_argv[0] > Info.dwSize.Y - Info.dwCursorPosition.Y)
-	  es_argv[0] = Info.dwSize.Y - Info.dwCursorPosition.Y;
-	Rect.Left   = 0;
-	Rect.Top    = Info.dwCursorPosition.Y + es_argv[0];
-	Rect.Right  = Info.dwSize.X - 1;
-	Rect.Bottom = Info.dwSize.Y - 1;
-	Pos.X = 0;
-	Pos.Y = Info.dwCursorPosition.Y;
-	CharInfo.Char.UnicodeChar = ' ';
-	CharInfo.Attributes = Info.wAttributes;
-	ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
-      return;
-
-      case 'P':                 // ESC[#P Delete # characters.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[P == ESC[1P
-	if (es_argc != 1) return;
-	if (Info.dwCursorPosition.X + es_argv[0] > Info.dwSize.X - 1)
-	  es_argv[0] = Info.dwSize.X - Info.dwCursorPosition.X;
-	Rect.Left   = Info.dwCursorPosition.X + es_argv[0];
-	Rect.Top    = Info.dwCursorPosition.Y;
-	Rect.Right  = Info.dwSize.X - 1;
-	Rect.Bottom = Info.dwCursorPosition.Y;
-	CharInfo.Char.UnicodeChar = ' ';
-	CharInfo.Attributes = Info.wAttributes;
-	ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Info.dwCursorPosition,
-				   &CharInfo );
-      return;
-
-      case '@':                 // ESC[#@ Insert # blank characters.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[@ == ESC[1@
-	if (es_argc != 1) return;
-	if (Info.dwCursorPosition.X + es_argv[0] > Info.dwSize.X - 1)
-	  es_argv[0] = Info.dwSize.X - Info.dwCursorPosition.X;
-	Rect.Left   = Info.dwCursorPosition.X;
-	Rect.Top    = Info.dwCursorPosition.Y;
-	Rect.Right  = Info.dwSize.X - 1 - es_argv[0];
-	Rect.Bottom = Info.dwCursorPosition.Y;
-	Pos.X = Info.dwCursorPosition.X + es_argv[0];
-	Pos.Y = Info.dwCursorPosition.Y;
-	CharInfo.Char.UnicodeChar = ' ';
-	CharInfo.Attributes = Info.wAttributes;
-	ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
-      return;
-
-      case 'A':                 // ESC[#A Moves cursor up # lines
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[A == ESC[1A
-	if (es_argc != 1) return;
-	Pos.Y = Info.dwCursorPosition.Y - es_argv[0];
-	if (Pos.Y < 0) Pos.Y = 0;
-	Pos.X = Info.dwCursorPosition.X;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'B':                 // ESC[#B Moves cursor down # lines
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[B == ESC[1B
-	if (es_argc != 1) return;
-	Pos.Y = Info.dwCursorPosition.Y + es_argv[0];
-	if (Pos.Y >= Info.dwSize.Y) Pos.Y = Info.dwSize.Y - 1;
-	Pos.X = Info.dwCursorPosition.X;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'C':                 // ESC[#C Moves cursor forward # spaces
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[C == ESC[1C
-	if (es_argc != 1) return;
-	Pos.X = Info.dwCursorPosition.X + es_argv[0];
-	if (Pos.X >= Info.dwSize.X) Pos.X = Info.dwSize.X - 1;
-	Pos.Y = Info.dwCursorPosition.Y;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'D':                 // ESC[#D Moves cursor back # spaces
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[D == ESC[1D
-	if (es_argc != 1) return;
-	Pos.X = Info.dwCursorPosition.X - es_argv[0];
-	if (Pos.X < 0) Pos.X = 0;
-	Pos.Y = Info.dwCursorPosition.Y;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'E':                 // ESC[#E Moves cursor down # lines, column 1.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[E == ESC[1E
-	if (es_argc != 1) return;
-	Pos.Y = Info.dwCursorPosition.Y + es_argv[0];
-	if (Pos.Y >= Info.dwSize.Y) Pos.Y = Info.dwSize.Y - 1;
-	Pos.X = 0;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'F':                 // ESC[#F Moves cursor up # lines, column 1.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[F == ESC[1F
-	if (es_argc != 1) return;
-	Pos.Y = Info.dwCursorPosition.Y - es_argv[0];
-	if (Pos.Y < 0) Pos.Y = 0;
-	Pos.X = 0;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'G':                 // ESC[#G Moves cursor column # in current row.
-	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[G == ESC[1G
-	if (es_argc != 1) return;
-	Pos.X = es_argv[0] - 1;
-	if (Pos.X >= Info.dwSize.X) Pos.X = Info.dwSize.X - 1;
-	if (Pos.X < 0) Pos.X = 0;
-	Pos.Y = Info.dwCursorPosition.Y;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 'f':                 // ESC[#;#f
-      case 'H':                 // ESC[#;#H Moves cursor to line #, column #
-	if (es_argc == 0)
-	  es_argv[es_argc++] = 1; // ESC[H == ESC[1;1H
-	if (es_argc == 1)
-	  es_argv[es_argc++] = 1; // ESC[#H == ESC[#;1H
-	if (es_argc > 2) return;
-	Pos.X = es_argv[1] - 1;
-	if (Pos.X < 0) Pos.X = 0;
-	if (Pos.X >= Info.dwSize.X) Pos.X = Info.dwSize.X - 1;
-	Pos.Y = es_argv[0] - 1;
-	if (Pos.Y < 0) Pos.Y = 0;
-	if (Pos.Y >= Info.dwSize.Y) Pos.Y = Info.dwSize.Y - 1;
-	SetConsoleCursorPosition( hConOut, Pos );
-      return;
-
-      case 's':                 // ESC[s Saves cursor position for recall later
-	if (es_argc != 0) return;
-	SavePos = Info.dwCursorPosition;
-      return;
-
-      case 'u':                 // ESC[u Return to saved cursor position
-	if (es_argc != 0) return;
-	SetConsoleCursorPosition( hConOut, SavePos );
-      return;
-
-      default:
-      return;
-    }
-  }
-}
-
-
-//-----------------------------------------------------------------------------
-//   ParseAndPrintString(hDev, lpBuffer, nNumberOfBytesToWrite)
-// Parses the string lpBuffer, interprets the escapes sequences and prints the
-// characters in the device hDev (console).
-// The lexer is a three states automata.
-// If the number of arguments es_argc > MAX_ARG, only the MAX_ARG-1 firsts and
-// the last arguments are processed (no es_argv[] overflow).
-//-----------------------------------------------------------------------------
-
-BOOL
-ParseAndPrintString( HANDLE hDev,
-		     LPCVOID lpBuffer,
-		     DWORD nNumberOfBytesToWrite,
-		     LPDWORD lpNumberOfBytesWritten
-		     )
-{
-  DWORD  i;
-  LPTSTR s;
-
-  if (hDev != hConOut)	// reinit if device has changed
-  {
-    hConOut = hDev;
-    state = 1;
-  }
-  for (i = nNumberOfBytesToWrite, s = (LPTSTR)lpBuffer; i > 0; i--, s++)
-  {
-    if (state == 1)
-    {
-      if (*s == ESC) state = 2;
-      else PushBuffer( *s );
-    }
-    else if (state == 2)
-    {
-      if (*s == ESC) ;	// \e\e...\e == \e
-      else if ((*s == '[')) // || (*s == '('))
-      {
-	FlushBuffer();
-	//prefix = *s;
-	state = 3;
-      }
-      else state = 1;
-    }
-    else if (state == 3)
-    {
-      if (isdigit( *s ))
-      {
-        es_argc = 0;
-	es_argv[0] = *s - '0';
-        state = 4;
-      }
-      else if (*s == ';')
-      {
-        es_argc = 1;
-        es_argv[0] = 0;
-	es_argv[1] = 0;
-        state = 4;
-      }
-      else
-      {
-        es_argc = 0;
-        suffix = *s;
-        InterpretEscSeq();
-        state = 1;
-      }
-    }
-    else if (state == 4)
-    {
-      if (isdigit( *s ))
-      {
-	es_argv[es_argc] = 10 * es_argv[es_argc] + (*s - '0');
-      }
-      else if (*s == ';')
-      {
-        if (es_argc < MAX_ARG-1) es_argc++;
-        es_argv[es_argc] = 0;
-      }
-      else
-      {
-	es_argc++;
-        suffix = *s;
-        InterpretEscSeq();
-        state = 1;
-      }
-    }
-  }
-  FlushBuffer();
-  *lpNumberOfBytesWritten = nNumberOfBytesToWrite - i;
-  return( i == 0 );
-}
-
 
 // ========== Child process injection
 
@@ -978,6 +444,7 @@ BOOL WINAPI MyCreateProcessA( LPCSTR lpApplicationName,
 {
   PROCESS_INFORMATION pi;
 
+  FlushBuffer();
   if (!CreateProcessA( lpApplicationName,
 		       lpCommandLine,
 		       lpThreadAttributes,
@@ -994,6 +461,7 @@ BOOL WINAPI MyCreateProcessA( LPCSTR lpApplicationName,
 	    (lpApplicationName == NULL) ? "" : lpApplicationName,
 	    (lpCommandLine == NULL) ? "" : lpCommandLine );
   Inject( &pi, lpProcessInformation, dwCreationFlags );
+  InvalidateInfo();	// the child may write to the console
 
   return TRUE;
 }
@@ -1012,6 +480,7 @@ BOOL WINAPI MyCreateProcessW( LPCWSTR lpApplicationName,
 {
   PROCESS_INFORMATION pi;
 
+  FlushBuffer();
   if (!CreateProcessW( lpApplicationName,
 		       lpCommandLine,
 		       lpThreadAttributes,
@@ -1028,6 +497,7 @@ BOOL WINAPI MyCreateProcessW( LPCWSTR lpApplicationName,
 	    (lpApplicationName == NULL) ? L"" : lpApplicationName,
 	    (lpCommandLine == NULL) ? L"" : lpCommandLine );
   Inject( &pi, lpProcessInformation, dwCreationFlags );
+  InvalidateInfo();	// the child may write to the console
 
   return TRUE;
 }
@@ -1089,21 +559,33 @@ HMODULE WINAPI MyLoadLibraryExW( LPCWSTR lpFileName, HANDLE hFile,
 // This function have exactly the same signature as the original one.
 //-----------------------------------------------------------------------------
 
-BOOL
-WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
-			DWORD nNumberOfCharsToWrite,
-			LPDWORD lpNumberOfCharsWritten, LPVOID lpReserved )
+
+// WriteConsoleA and WriteFile to the console; type says which (for tracing).
+BOOL WriteNarrow( int type, HANDLE hCon, LPCVOID lpBuffer,
+		  DWORD nNumberOfCharsToWrite,
+		  LPDWORD lpNumberOfCharsWritten, LPVOID lpReserved )
 {
   DWORD  Mode;
   LPWSTR buf;
   DWORD  len;
   BOOL	 rc = TRUE;
+  const SbcsMap* map;
 
   // if we write in a console buffer with processed output
   if (GetConsoleMode( hCon, &Mode ) && (Mode & ENABLE_PROCESSED_OUTPUT))
   {
     UINT cp = GetConsoleOutputCP();
     DEBUGSTR( TEXT("\\WriteConsoleA: %lu \"%.*hs\""), nNumberOfCharsToWrite, nNumberOfCharsToWrite, lpBuffer );
+    STAT_WRITE( nNumberOfCharsToWrite );
+    if (Tracing)
+      TraceWrite( type, hCon, cp, lpBuffer, nNumberOfCharsToWrite );
+    if (cp == CP_UTF8)
+      return ParseAndPrintUtf8( hCon, lpBuffer, nNumberOfCharsToWrite,
+				lpNumberOfCharsWritten );
+    map = CodePageMap( cp );
+    if (map != NULL)
+      return ParseAndPrintSbcs( hCon, map, lpBuffer, nNumberOfCharsToWrite,
+				lpNumberOfCharsWritten );
     len = MultiByteToWideChar( cp, 0, lpBuffer, nNumberOfCharsToWrite, NULL, 0 );
     buf = malloc( len * sizeof(WCHAR) );
     if (buf == NULL)
@@ -1118,6 +600,8 @@ WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
   }
   else
   {
+    FlushBuffer();
+    InvalidateInfo();
     return WriteConsoleA( hCon, lpBuffer,
 			  nNumberOfCharsToWrite,
 			  lpNumberOfCharsWritten,
@@ -1125,6 +609,15 @@ WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
   }
 }
 
+BOOL
+WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
+			DWORD nNumberOfCharsToWrite,
+			LPDWORD lpNumberOfCharsWritten, LPVOID lpReserved )
+{
+  return WriteNarrow( TRACE_A, hCon, lpBuffer, nNumberOfCharsToWrite,
+		      lpNumberOfCharsWritten, lpReserved );
+}
+
 BOOL
 WINAPI MyWriteConsoleW( HANDLE hCon, LPCVOID lpBuffer,
 			DWORD nNumberOfCharsToWrite,
@@ -1134,12 +627,18 @@ WINAPI MyWriteConsoleW( HANDLE hCon, LPCVOID lpBuffer,
   if (GetConsoleMode( hCon, &Mode ) && (Mode & ENABLE_PROCESSED_OUTPUT))
   {
     DEBUGSTR( TEXT("\\WriteConsoleW: %lu \"%.*ls\""), nNumberOfCharsToWrite, nNumberOfCharsToWrite, lpBuffer );
+    STAT_WRITE( nNumberOfCharsToWrite );
+    if (Tracing)
+      TraceWrite( TRACE_W, hCon, 0, lpBuffer,
+		  nNumberOfCharsToWrite * sizeof(WCHAR) );
     return ParseAndPrintString( hCon, lpBuffer,
 				nNumberOfCharsToWrite,
 				lpNumberOfCharsWritten );
   }
   else
   {
+    FlushBuffer();
+    InvalidateInfo();
     return WriteConsoleW( hCon, lpBuffer,
 			  nNumberOfCharsToWrite,
 			  lpNumberOfCharsWritten,
@@ -1155,10 +654,10 @@ WINAPI MyWriteFile( HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
   if (GetConsoleMode( hFile, &Mode ) && (Mode & ENABLE_PROCESSED_OUTPUT))
   {
     DEBUGSTR( TEXT("\\WriteFile: %lu \"%.*hs\""), nNumberOfBytesToWrite, nNumberOfBytesToWrite, lpBuffer );
-    return MyWriteConsoleA( hFile, lpBuffer,
-			    nNumberOfBytesToWrite,
-			    lpNumberOfBytesWritten,
-			    lpOverlapped );
+    return WriteNarrow( TRACE_FILE, hFile, lpBuffer,
+			nNumberOfBytesToWrite,
+			lpNumberOfBytesWritten,
+			lpOverlapped );
   }
   else	    // here, WriteFile is the old function (this module is not hooked)
   {
@@ -1170,6 +669,111 @@ WINAPI MyWriteFile( HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
 }
 
 
+//-----------------------------------------------------------------------------
+//   MySetConsole..., MyRead..., MyExitProcess
+// Functions that move the cursor, change the attribute or resize the console
+// behind the interpreter's back, so its buffer must be written first and its
+// shadow of the console must be read again.  Reading echoes the input.  The
+// mode and exiting only need the buffer (and any queued writes) written.
+//-----------------------------------------------------------------------------
+
+BOOL
+WINAPI MySetConsoleCursorPosition( HANDLE hCon, COORD dwCursorPosition )
+{
+  FlushBuffer();
+  InvalidateInfo();
+  return SetConsoleCursorPosition( hCon, dwCursorPosition );
+}
+
+BOOL
+WINAPI MySetConsoleTextAttribute( HANDLE hCon, WORD wAttributes )
+{
+  FlushBuffer();
+  InvalidateInfo();
+  return SetConsoleTextAttribute( hCon, wAttributes );
+}
+
+BOOL
+WINAPI MySetConsoleScreenBufferSize( HANDLE hCon, COORD dwSize )
+{
+  FlushBuffer();
+  InvalidateInfo();
+  return SetConsoleScreenBufferSize( hCon, dwSize );
+}
+
+BOOL
+WINAPI MySetConsoleWindowInfo( HANDLE hCon, BOOL bAbsolute,
+			       CONST SMALL_RECT* lpConsoleWindow )
+{
+  FlushBuffer();
+  InvalidateInfo();
+  return SetConsoleWindowInfo( hCon, bAbsolute, lpConsoleWindow );
+}
+
+BOOL
+WINAPI MySetConsoleMode( HANDLE hCon, DWORD dwMode )
+{
+  FlushBuffer();
+  return SetConsoleMode( hCon, dwMode );
+}
+
+BOOL
+WINAPI MyGetConsoleScreenBufferInfo( HANDLE hCon,
+				     PCONSOLE_SCREEN_BUFFER_INFO lpInfo )
+{
+  FlushBuffer();
+  return GetConsoleScreenBufferInfo( hCon, lpInfo );
+}
+
+BOOL
+WINAPI MyReadConsoleA( HANDLE hCon, LPVOID lpBuffer,
+		       DWORD nNumberOfCharsToRead,
+		       LPDWORD lpNumberOfCharsRead, LPVOID lpReserved )
+{
+  FlushBuffer();
+  InvalidateInfo();
+  return ReadConsoleA( hCon, lpBuffer, nNumberOfCharsToRead,
+		       lpNumberOfCharsRead, lpReserved );
+}
+
+BOOL
+WINAPI MyReadConsoleW( HANDLE hCon, LPVOID lpBuffer,
+		       DWORD nNumberOfCharsToRead,
+		       LPDWORD lpNumberOfCharsRead, LPVOID lpReserved )
+{
+  FlushBuffer();
+  InvalidateInfo();
+  return ReadConsoleW( hCon, lpBuffer, nNumberOfCharsToRead,
+		       lpNumberOfCharsRead, lpReserved );
+}
+
+BOOL
+WINAPI MyReadFile( HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead,
+		   LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped )
+{
+  DWORD Mode;
+
+  // Only a read of the console echoes (or moves the cursor); files, pipes
+  // and sockets are left alone.
+  if (GetFileType( hFile ) == FILE_TYPE_CHAR && GetConsoleMode( hFile, &Mode ))
+  {
+    if (OutputPending())
+      FlushBuffer();
+    InvalidateInfo();
+  }
+  return ReadFile( hFile, lpBuffer, nNumberOfBytesToRead,
+		   lpNumberOfBytesRead, lpOverlapped );
+}
+
+
+VOID
+WINAPI MyExitProcess( UINT uExitCode )
+{
+  FlushBuffer();	// the renderer won't outlive this
+  TraceFlush(); 	// nor will the trace's writer
+  ExitProcess( uExitCode );
+}
+
 // ========== Environment variable
 
 void set_ansicon( PCONSOLE_SCREEN_BUFFER_INFO pcsbi )
@@ -1226,6 +830,16 @@ HookFn Hooks[] = {
   { APIConsole, 	   "WriteConsoleA",           (PROC)MyWriteConsoleA,           NULL, NULL },
   { APIConsole, 	   "WriteConsoleW",           (PROC)MyWriteConsoleW,           NULL, NULL },
   { APIFile,		   "WriteFile",               (PROC)MyWriteFile,               NULL, NULL },
+  { APIConsole, 	   "ReadConsoleA",            (PROC)MyReadConsoleA,            NULL, NULL },
+  { APIConsole, 	   "ReadConsoleW",            (PROC)MyReadConsoleW,            NULL, NULL },
+  { APIFile,		   "ReadFile",                (PROC)MyReadFile,                NULL, NULL },
+  { APIKernel,		   "SetConsoleCursorPosition",   (PROC)MySetConsoleCursorPosition,   NULL, NULL },
+  { APIKernel,		   "SetConsoleTextAttribute",    (PROC)MySetConsoleTextAttribute,    NULL, NULL },
+  { APIKernel,		   "SetConsoleScreenBufferSize", (PROC)MySetConsoleScreenBufferSize, NULL, NULL },
+  { APIKernel,		   "SetConsoleWindowInfo",       (PROC)MySetConsoleWindowInfo,       NULL, NULL },
+  { APIKernel,		   "GetConsoleScreenBufferInfo", (PROC)MyGetConsoleScreenBufferInfo, NULL, NULL },
+  { APIConsole, 	   "SetConsoleMode",             (PROC)MySetConsoleMode,             NULL, NULL },
+  { APIProcessThreads,	   "ExitProcess",                (PROC)MyExitProcess,                NULL, NULL },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -1281,6 +895,8 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
 #endif
 
     hDllInstance = hInstance; // save Dll instance handle
+    Con = &WinCon;
+    StatInit();
     DEBUGSTR( TEXT("hDllInstance = %p"), hDllInstance );
 
     // Get the entry points to the original functions.
@@ -1293,14 +909,34 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
 	hook->apifunc = GetProcAddress( api, hook->name );
     }
 
-    bResult = HookAPIAllMod( Hooks, FALSE );
+    // The lock and settings must be ready before any thread can reach the
+    // hooks.
     OriginalAttr();
+    InitBuffer();
+    TraceInit();
+    bResult = HookAPIAllMod( Hooks, FALSE );
+    if (WriteBehind || Tracing)
+    {
+      // Never unload while a thread of ours may be running.
+      HMODULE self;
+      GetModuleHandleEx( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+			 GET_MODULE_HANDLE_EX_FLAG_PIN,
+			 (LPCTSTR)DllMain, &self );
+    }
     DisableThreadLibraryCalls( hInstance );
   }
-  else if (dwReason == DLL_PROCESS_DETACH && lpReserved == NULL)
+  else if (dwReason == DLL_PROCESS_DETACH)
   {
-    DEBUGSTR( TEXT("Unloading") );
-    HookAPIAllMod( Hooks, TRUE );
+    StopQueue();
+    FlushBuffer();
+    ResetPalette();
+    StatDump();
+    TraceStop();
+    if (lpReserved == NULL)
+    {
+      DEBUGSTR( TEXT("Unloading") );
+      HookAPIAllMod( Hooks, TRUE );
+    }
   }
 
   return( bResult );
@@ -0,0 +1,871 @@
+/*
+  ansibench.c - Measure the escape sequence interpreter.
+
+  Feed files through ParseAndPrintString, using the in-memory console, and
+  report the time taken and the console calls made.  The files are taken to
+  be UTF-8 and are written in blocks, as a program would write them; they are
+  decoded first, unless -c gives the code page to write them in, converting
+  each block as WriteConsoleA does (65001 is UTF-8; 28591, Latin-1, and
+  1252 are the only single-byte code pages without Windows).  Without
+  files, a suite of generated streams is used instead, resembling compiler
+  diagnostics, "ls --color", progress bars, a full-screen program (also with
+  synchronized output), a log scrolling between fixed rows, syntax
+  highlighting (in the basic colors and truecolor), a truecolor picture,
+  UTF-8 text and Windows-1252 text with stray bytes.  The last is checked
+  to have been printed to its end (run it with -c1252); a failure is shown
+  and makes the exit status 1.
+
+  A file recorded by ANSICON_TRACE (see trace.h) is replayed write by write,
+  as it was recorded, as fast as possible or, with -o, at its original
+  speed.  Every handle in it is written to the one console.
+
+  The console calls are also charged a cost, giving the time the output
+  would have taken on a real console ("sim ms", for one pass): each call
+  costs the microseconds given in CallCost, plus CellCost for each cell it
+  touched.  The costs may be changed with -kNAME=US, where NAME is the name
+  of the call (as listed) or "cell".
+
+  The ANSICON_BUFFER, ANSICON_FLUSH, ANSICON_RENDER, ANSICON_TITLE,
+  ANSICON_SYNC, ANSICON_WINDOW, ANSICON_PALETTE, ANSICON_ASYNC and
+  ANSICON_TRACE settings apply; with ANSICON_ASYNC, the time the writes
+  took to return is also shown.  -s counts and times the console calls (as
+  ANSICON_STATS would) and shows the totals at the end.
+
+  With -t, THREADS threads instead each write REPEAT thousand lines of their
+  own color, a line at a time, and the lines left on the screen are checked
+  for any that were torn apart by another thread.  The screen defaults to
+  the most lines a console allows, to keep as many of them as possible.
+
+  ansibench [-bBLOCK] [-nREPEAT] [-wWIDTH] [-hHEIGHT] [-cCP] [-kNAME=US]...
+	    [-s] [-o] [file...]
+  ansibench -tTHREADS [-nREPEAT] [-wWIDTH] [-hHEIGHT]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "ansiesc.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifdef _WIN32
+static double Now( void )
+{
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter( &c );
+  QueryPerformanceFrequency( &f );
+  return (double)c.QuadPart / f.QuadPart;
+}
+
+static void Pause( double s )
+{
+  Sleep( (DWORD)(s * 1e3) );
+}
+#else
+#include <time.h>
+static double Now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Pause( double s )
+{
+  struct timespec ts;
+  ts.tv_sec  = (time_t)s;
+  ts.tv_nsec = (long)((s - ts.tv_sec) * 1e9);
+  nanosleep( &ts, NULL );
+}
+#endif
+
+
+static const char* const CallName[MC_CALLS] =
+{
+  "Write", "WriteA", "WriteOutput", "FillChar", "FillAttr", "Scroll",
+  "SetCursor", "SetAttr", "GetInfo", "SetTitle", "ReadOutput", "SetVisible",
+  "GetPalette", "SetPalette"
+};
+
+// The cost model, in microseconds.  These are rough figures for conhost,
+// where every call is a round trip to another process.
+static double CallCost[MC_CALLS] =
+{
+  8, 8, 12, 6, 6, 15, 3, 2, 3, 40, 12, 6, 10, 60
+};
+static double CellCost = 0.02;
+
+// The settings of the replay.
+static DWORD   Block = 4096, Repeat = 10;
+static UINT    Cp;
+static SbcsMap Map;
+static BOOL    Original;	// replay traces at their original speed
+
+
+// ========== Corpora
+//
+// Streams generated to resemble what programs write, since recordings would
+// bloat the source.  The same pseudo-random sequence is used every time, so
+// the streams are always the same.
+
+#define CORPUS_SIZE (1024 * 1024)	// approximate size of each stream
+
+typedef struct
+{
+  char* s;
+  long	len, max;
+} Corpus;
+
+static unsigned Seed;
+
+static unsigned Rand( unsigned n )
+{
+  Seed = Seed * 1103515245 + 12345;
+  return (Seed >> 16) % n;
+}
+
+static void Add( Corpus* c, const char* fmt, ... )
+{
+  va_list args;
+  int	  n;
+
+  if (c->max - c->len < 1024)
+  {
+    c->max = (c->max == 0) ? CORPUS_SIZE + 4096 : c->max * 2;
+    c->s = realloc( c->s, c->max );
+    if (c->s == NULL)
+    {
+      fprintf( stderr, "ansibench: out of memory\n" );
+      exit( 1 );
+    }
+  }
+  va_start( args, fmt );
+  n = vsnprintf( c->s + c->len, c->max - c->len, fmt, args );
+  va_end( args );
+  c->len += n;
+}
+
+static const char* const Word[] =
+{
+  "buffer", "count", "index", "node", "value", "state", "handle", "result",
+  "length", "offset", "error", "table", "entry", "line", "attr", "cursor"
+};
+#define WORDS (sizeof(Word) / sizeof(*Word))
+
+// Warnings and errors from gcc, with the source line and caret.
+static void Compile( Corpus* c )
+{
+  static const char* const msg[][3] =
+  {
+    { "warning", "35", "unused variable" },
+    { "warning", "35", "implicit declaration of function" },
+    { "error",   "31", "unknown type name" },
+    { "note",    "36", "previous definition of" },
+  };
+  int m, line, col;
+
+  while (c->len < CORPUS_SIZE)
+  {
+    m = Rand( 4 );
+    line = 1 + Rand( 2000 );
+    col = 1 + Rand( 40 );
+    if (Rand( 8 ) == 0)
+      Add( c, "\33[01m\33[K%s.c:\33[m\33[K In function \xE2\x80\x98"
+	      "\33[01m\33[K%s\33[m\33[K\xE2\x80\x99:\n",
+	      Word[Rand( WORDS )], Word[Rand( WORDS )] );
+    Add( c, "\33[01m\33[K%s.c:%d:%d:\33[m\33[K \33[01;%sm\33[K%s:\33[m\33[K "
+	    "%s \xE2\x80\x98\33[01m\33[K%s\33[m\33[K\xE2\x80\x99\n",
+	    Word[Rand( WORDS )], line, col, msg[m][1], msg[m][0], msg[m][2],
+	    Word[Rand( WORDS )] );
+    Add( c, " %4d |   %s = %s( %s, %d );\n", line, Word[Rand( WORDS )],
+	    Word[Rand( WORDS )], Word[Rand( WORDS )], Rand( 100 ) );
+    Add( c, "      | %*s\33[01;%sm\33[K^~~~~~\33[m\33[K\n",
+	    col, "", msg[m][1] );
+  }
+}
+
+// Directory listings, in columns, colored by type.
+static void Ls( Corpus* c )
+{
+  static const char* const color[] =
+  {
+    NULL, NULL, NULL, "01;34", "01;32", "01;36", "01;31", "01;35"
+  };
+  static const char* const ext[] =
+  {
+    ".c", ".h", ".txt", "", "", "", ".tar.gz", ".png"
+  };
+  char name[32];
+  int  i, t, n;
+
+  while (c->len < CORPUS_SIZE)
+  {
+    for (i = 0; i < 4; ++i)
+    {
+      t = Rand( 8 );
+      n = sprintf( name, "%s_%s%s", Word[Rand( WORDS )], Word[Rand( WORDS )],
+		   ext[t] );
+      if (color[t])
+	Add( c, "\33[0m\33[%sm%s\33[0m", color[t], name );
+      else
+	Add( c, "%s", name );
+      if (i < 3)
+	Add( c, "%*s", 20 - n, "" );
+    }
+    Add( c, "\n" );
+  }
+}
+
+// Downloads, each redrawing its progress bar over itself and showing it in
+// the title.
+static void Progress( Corpus* c )
+{
+  int p, bar;
+
+  while (c->len < CORPUS_SIZE)
+  {
+    for (p = 0; p <= 100; p += 1 + Rand( 3 ))
+    {
+      bar = p * 30 / 100;
+      Add( c, "\33]0;%d%% downloaded\a", p );
+      Add( c, "\r%-16.16s %3d%% [\33[32m%.*s\33[0m%*s] %5.1f MB/s",
+	   Word[Rand( WORDS )], p, bar, "##############################",
+	   30 - bar, "", Rand( 1000 ) / 10.0 );
+    }
+    Add( c, "\n" );
+  }
+}
+
+// A full-screen program (like top), updating some rows of each frame; with
+// sync, each frame is synchronized output, drawn with the cursor hidden.
+static void Frames( Corpus* c, int sync )
+{
+  int frame, row, i;
+
+  for (frame = 0; c->len < CORPUS_SIZE; ++frame)
+  {
+    if (sync)
+      Add( c, "\33[?2026h\33[?25l" );
+    if (frame % 50 == 0)
+      Add( c, "\33[0m\33[2J" );
+    Add( c, "\33[1;1H\33[7m %-20s load %d.%02d  frame %-8d%*s\33[0m",
+	 Word[Rand( WORDS )], Rand( 8 ), Rand( 100 ), frame, 30, "" );
+    for (i = 0; i < 6; ++i)
+    {
+      row = 3 + Rand( 21 );
+      Add( c, "\33[%d;1H\33[1;3%dm%5d\33[0m %-10s \33[3%dm%5.1f%%\33[0m"
+	      " %-12s\33[K", row, 1 + Rand( 7 ), Rand( 65536 ),
+	   Word[Rand( WORDS )], 1 + Rand( 7 ), Rand( 1000 ) / 10.0,
+	   Word[Rand( WORDS )] );
+    }
+    Add( c, "\33[25;1H\33[44;37m F1 Help  F10 Quit \33[0m\33[K" );
+    if (sync)
+      Add( c, "\33[?25h\33[?2026l" );
+  }
+}
+
+static void Tui( Corpus* c )
+{
+  Frames( c, 0 );
+}
+
+static void Sync( Corpus* c )
+{
+  Frames( c, 1 );
+}
+
+// Text in several scripts (including wide CJK), with the odd colored word.
+static void Utf8( Corpus* c )
+{
+  static const char* const text[] =
+  {
+    "\xCE\x97 \xCE\xB3\xCF\x81\xCE\xAE\xCE\xB3\xCE\xBF\xCF\x81\xCE\xB7 "
+    "\xCE\xB1\xCE\xBB\xCE\xB5\xCF\x80\xCE\xBF\xCF\x8D",
+    "\xD0\xA1\xD1\x8A\xD0\xB5\xD1\x88\xD1\x8C \xD0\xB6\xD0\xB5 "
+    "\xD0\xB5\xD1\x89\xD1\x91 \xD1\x8D\xD1\x82\xD0\xB8\xD1\x85",
+    "\xE3\x81\x84\xE3\x82\x8D\xE3\x81\xAF\xE3\x81\xAB\xE3\x81\xBB"
+    "\xE3\x81\xB8\xE3\x81\xA8",
+    "\xE5\xA4\xA9\xE5\x9C\xB0\xE7\x8E\x84\xE9\xBB\x84",
+    "voix ambigu\xC3\xAB d\xE2\x80\x99un c\xC5\x93ur",
+    "\xE2\x94\x8C\xE2\x94\x80\xE2\x94\x80\xE2\x94\x90 \xE2\x9C\x93 "
+    "\xE2\x98\x85",
+  };
+  int i, n;
+
+  while (c->len < CORPUS_SIZE)
+  {
+    n = 2 + Rand( 3 );
+    for (i = 0; i < n; ++i)
+    {
+      if (Rand( 6 ) == 0)
+	Add( c, "\33[3%dm%s\33[m ", 1 + Rand( 7 ), text[Rand( 6 )] );
+      else
+	Add( c, "%s ", text[Rand( 6 )] );
+    }
+    Add( c, "\n" );
+  }
+}
+
+// Syntax highlighted source (like bat), in truecolor or (to compare) the
+// basic colors, with every other changed line on a colored background (like
+// delta).
+static void Highlight( Corpus* c, int rgb )
+{
+  static const struct
+  {
+    const char* basic;
+    const char* truecolor;
+  } theme[] =
+  {
+    { "35", "38;2;249;38;114"  },	// keyword
+    { "33", "38;2;230;219;116" },	// string
+    { "36", "38;2;102;217;239" },	// type
+    { "32", "38;2;166;226;46"  },	// function
+    { "34", "38;2;117;113;94"  },	// comment
+    { "31", "38;2;174;129;255" },	// number
+    { "37", "38;2;248;248;242" },	// plain
+  };
+  int line, i, t;
+
+  for (line = 1; c->len < CORPUS_SIZE; ++line)
+  {
+    Add( c, "\33[%sm%4d\33[0m ", rgb ? "38;5;238" : "30;1", line );
+    if (line % 8 == 0)
+      Add( c, "\33[%sm", rgb ? "48;2;63;0;1" : "41" );
+    for (i = 3 + Rand( 6 ); i > 0; --i)
+    {
+      t = Rand( 7 );
+      Add( c, "\33[%sm%s ", rgb ? theme[t].truecolor : theme[t].basic,
+	   Word[Rand( WORDS )] );
+    }
+    Add( c, "\33[0m\n" );
+  }
+}
+
+static void Code( Corpus* c )
+{
+  Highlight( c, 0 );
+}
+
+static void Rgb( Corpus* c )
+{
+  Highlight( c, 1 );
+}
+
+// A picture drawn in half blocks, each with an RGB foreground (the top half)
+// and background (the bottom), as image viewers draw them: a gradient of 64
+// colors, moving each frame.
+static void Image( Corpus* c )
+{
+  int frame, x, y;
+
+  for (frame = 0; c->len < CORPUS_SIZE; ++frame)
+  {
+    for (y = 0; y < 24; ++y)
+    {
+      Add( c, "\33[%d;1H", y + 1 );
+      for (x = 0; x < 80; ++x)
+	Add( c, "\33[38;2;%d;%d;%d;48;2;%d;%d;%dm\xE2\x96\x80",
+	     (x + frame) / 10 % 8 * 36, y * 2 / 6 * 36, 128,
+	     (x + frame) / 10 % 8 * 36, (y * 2 + 1) / 6 * 36, 128 );
+    }
+    Add( c, "\33[0m" );
+  }
+}
+
+// A log tailer, scrolling its lines between a header and footer kept by the
+// scrolling margins, updating them every so often.
+static void Pane( Corpus* c )
+{
+  int line;
+
+  Add( c, "\33[2J\33[2;24r\33[24;1H" );
+  for (line = 0; c->len < CORPUS_SIZE; ++line)
+  {
+    if (line % 20 == 0)
+      Add( c, "\33[s\33[1;1H\33[7m %-20s %8d lines\33[K\33[0m"
+	      "\33[25;1H\33[44;37m F1 Help  F10 Quit \33[0m\33[K\33[u",
+	   Word[Rand( WORDS )], line );
+    Add( c, "%02d:%02d:%02d \33[3%dm%-5s\33[0m %s %s: request %d took %d ms\n",
+	 line / 3600 % 24, line / 60 % 60, line % 60, 1 + Rand( 3 ),
+	 Word[Rand( WORDS )], Word[Rand( WORDS )], Word[Rand( WORDS )],
+	 Rand( 100000 ), Rand( 1000 ) );
+  }
+}
+
+// Windows-1252 text with the bytes it leaves undefined, as a program might
+// write them by mistake.  They must be printed, not taken as the C1
+// controls they widen to (0x90 and 0x9D would start a string that swallows
+// the rest), so it ends with a line that is checked.
+#define CP1252_END "-- end of text --"
+
+static void Cp1252( Corpus* c )
+{
+  static const char stray[] = "\x81\x8D\x8F\x90\x9D";
+  int line;
+
+  for (line = 0; c->len < CORPUS_SIZE; ++line)
+    Add( c, "%s \x93%s\x94 %c %s \x80%d %c line %d\n",
+	 Word[Rand( WORDS )], Word[Rand( WORDS )], stray[Rand( 5 )],
+	 Word[Rand( WORDS )], Rand( 1000 ), stray[Rand( 5 )], line );
+  Add( c, CP1252_END "\n" );
+}
+
+static const struct
+{
+  const char* name;
+  void (*make)( Corpus* );
+  const char* end;		// the last line, to be checked (or NULL)
+} Suite[] =
+{
+  { "<compile>",  Compile,  NULL },
+  { "<ls>",	  Ls,	    NULL },
+  { "<progress>", Progress, NULL },
+  { "<tui>",	  Tui,	    NULL },
+  { "<sync>",	  Sync,     NULL },
+  { "<pane>",	  Pane,     NULL },
+  { "<code>",	  Code,     NULL },
+  { "<rgb>",	  Rgb,	    NULL },
+  { "<image>",	  Image,    NULL },
+  { "<utf8>",	  Utf8,     NULL },
+  { "<cp1252>",   Cp1252,   CP1252_END },
+};
+#define SUITE (sizeof(Suite) / sizeof(*Suite))
+
+
+// ========== Replay
+
+//-----------------------------------------------------------------------------
+//   Start( mc )
+// Clears the console and the attributes before a replay.
+//-----------------------------------------------------------------------------
+
+static void Start( PMemCon mc )
+{
+  ResetPalette();
+  MemCon_Reset( mc );
+  foreground = org_fg = 7;
+  background = org_bg = 0;
+  bold = org_bold = underline = org_ul = 0;
+}
+
+//-----------------------------------------------------------------------------
+//   Report( mc, name, size, t, tw )
+// Shows the results of replaying size bytes Repeat times in t seconds (the
+// writes returning after tw).
+//-----------------------------------------------------------------------------
+
+static void Report( PMemCon mc, const char* name, long size, double t,
+		    double tw )
+{
+  DWORD  calls;
+  double sim;
+  int	 c;
+
+  calls = MemCon_Calls( mc ) / Repeat;
+  sim = t + mc->cells * CellCost / 1e6;
+  for (c = 0; c < MC_CALLS; ++c)
+    sim += mc->calls[c] * CallCost[c] / 1e6;
+  sim /= Repeat;
+
+  printf( "%-20s %10ld %10.2f %10lu %10.2f %10.1f\n", name, size,
+	  size * (double)Repeat / t / 1e6, (unsigned long)calls,
+	  (size) ? calls * 1024.0 / size : 0, sim * 1e3 );
+  if (WriteBehind)
+    printf( "  writes returned in %.3f of %.3f s (%.0f%% sooner)\n",
+	    tw, t, 100 * (1 - tw / t) );
+  for (c = 0; c < MC_CALLS; ++c)
+    if (mc->calls[c])
+      printf( "  %-18s %10lu\n", CallName[c],
+	      (unsigned long)(mc->calls[c] / Repeat) );
+}
+
+//-----------------------------------------------------------------------------
+//   Ended( mc, text )
+// Returns TRUE if the line above the cursor is text.
+//-----------------------------------------------------------------------------
+
+static BOOL Ended( PMemCon mc, const char* text )
+{
+  int	     y = mc->info.dwCursorPosition.Y - 1;
+  PCHAR_INFO row;
+  int	     x;
+
+  if (y < 0)
+    return FALSE;
+  row = mc->cell + (y + mc->top) % mc->info.dwSize.Y * mc->info.dwSize.X;
+  for (x = 0; text[x] != '\0'; ++x)
+    if (x == mc->info.dwSize.X || row[x].Char.UnicodeChar != (BYTE)text[x])
+      return FALSE;
+  return (x == mc->info.dwSize.X || row[x].Char.UnicodeChar == ' ');
+}
+
+//-----------------------------------------------------------------------------
+//   Replay( mc, name, data, size )
+// Writes the stream Repeat times in blocks and reports the results.
+//-----------------------------------------------------------------------------
+
+static void Replay( PMemCon mc, const char* name, const char* data, long size )
+{
+  WCHAR* wide;
+  DWORD  len, pos, n, r;
+  double t, tw;
+  Utf8State st;
+
+  wide = malloc( (size + UTF8_EXTRA) * sizeof(WCHAR) );
+  if (wide == NULL)
+  {
+    fprintf( stderr, "%s: out of memory\n", name );
+    return;
+  }
+  memset( &st, 0, sizeof(st) );
+  len = Utf8Decode( &st, data, size, wide );
+
+  Start( mc );
+  t = Now();
+  for (r = 0; r < Repeat; ++r)
+  {
+    if (Cp != 0)
+    {
+      for (pos = 0; pos < (DWORD)size; pos += n)
+      {
+	n = (size - pos < Block) ? size - pos : Block;
+	STAT_WRITE( n );
+	if (Tracing)
+	  TraceWrite( TRACE_A, mc, Cp, data + pos, n );
+	if (Cp == CP_UTF8)
+	  ParseAndPrintUtf8( mc, data + pos, n, &n );
+	else
+	  ParseAndPrintSbcs( mc, &Map, data + pos, n, &n );
+      }
+    }
+    else
+    {
+      for (pos = 0; pos < len; pos += n)
+      {
+	n = (len - pos < Block) ? len - pos : Block;
+	STAT_WRITE( n );
+	if (Tracing)
+	  TraceWrite( TRACE_W, mc, 0, wide + pos, n * sizeof(WCHAR) );
+	ParseAndPrintString( mc, wide + pos, n, &n );
+      }
+    }
+  }
+  tw = Now() - t;
+  FlushBuffer();
+  t = Now() - t;
+  Report( mc, name, size, t, tw );
+  free( wide );
+}
+
+//-----------------------------------------------------------------------------
+//   ReplayTrace( mc, name, data, size )
+// Writes the writes of the trace Repeat times and reports the results.
+// Code pages other than UTF-8 and those SbcsInit knows are taken as Latin-1.
+//-----------------------------------------------------------------------------
+
+static void ReplayTrace( PMemCon mc, const char* name, const char* data,
+			 long size )
+{
+  TraceReader tr;
+  TraceEvent  ev;
+  SbcsMap     map;
+  WCHAR*      wide = NULL;
+  DWORD       max = 0, r, n;
+  long	      bytes = 0;
+  double      t, tw;
+
+  map.cp = 0;
+  Start( mc );
+  t = Now();
+  for (r = 0; r < Repeat; ++r)
+  {
+    TraceOpen( &tr, data, size );
+    while (TraceNext( &tr, &ev ))
+    {
+      if (r == 0)
+	bytes += ev.len;
+      if (Original)
+      {
+	double wait = t + r * (tr.time / 1e6) + ev.time / 1e6 - Now();
+	if (wait > 0)
+	  Pause( wait );
+      }
+      STAT_WRITE( ev.len );
+      if (ev.type == TRACE_W)
+      {
+	// The data may not be aligned.
+	if (ev.len > max)
+	{
+	  max  = ev.len;
+	  wide = realloc( wide, max );
+	  if (wide == NULL)
+	    break;
+	}
+	memcpy( wide, ev.data, ev.len );
+	ParseAndPrintString( mc, wide, ev.len / sizeof(WCHAR), &n );
+      }
+      else if (ev.cp == CP_UTF8)
+	ParseAndPrintUtf8( mc, (LPCSTR)ev.data, ev.len, &n );
+      else
+      {
+	if (ev.cp != map.cp && !SbcsInit( &map, ev.cp ))
+	{
+	  SbcsInit( &map, 28591 );
+	  map.cp = ev.cp;
+	}
+	ParseAndPrintSbcs( mc, &map, (LPCSTR)ev.data, ev.len, &n );
+      }
+    }
+    TraceClose( &tr );
+  }
+  tw = Now() - t;
+  FlushBuffer();
+  t = Now() - t;
+  Report( mc, name, bytes, t, tw );
+  free( wide );
+}
+
+//-----------------------------------------------------------------------------
+//   SetCost( arg )
+// Sets the cost of a call (or cell) from "NAME=US".
+//-----------------------------------------------------------------------------
+
+static BOOL SetCost( const char* arg )
+{
+  char name[16];
+  int  c, n;
+
+  n = strcspn( arg, "=" );
+  if (arg[n] != '=' || n >= sizeof(name))
+    return FALSE;
+  memcpy( name, arg, n );
+  name[n] = '\0';
+  if (stricmp( name, "cell" ) == 0)
+  {
+    CellCost = atof( arg + n + 1 );
+    return TRUE;
+  }
+  for (c = 0; c < MC_CALLS; ++c)
+    if (stricmp( name, CallName[c] ) == 0)
+    {
+      CallCost[c] = atof( arg + n + 1 );
+      return TRUE;
+    }
+  return FALSE;
+}
+
+
+// ========== Stress
+//
+// Threads writing lines at once (-t), to check none are torn apart.
+
+typedef struct
+{
+  PMemCon mc;
+  int	  id;
+  DWORD   lines;
+} Writer;
+
+#define WRITER_COLOR( id ) (1 + (id) % 7)
+
+static void* WriterThread( void* arg )
+{
+  Writer* w = arg;
+  char	  line[80];
+  DWORD   i, n;
+
+  for (i = 0; i < w->lines; ++i)
+  {
+    n = sprintf( line, "\33[3%dmthread %3d line %7lu\33[0m\n",
+		 WRITER_COLOR( w->id ), w->id, (unsigned long)i );
+    ParseAndPrintUtf8( w->mc, line, n, &n );
+  }
+  return NULL;
+}
+
+// Returns TRUE if row y is blank or is one whole line in its thread's color.
+static BOOL RowIntact( PMemCon mc, int y )
+{
+  static const WORD attr[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+  PCHAR_INFO row = mc->cell + (y + mc->top) % mc->info.dwSize.Y
+			      * mc->info.dwSize.X;
+  char	     text[256];
+  int	     x, id, len;
+  unsigned long n;
+
+  for (x = 0; x < mc->info.dwSize.X && x < 255; ++x)
+    text[x] = (char)row[x].Char.UnicodeChar;
+  text[x] = '\0';
+  for (len = x; len > 0 && text[len-1] == ' '; --len) ;
+  if (len == 0)
+    return TRUE;
+  text[len] = '\0';
+  if (sscanf( text, "thread %d line %lu%n", &id, &n, &x ) != 2 || x != len)
+    return FALSE;
+  for (x = 0; x < len; ++x)
+    if (row[x].Attributes != attr[WRITER_COLOR( id )])
+      return FALSE;
+  return TRUE;
+}
+
+static int Stress( PMemCon mc, int threads, DWORD lines )
+{
+  pthread_t* tid = malloc( threads * sizeof(pthread_t) );
+  Writer*    w	 = malloc( threads * sizeof(Writer) );
+  double     t;
+  int	     i, torn;
+
+  if (tid == NULL || w == NULL)
+  {
+    fprintf( stderr, "ansibench: out of memory\n" );
+    return 1;
+  }
+  t = Now();
+  for (i = 0; i < threads; ++i)
+  {
+    w[i].mc    = mc;
+    w[i].id    = i;
+    w[i].lines = lines;
+    pthread_create( &tid[i], NULL, WriterThread, &w[i] );
+  }
+  for (i = 0; i < threads; ++i)
+    pthread_join( tid[i], NULL );
+  FlushBuffer();
+  t = Now() - t;
+
+  torn = 0;
+  for (i = 0; i < mc->info.dwSize.Y - 1; ++i)
+    if (!RowIntact( mc, i ))
+      ++torn;
+  printf( "%d threads, %lu lines: %.2f s, %.0f lines/s, %lu calls, "
+	  "%d torn of %d rows\n", threads, (unsigned long)lines * threads, t,
+	  lines * threads / t, (unsigned long)MemCon_Calls( mc ), torn,
+	  mc->info.dwSize.Y - 1 );
+  free( tid );
+  free( w );
+  return (torn != 0);
+}
+
+
+int main( int argc, char* argv[] )
+{
+  int	  width = 80, height = 0;
+  int	  threads = 0;
+  int	  rc = 0;
+  BOOL	  stats = FALSE;
+  PMemCon mc;
+  int	  i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+  {
+    switch (argv[i][1])
+    {
+      case 'b': Block  = atoi( argv[i] + 2 ); break;
+      case 'n': Repeat = atoi( argv[i] + 2 ); break;
+      case 'w': width  = atoi( argv[i] + 2 ); break;
+      case 'h': height = atoi( argv[i] + 2 ); break;
+      case 'c': Cp     = atoi( argv[i] + 2 ); break;
+      case 't': threads = atoi( argv[i] + 2 ); break;
+      case 's': stats  = TRUE; break;
+      case 'o': Original = TRUE; break;
+      case 'k':
+	if (SetCost( argv[i] + 2 ))
+	  break;
+	// fall through
+      default:
+	fprintf( stderr, "ansibench [-bBLOCK] [-nREPEAT] [-wWIDTH] "
+			 "[-hHEIGHT] [-cCP] [-kNAME=US]... [-s] [-o] [file...]\n"
+			 "ansibench -tTHREADS [-nREPEAT] [-wWIDTH] "
+			 "[-hHEIGHT]\n" );
+	return 1;
+    }
+  }
+  if (Block == 0 || Repeat == 0)
+  {
+    fprintf( stderr, "ansibench: nothing to do\n" );
+    return 1;
+  }
+  if (Cp != 0 && Cp != CP_UTF8 && !SbcsInit( &Map, Cp ))
+  {
+    fprintf( stderr, "ansibench: code page %u is not known\n", Cp );
+    return 1;
+  }
+
+  if (height <= 0)
+    height = (threads > 0) ? 32766 : 300;
+  mc = MemCon_Create( width, height, width, 25, 7 );
+  if (mc == NULL)
+  {
+    fprintf( stderr, "ansibench: out of memory\n" );
+    return 1;
+  }
+  Con = &MemConFn;
+  if (stats)
+  {
+    StatInit();
+    Stat->timing = TRUE;
+  }
+  InitBuffer();
+  TraceInit();
+  if (threads > 0)
+  {
+    foreground = org_fg = 7;
+    i = Stress( mc, threads, Repeat * 1000 );
+    MemCon_Destroy( mc );
+    return i;
+  }
+
+  printf( "%-20s %10s %10s %10s %10s %10s\n",
+	  "file", "bytes", "MB/s", "calls", "calls/KB", "sim ms" );
+  if (i == argc)
+  {
+    unsigned s;
+    for (s = 0; s < SUITE; ++s)
+    {
+      Corpus c = { NULL, 0, 0 };
+      Seed = 1;
+      Suite[s].make( &c );
+      Replay( mc, Suite[s].name, c.s, c.len );
+      if (Suite[s].end != NULL && !Ended( mc, Suite[s].end ))
+      {
+	printf( "%s: the text was not printed to its end\n", Suite[s].name );
+	rc = 1;
+      }
+      free( c.s );
+    }
+  }
+  for (; i < argc; ++i)
+  {
+    FILE* f;
+    char* data;
+    long  size;
+
+    f = fopen( argv[i], "rb" );
+    if (f == NULL)
+    {
+      perror( argv[i] );
+      continue;
+    }
+    fseek( f, 0, SEEK_END );
+    size = ftell( f );
+    rewind( f );
+    data = malloc( size + 1 );
+    if (data == NULL || fread( data, 1, size, f ) != size)
+      fprintf( stderr, "%s: unable to read\n", argv[i] );
+    else if (size >= 8 && memcmp( data, TRACE_MAGIC, 8 ) == 0)
+      ReplayTrace( mc, argv[i], data, size );
+    else
+      Replay( mc, argv[i], data, size );
+    fclose( f );
+    free( data );
+  }
+
+  TraceStop();
+  if (stats)
+    StatReport( stdout );
+  MemCon_Destroy( mc );
+  return rc;
+}
@@ -0,0 +1,2432 @@
+/*
+  ansiesc.c - ANSI escape sequence interpreter.
+
+  Jason Hood, 21 & 22 October, 2005.
+
+  Split from ANSI.c, 16 October, 2026, so the parser and interpreter can be
+  used with any console backend (see console.h).
+
+  v1.40, 16 October, 2026:
+    keep a shadow of the console state, rather than reading it for every
+    sequence;
+    write text straight from the caller's buffer, finding escapes with SIMD;
+    growable print buffer, optionally kept over consecutive writes;
+    optionally render text and its attributes as cells;
+    look up the SGR attribute in a table and don't set it if it's unchanged;
+    defer setting the cursor and attribute until text is written;
+    don't erase rows that are known to be blank;
+    parse and write narrow ASCII output without widening it (ansiprint.h);
+    keep the parser state of each handle, rather than resetting it;
+    lock each write, so threads don't interleave sequences;
+    optionally queue writes for a renderer thread (ANSICON_ASYNC);
+    count sequences and flushes (see stats.c);
+    queue the writes in a ring shared with the trace (see ring.c);
+    parse with the VT500 state machine, taking every sequence out of the
+    text (private, intermediate, OSC, DCS, C1, ...);
+    set the title with OSC 0 and 2, at most every ANSICON_TITLE ms;
+    render a line being drawn over as cells, so only its last frame is drawn;
+    hold synchronized output (ESC[?2026h/l) and write the frame at once;
+    show and hide the cursor (ESC[?25h/l);
+    scrolling margins (ESC[#;#r) and scroll up and down (ESC[#S and T);
+    optionally address the window, rather than the buffer (ANSICON_WINDOW);
+    map 256-color and RGB colors to the nearest console color (color.c);
+    or allocate the palette to them (ANSICON_PALETTE).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "ansiesc.h"
+#include "color.h"
+#include "ring.h"
+#include "scan.h"
+#include "stats.h"
+
+#define isdigit(c) ('0' <= (c) && (c) <= '9')
+
+// ========== Global variables and constants
+
+PConsoleFn Con; 		// console functions
+HANDLE	   hConOut;		// handle to CONOUT$
+
+#define ESC	'\x1B'	        // ESCape character
+
+#define MAX_ARG 32		// max number of args in an escape sequence (and
+				//  bits in es_sub)
+#define MAX_PARAM 32767 	// largest value of an arg
+int   state;			// parser state (see Parser)
+TCHAR prefix;			// private marker ('<' to '?') or 0
+TCHAR es_inter; 		// intermediate (' ' to '/'), 0 or INTER_MANY
+TCHAR suffix;			// escape sequence suffix
+int   es_argc;			// escape sequence args count
+int   es_argv[MAX_ARG]; 	// escape sequence args
+DWORD es_sub;			// bit n set if es_argv[n] follows a colon
+BOOL  es_param; 		// the sequence has args
+
+#define INTER_MANY 1		// more than one intermediate
+
+#define OSC_MAX 512		// longest OSC string kept
+TCHAR* OscBuf;			// OSC string (of the handle's context)
+int    OscLen;			// its length
+
+enum				// parser states
+{
+  S_GROUND,			// text
+  S_ESC,			// after ESC
+  S_ESC_INT,			// after ESC and intermediates
+  S_CSI,			// after CSI
+  S_CSI_PARAM,			// in the args of a CSI
+  S_CSI_INT,			// in the intermediates of a CSI
+  S_CSI_IGNORE, 		// in a malformed CSI
+  S_OSC,			// in an OSC string
+  S_STRING,			// in a DCS, SOS, PM or APC string
+  STATES
+};
+
+// color constants
+
+// The console's color bits are the reverse of ANSI's (blue is 1, not 4).
+#define FG( c ) ((((c) & 1) << 2) | ((c) & 2) | (((c) & 4) >> 2))
+#define BG( c ) (FG( c ) << 4)
+
+// The attribute for each combination of the SGR state, indexed by SGRIDX.
+// bold and underline are already the intensity bits, so they go in as is.
+#define SGRIDX( fg, bg, bold, ul, rv, conc ) \
+	((fg) | ((bg) << 3) | ((bold) << 3) | (ul) | ((rv) << 8) | ((conc) << 9))
+
+#define SGR_FG( i )   ((i) & 7)
+#define SGR_BG( i )   (((i) >> 3) & 7)
+#define SGR_BOLD( i ) ((i) & 0x40)
+#define SGR_UL( i )   ((i) & 0x80)
+
+#define SGRATTR( i ) \
+  (((i) & 0x200) ? ((i) & 0x100) \
+		   ? FG( SGR_FG( i ) ) | BG( SGR_FG( i ) ) \
+		     | (SGR_BOLD( i ) ? 0x88 : 0) \
+		   : FG( SGR_BG( i ) ) | BG( SGR_BG( i ) ) \
+		     | (SGR_UL( i ) ? 0x88 : 0) \
+  : ((i) & 0x100) ? FG( SGR_BG( i ) ) | BG( SGR_FG( i ) ) \
+		    | (SGR_BOLD( i ) ? BACKGROUND_INTENSITY : 0) \
+		    | (SGR_UL( i ) ? FOREGROUND_INTENSITY : 0) \
+  : FG( SGR_FG( i ) ) | BG( SGR_BG( i ) ) \
+    | (SGR_BOLD( i ) ? FOREGROUND_INTENSITY : 0) \
+    | (SGR_UL( i ) ? BACKGROUND_INTENSITY : 0))
+
+#define SGR4( i )   SGRATTR( i ), SGRATTR( i+1 ), SGRATTR( i+2 ), SGRATTR( i+3 )
+#define SGR16( i )  SGR4( i ),	 SGR4( i+4 ),	SGR4( i+8 ),   SGR4( i+12 )
+#define SGR64( i )  SGR16( i ),  SGR16( i+16 ), SGR16( i+32 ), SGR16( i+48 )
+#define SGR256( i ) SGR64( i ),  SGR64( i+64 ), SGR64( i+128 ), SGR64( i+192 )
+
+const WORD sgr_attr[1024] =
+{
+  SGR256( 0 ), SGR256( 256 ), SGR256( 512 ), SGR256( 768 )
+};
+
+void Flush( void );
+void FlushText( void );
+void WriteText( LPCTSTR s, DWORD len );
+void InterpretEscSeq( void );
+void InterpretOsc( void );
+void ApplyTitle( BOOL force );
+void EndFrame( void );
+void FrameHide( void );
+
+
+// screen attributes
+WORD org_fg, org_bg, org_bold, org_ul;	// original attributes
+WORD foreground;
+WORD background;
+WORD bold;
+WORD underline;
+WORD rvideo	= 0;
+WORD concealed	= 0;
+WORD fg_bright	= 0;		// intensity of an extended foreground color
+WORD bg_bright	= 0;		// and background
+BOOL fg_ext	= FALSE;	// the foreground is an extended color
+BOOL bg_ext	= FALSE;	// and the background
+
+// With ANSICON_PALETTE, extended colors are given slots of the palette (see
+// color.c), once it has been read.
+BOOL PaletteMode;
+BOOL PaletteInUse;
+
+// saved cursor position
+COORD SavePos = { 0, 0 };
+
+// scrolling margins (rows of the screen), if not the whole screen
+BOOL  Margins;
+SHORT MarginTop, MarginBottom;
+
+
+// ========== Locking
+//
+// Threads may write at the same time, so each write (and anything else that
+// uses the interpreter's state) holds a lock for its duration.  Whole writes
+// are therefore drawn one after another, never interleaved.  The lock is
+// recursive, as the entry points call each other; without contention it is
+// only an interlocked operation.
+
+#ifdef _WIN32
+CRITICAL_SECTION Lock;
+#define LOCK()	 EnterCriticalSection( &Lock )
+#define UNLOCK() LeaveCriticalSection( &Lock )
+#else
+#include <pthread.h>
+pthread_mutex_t Lock;
+#define LOCK()	 pthread_mutex_lock( &Lock )
+#define UNLOCK() pthread_mutex_unlock( &Lock )
+#endif
+
+
+// ========== Write-behind
+//
+// With ANSICON_ASYNC, a write is only copied into a ring (see ring.c), and
+// the writer carries on while the ring's thread parses and draws it,
+// flushing the print buffer whenever the ring empties.  Anything that needs
+// the console up to date (reading, querying, moving the cursor, changing the
+// color or mode, starting a program or exiting) calls FlushBuffer, which
+// waits for the ring to empty.
+
+enum { Q_WIDE, Q_NARROW, Q_UTF8, Q_SBCS };
+
+BOOL WriteBehind;		// writes go to the queue
+Ring Queue;
+
+// Should this write be queued, rather than drawn?
+#define QUEUED() (WriteBehind && !RingThreadIs( &Queue ))
+
+//-----------------------------------------------------------------------------
+//   Enqueue( hDev, kind, map, lpBuffer, nBytes )
+// Adds a write to the queue.
+//-----------------------------------------------------------------------------
+
+void Enqueue( HANDLE hDev, int kind, const SbcsMap* map,
+	      LPCVOID lpBuffer, DWORD nBytes )
+{
+  RingRec rec;
+
+  rec.h    = hDev;
+  rec.arg  = map;
+  rec.time = 0;
+  rec.kind = kind;
+  rec.len  = nBytes;
+  RingPut( &Queue, &rec, lpBuffer );
+}
+
+//-----------------------------------------------------------------------------
+//   Draw( q, data )
+// Parses and prints the queued write q.
+//-----------------------------------------------------------------------------
+
+static void Draw( const RingRec* q, const char* data )
+{
+  DWORD written;
+
+  switch (q->kind)
+  {
+    case Q_WIDE:
+      ParseAndPrintString( q->h, data, q->len / sizeof(WCHAR), &written );
+      break;
+    case Q_NARROW:
+      ParseAndPrintStringA( q->h, data, q->len, &written );
+      break;
+    case Q_UTF8:
+      ParseAndPrintUtf8( q->h, data, q->len, &written );
+      break;
+    case Q_SBCS:
+      ParseAndPrintSbcs( q->h, q->arg, data, q->len, &written );
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   InitQueue( kb )
+// Starts drawing in another thread, queuing writes in kb kilobytes.
+//-----------------------------------------------------------------------------
+
+void InitQueue( int kb )
+{
+  Queue.consume = Draw;
+  Queue.idle	= Flush;
+  WriteBehind	= RingInit( &Queue, kb );
+}
+
+//-----------------------------------------------------------------------------
+//   StopQueue()
+// Draws what remains in the queue on this thread and stops the other.
+//-----------------------------------------------------------------------------
+
+void StopQueue( void )
+{
+  if (WriteBehind)
+  {
+    WriteBehind = FALSE;
+    RingStop( &Queue );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   OutputPending()
+// Returns TRUE if there's output that hasn't reached the console.
+//-----------------------------------------------------------------------------
+
+BOOL OutputPending( void )
+{
+  return (nCharInBuffer != 0 || !RingEmpty( &Queue ));
+}
+
+
+// ========== Console shadow
+//
+// Rather than asking the console for its state before every sequence, keep
+// a copy of it, advancing the cursor as text is written.  The copy is read
+// from the console again when it might be stale: when the handle changes,
+// when a hooked function indicates someone else may have moved the cursor
+// (InfoValid is cleared), or when it is older than SYNC_TIME.
+//
+// The cursor and attribute only matter to the console when text is written,
+// so sequences that change them just change the shadow; the console is
+// brought up to date before text is written (ApplyPending).  A run of cursor
+// movements becomes a single move, and colors that are changed and changed
+// back (or never written with) are never set at all.  Showing and hiding the
+// cursor (ESC[?25h and l) waits likewise.
+
+#define SYNC_TIME 50		// milliseconds before the shadow is resynced
+
+CONSOLE_SCREEN_BUFFER_INFO Info;	// shadow of the console
+BOOL  InfoValid;			// Info reflects the console
+DWORD InfoTime; 			// when Info was read
+BOOL  CursorPending;			// console cursor is behind Info
+BOOL  AttrPending;			// console attribute is behind Info
+WORD  ConAttr;				// the console's actual attribute
+COORD ConPos;				// the console's actual cursor
+BOOL  CursorShown = TRUE;		// the cursor should be visible
+BOOL  ConVisible = TRUE;		// the console's cursor is visible
+
+// Output can be held for a frame (see Synchronized output).
+#define FRAME_TIMEOUT 150		// milliseconds a frame may be held
+
+BOOL  Frame;				// holding a frame
+DWORD FrameTime;			// when it began
+DWORD FrameTimeout = FRAME_TIMEOUT;	// ANSICON_SYNC
+BOOL  FrameKept;			// the cells still hold the last frame
+
+// The rows the sequences address (as the screen): the whole buffer or, with
+// ANSICON_WINDOW, only the window, so erasing and scrolling are bounded by
+// the window, however big the buffer.
+BOOL  WindowMode;			// ANSICON_WINDOW
+
+#define SCREEN_TOP    (WindowMode ? Info.srWindow.Top : 0)
+#define SCREEN_BOTTOM (WindowMode ? Info.srWindow.Bottom : Info.dwSize.Y - 1)
+
+// Rows known to be blank (in BlankAttr) since the screen was cleared, so
+// erasing them again can be skipped.  Anything that scrolls, or rereads the
+// shadow, forgets them.  Another process (a child, say) may have written to
+// the console since, so before they're believed, the console is asked if its
+// cursor and attribute are still where they were left.
+BOOL  BlankValid;			// Blank is to be believed
+BYTE* Blank;				// row is blank
+SHORT BlankRows;			// rows in Blank
+WORD  BlankAttr;			// attribute of the blank rows
+
+//-----------------------------------------------------------------------------
+//   SyncInfo()
+// Ensures the shadow matches the console.
+//-----------------------------------------------------------------------------
+
+void SyncInfo( void )
+{
+  WORD attr;
+
+  if (!InfoValid)
+  {
+    attr = Info.wAttributes;
+    InfoValid = Con->GetInfo( hConOut, &Info );
+    InfoTime  = GetTickCount();
+    ConAttr   = Info.wAttributes;
+    ConPos    = Info.dwCursorPosition;
+    BlankValid = FALSE;
+    FrameKept  = FALSE;
+    if (AttrPending)
+      Info.wAttributes = attr;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   SetBlank( first, last )
+// Records that rows first to last have been erased with the current
+// attribute.  If that's the whole screen, start believing Blank (the rows
+// outside the window not being blank).
+//-----------------------------------------------------------------------------
+
+void SetBlank( int first, int last )
+{
+  BOOL blank;
+
+  if (first == SCREEN_TOP && last == SCREEN_BOTTOM)
+  {
+    if (BlankRows != Info.dwSize.Y)
+    {
+      free( Blank );
+      Blank = malloc( Info.dwSize.Y );
+      BlankRows = (Blank) ? Info.dwSize.Y : 0;
+    }
+    if (Blank != NULL && (!BlankValid || BlankAttr != Info.wAttributes))
+      memset( Blank, FALSE, BlankRows );
+    BlankValid = (Blank != NULL);
+    BlankAttr  = Info.wAttributes;
+  }
+  if (BlankValid)
+  {
+    blank = (Info.wAttributes == BlankAttr);
+    while (first <= last)
+      Blank[first++] = blank;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   Unblank( first, last )
+// Records that something may have been written in rows first to last.
+//-----------------------------------------------------------------------------
+
+void Unblank( int first, int last )
+{
+  if (BlankValid)
+    while (first <= last)
+      Blank[first++] = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   IsBlank( first, last )
+// Returns TRUE if rows first to last are known to be blank with the current
+// attribute (and nothing else has written to the console since).
+//-----------------------------------------------------------------------------
+
+BOOL IsBlank( int first, int last )
+{
+  CONSOLE_SCREEN_BUFFER_INFO csbi;
+
+  if (!BlankValid || Info.wAttributes != BlankAttr)
+    return FALSE;
+  while (first <= last)
+    if (!Blank[first++])
+      return FALSE;
+  if (!Con->GetInfo( hConOut, &csbi ) || csbi.wAttributes != ConAttr ||
+      csbi.dwCursorPosition.X != ConPos.X ||
+      csbi.dwCursorPosition.Y != ConPos.Y)
+  {
+    BlankValid = FALSE;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   ShowCursor()
+// Scrolls the shadow window so it contains the cursor, as the console does
+// when text is written or the cursor is set.
+//-----------------------------------------------------------------------------
+
+void ShowCursor( void )
+{
+  SHORT y = Info.dwCursorPosition.Y;
+
+  if (y > Info.srWindow.Bottom)
+  {
+    Info.srWindow.Top += y - Info.srWindow.Bottom;
+    Info.srWindow.Bottom = y;
+  }
+  else if (y < Info.srWindow.Top)
+  {
+    Info.srWindow.Bottom -= Info.srWindow.Top - y;
+    Info.srWindow.Top = y;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   SetCursor( Pos )
+// Moves the cursor and its shadow.
+//-----------------------------------------------------------------------------
+
+void SetCursor( COORD Pos )
+{
+  CursorPending = FALSE;
+  if (Con->SetCursor( hConOut, Pos ))
+  {
+    Info.dwCursorPosition = Pos;
+    ConPos = Pos;
+    ShowCursor();
+  }
+  else
+  {
+    InfoValid = FALSE;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   MoveCursor( Pos )
+// Moves the shadow cursor, leaving the console's until it's needed.
+//-----------------------------------------------------------------------------
+
+void MoveCursor( COORD Pos )
+{
+  Info.dwCursorPosition = Pos;
+  CursorPending = TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   ApplyPending()
+// Brings the console's palette, cursor and attribute up to date with the
+// shadow.
+//-----------------------------------------------------------------------------
+
+void ApplyPending( void )
+{
+  if (PaletteInUse)
+    PaletteApply();
+  if (CursorPending)
+    SetCursor( Info.dwCursorPosition );
+  if (AttrPending)
+  {
+    AttrPending = FALSE;
+    if (Info.wAttributes != ConAttr || !InfoValid)
+    {
+      if (Con->SetAttr( hConOut, Info.wAttributes ))
+	ConAttr = Info.wAttributes;
+      else
+	InfoValid = FALSE;
+    }
+  }
+  if (CursorShown != ConVisible && !Frame)
+  {
+    if (Con->SetVisible( hConOut, CursorShown ))
+      ConVisible = CursorShown;
+  }
+}
+
+
+// ========== Title
+//
+// OSC 0 and 2 set the window title.  Programs showing their progress may set
+// it many times a second, each a round trip to the console and a redraw of
+// its window, so only the last title is kept, to be applied no more often
+// than every TitleRate milliseconds (ANSICON_TITLE, 0 for every time).  A
+// title that has to wait is applied by the first write after its time, or
+// whenever the console is brought up to date (see FlushBuffer).
+
+#define TITLE_RATE 100		// default milliseconds between titles
+
+TCHAR Title[OSC_MAX+1]; 	// the title to be applied
+BOOL  TitlePending;		// Title is yet to be applied
+DWORD TitleRate = TITLE_RATE;	// milliseconds between titles
+DWORD TitleTime;		// when the last one was applied
+
+//-----------------------------------------------------------------------------
+//   InterpretOsc()
+// Interprets the OSC string: "0;title" and "2;title" set the title (1, the
+// icon name, and the others are ignored).
+//-----------------------------------------------------------------------------
+
+void InterpretOsc( void )
+{
+  if (OscLen < 2 || OscBuf[1] != ';' || (OscBuf[0] != '0' && OscBuf[0] != '2'))
+    return;
+  memcpy( Title, OscBuf + 2, (OscLen - 2) * sizeof(TCHAR) );
+  Title[OscLen - 2] = '\0';
+  TitlePending = TRUE;
+  ApplyTitle( FALSE );
+}
+
+//-----------------------------------------------------------------------------
+//   ApplyTitle( force )
+// Sets the pending title, if it's been long enough since the last one (or
+// force is set).
+//-----------------------------------------------------------------------------
+
+void ApplyTitle( BOOL force )
+{
+  DWORD now;
+
+  if (!TitlePending)
+    return;
+  now = GetTickCount();
+  if (!force && now - TitleTime < TitleRate)
+    return;
+  Con->SetTitle( hConOut, Title );
+  TitleTime = now;
+  TitlePending = FALSE;
+}
+
+
+// ========== Handle contexts
+//
+// Each handle written to has its own parser state (and UTF-8 decoder), so
+// writes to stdout and stderr can alternate without losing a sequence that
+// one of them has only half written.  The parser works on the globals; the
+// contexts of the handles are swapped in and out when the handle changes.
+// The OSC string being collected is kept in the context, rather than copied.
+// The colors and saved position stay global, as they belong to the console.
+
+#define HANDLES 8		// handles with their own context
+
+#ifdef _MSC_VER
+#define ALIGN64 __declspec(align(64))
+#else
+#define ALIGN64 __attribute__((aligned(64)))
+#endif
+
+typedef struct
+{
+  HANDLE    h;			// the handle (NULL if unused)
+  int	    state;
+  int	    es_argc;
+  int	    es_argv[MAX_ARG];
+  DWORD     es_sub;
+  BOOL	    es_param;
+  TCHAR     prefix;
+  TCHAR     es_inter;
+  TCHAR     suffix;
+  Utf8State utf8;		// incomplete UTF-8 sequence
+  int	    osc_len;
+  TCHAR     osc[OSC_MAX];	// OSC string being collected
+} ALIGN64 HandleCtx;
+
+HandleCtx  Ctx[HANDLES];
+HandleCtx* CurCtx;		// the context of hConOut
+int	   CtxNext;		// the next context to reuse
+
+//-----------------------------------------------------------------------------
+//   SwitchHandle( hDev )
+// Makes hDev the handle being written, saving the parser state of the
+// previous one and restoring its own (or starting afresh).
+//-----------------------------------------------------------------------------
+
+void SwitchHandle( HANDLE hDev )
+{
+  HandleCtx* c;
+
+  EndFrame();
+  Flush();
+  if (CurCtx != NULL)
+  {
+    CurCtx->state    = state;
+    CurCtx->es_argc  = es_argc;
+    CurCtx->es_sub   = es_sub;
+    CurCtx->es_param = es_param;
+    CurCtx->prefix   = prefix;
+    CurCtx->es_inter = es_inter;
+    CurCtx->suffix   = suffix;
+    CurCtx->osc_len  = OscLen;
+    memcpy( CurCtx->es_argv, es_argv, sizeof(es_argv) );
+  }
+
+  for (c = Ctx; c < Ctx + HANDLES && c->h != hDev; ++c) ;
+  if (c == Ctx + HANDLES)
+  {
+    c = Ctx + CtxNext;
+    if (c == CurCtx)
+      c = Ctx + (CtxNext = (CtxNext + 1) % HANDLES);
+    CtxNext = (CtxNext + 1) % HANDLES;
+    c->h = hDev;
+    c->state = S_GROUND;
+    c->utf8.npend = 0;
+  }
+  state    = c->state;
+  es_argc  = c->es_argc;
+  es_sub   = c->es_sub;
+  es_param = c->es_param;
+  prefix   = c->prefix;
+  es_inter = c->es_inter;
+  suffix   = c->suffix;
+  OscLen   = c->osc_len;
+  OscBuf   = c->osc;
+  memcpy( es_argv, c->es_argv, sizeof(es_argv) );
+
+  CurCtx    = c;
+  hConOut   = hDev;
+  InfoValid = FALSE;		// it may be another buffer
+}
+
+
+// ========== Print Buffer functions
+//
+// Text is collected in a buffer that grows up to BufferMax characters; runs
+// longer than that are written directly from the caller's buffer.  The
+// buffer is always flushed before anything else is done to the console.  By
+// default it is also flushed at the end of every write; ANSICON_FLUSH can
+// keep it over consecutive writes: "line" flushes at the end of a write that
+// ended a line, "full" only when the buffer is full (or the process reads,
+// starts another, or exits).  ANSICON_BUFFER sets BufferMax.  The buffer
+// holds either wide or narrow text (ansiprint.h); adding the other flushes it.
+
+#define BUFFER_MIN   256	// initial size of the buffer
+#define BUFFER_SIZE 8192	// default maximum size of the buffer
+
+DWORD  nCharInBuffer;		// length of the text
+DWORD  BufferMax = BUFFER_SIZE; // high-water mark
+int    FlushMode = FLUSH_WRITE; // when to flush between writes
+BOOL   BufferLine;		// buffer contains a new line
+BOOL   BufferWide;		// buffer is ChBuffer, not ChBufferA
+
+// ========== Cell rendering
+//
+// With ANSICON_RENDER=cells, text is not written as text, but placed (with
+// its attribute) into rows of cells, following the shadow cursor.  The rows
+// are written with WriteConsoleOutput: one call for each row that was
+// already in the buffer and one for all the rows that scrolled into it (the
+// scrolling itself being one call).  Setting the cursor and the attribute is
+// left until the console needs them.  Color changes within the text are
+// free, so the calls per line no longer depend on how many there are.
+//
+// Otherwise, a line that is drawn over (after a carriage return or ESC[G)
+// is rendered as cells to its end (CellLine), so each of its frames replaces
+// the last in the cells, and only the one left is written.  Erasing (ESC[K)
+// and moving (ESC[G) along the line are done in the cells, too.
+
+typedef struct
+{
+  SHORT left, right;		// columns written (none if right < left)
+} CellSpan;
+
+BOOL	   CellMode;		// render text as cells
+BOOL	   CellLine;		// render text as cells to the end of the line
+PCHAR_INFO Cells;		// pending rows of cells
+CellSpan*  CellSpans;		// columns written in each row
+int	   CellWidth;		// width of the rows
+int	   CellMax;		// number of rows to use
+int	   CellAlloc;		// number of rows allocated
+BOOL	   CellKnown;		// the rows are a copy of the console
+BOOL	   CellShow;		// the window is to follow the cursor down
+int	   CellRows;		// number of rows pending
+int	   CellTop;		// buffer row of the first, before scrolling
+int	   CellScroll;		// lines to scroll up before writing the rows
+WORD	   ScrollAttr;		// attribute of the last line scrolled in
+
+//-----------------------------------------------------------------------------
+//   CellRow( r )
+// Returns the cells of row r (relative to CellTop), adding rows as required,
+// or NULL if there would be too many.  A row that scrolled into the buffer
+// starts blank and is written in full.
+//-----------------------------------------------------------------------------
+
+PCHAR_INFO CellRow( int r )
+{
+  PCHAR_INFO row;
+  int	     x;
+
+  while (CellRows <= r)
+  {
+    if (CellRows == CellMax)
+      return NULL;
+    row = Cells + CellRows * CellWidth;
+    if (CellTop + CellRows >= Info.dwSize.Y)
+    {
+      for (x = 0; x < CellWidth; ++x)
+      {
+	row[x].Char.UnicodeChar = ' ';
+	row[x].Attributes = Info.wAttributes;
+      }
+      CellSpans[CellRows].left	= 0;
+      CellSpans[CellRows].right = CellWidth - 1;
+    }
+    else
+    {
+      CellSpans[CellRows].left	= CellWidth;
+      CellSpans[CellRows].right = -1;
+    }
+    ++CellRows;
+  }
+  return Cells + r * CellWidth;
+}
+
+//-----------------------------------------------------------------------------
+//   FlushKnown()
+// Writes the pending cells when they are a copy of the console: as the cells
+// between the changes are known, all of them are written at once.
+//-----------------------------------------------------------------------------
+
+void FlushKnown( void )
+{
+  SMALL_RECT Rect;
+  COORD      size, coord;
+  int	     r, first = -1, last = -1;
+
+  Rect.Left  = CellWidth;
+  Rect.Right = -1;
+  for (r = 0; r < CellRows; ++r)
+  {
+    if (CellSpans[r].left <= CellSpans[r].right)
+    {
+      if (first < 0)
+	first = r;
+      last = r;
+      if (CellSpans[r].left  < Rect.Left)  Rect.Left  = CellSpans[r].left;
+      if (CellSpans[r].right > Rect.Right) Rect.Right = CellSpans[r].right;
+    }
+  }
+  if (first < 0)
+    return;
+  size.X  = CellWidth;
+  size.Y  = CellRows;
+  coord.X = Rect.Left;
+  coord.Y = first;
+  Rect.Top    = CellTop + first;
+  Rect.Bottom = CellTop + last;
+  Unblank( Rect.Top, Rect.Bottom );
+  Con->WriteOutput( hConOut, Cells, size, coord, &Rect );
+}
+
+//-----------------------------------------------------------------------------
+//   FlushCells()
+// Writes the pending cells to the console.  The cursor is only set if it
+// has moved out of the window (so the window follows it, as it would text).
+//-----------------------------------------------------------------------------
+
+void FlushCells( void )
+{
+  SMALL_RECT Rect;
+  COORD      size, coord;
+  CHAR_INFO  fill;
+  int	     r, first, top;
+
+  if (Frame)
+    FrameHide();
+  if (CellRows == 0 && CellScroll == 0)
+    return;
+  if (PaletteInUse)
+    PaletteApply();		// the cells may have new colors
+
+  if (CellKnown && CellScroll == 0)
+    FlushKnown();
+  else
+  {
+    if (CellScroll)
+    {
+      Rect.Left   = 0;
+      Rect.Top    = CellScroll;
+      Rect.Right  = Info.dwSize.X - 1;
+      Rect.Bottom = Info.dwSize.Y - 1;
+      coord.X = coord.Y = 0;
+      fill.Char.UnicodeChar = ' ';
+      fill.Attributes = ScrollAttr;
+      Con->Scroll( hConOut, &Rect, NULL, coord, &fill );
+      BlankValid = FALSE;
+    }
+    else
+      Unblank( CellTop, CellTop + CellRows - 1 );
+
+    size.X = CellWidth;
+    size.Y = CellRows;
+    first  = Info.dwSize.Y - CellTop;	// the first row scrolled in
+    if (first > CellRows)
+      first = CellRows;
+    for (r = 0; r < first; ++r)
+    {
+      top = CellTop + r - CellScroll;
+      if (CellSpans[r].left <= CellSpans[r].right && top >= 0)
+      {
+	coord.X = CellSpans[r].left;
+	coord.Y = r;
+	Rect.Left   = CellSpans[r].left;
+	Rect.Right  = CellSpans[r].right;
+	Rect.Top    = Rect.Bottom = top;
+	Con->WriteOutput( hConOut, Cells, size, coord, &Rect );
+      }
+    }
+    if (first < CellRows)
+    {
+      r   = first;
+      top = CellTop + r - CellScroll;
+      if (top < 0)
+      {
+	r  -= top;
+	top = 0;
+      }
+      coord.X = 0;
+      coord.Y = r;
+      Rect.Left   = 0;
+      Rect.Right  = CellWidth - 1;
+      Rect.Top    = top;
+      Rect.Bottom = CellTop + CellRows - 1 - CellScroll;
+      Con->WriteOutput( hConOut, Cells, size, coord, &Rect );
+    }
+  }
+  CellRows = CellScroll = 0;
+  CellKnown = FALSE;
+
+  if (CellShow)
+  {
+    // Take the window down to where the text went, then set the cursor.
+    CellShow = FALSE;
+    if (Info.dwCursorPosition.Y != Info.srWindow.Bottom)
+    {
+      coord.X = 0;
+      coord.Y = Info.srWindow.Bottom;
+      Con->SetCursor( hConOut, coord );
+    }
+    SetCursor( Info.dwCursorPosition );
+  }
+  else if (CursorPending && (Info.dwCursorPosition.Y < Info.srWindow.Top ||
+			     Info.dwCursorPosition.Y > Info.srWindow.Bottom))
+    SetCursor( Info.dwCursorPosition );
+}
+
+//-----------------------------------------------------------------------------
+//   InitBuffer()
+// Reads the buffer and rendering settings from the environment.
+//-----------------------------------------------------------------------------
+
+void InitBuffer( void )
+{
+  char* env;
+
+#ifdef _WIN32
+  InitializeCriticalSection( &Lock );
+#else
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+  pthread_mutex_init( &Lock, &attr );
+  pthread_mutexattr_destroy( &attr );
+#endif
+
+  env = getenv( "ANSICON_BUFFER" );
+  if (env != NULL && atoi( env ) > 0)
+    BufferMax = atoi( env );
+
+  env = getenv( "ANSICON_FLUSH" );
+  if (env != NULL)
+  {
+    if (stricmp( env, "line" ) == 0)
+      FlushMode = FLUSH_LINE;
+    else if (stricmp( env, "full" ) == 0)
+      FlushMode = FLUSH_FULL;
+  }
+
+  env = getenv( "ANSICON_TITLE" );
+  if (env != NULL && *env != '\0')
+    TitleRate = atoi( env );
+
+  env = getenv( "ANSICON_SYNC" );
+  if (env != NULL && *env != '\0')
+    FrameTimeout = atoi( env );
+
+  env = getenv( "ANSICON_WINDOW" );
+  WindowMode = (env != NULL && *env != '\0');
+
+  env = getenv( "ANSICON_PALETTE" );
+  PaletteMode = (env != NULL && *env != '\0');
+
+  env = getenv( "ANSICON_RENDER" );
+  CellMode = (env != NULL && stricmp( env, "cells" ) == 0);
+
+  env = getenv( "ANSICON_ASYNC" );
+  if (env != NULL && *env != '\0' && strcmp( env, "0" ) != 0)
+    InitQueue( atoi( env ) );
+}
+
+//-----------------------------------------------------------------------------
+//   CellAllocate( rows )
+// Makes rows the number of rows to use, allocating them if need be.
+//-----------------------------------------------------------------------------
+
+void CellAllocate( int rows )
+{
+  FrameKept = FALSE;
+  if (rows > CellAlloc || Info.dwSize.X != CellWidth)
+  {
+    free( Cells );
+    free( CellSpans );
+    Cells     = malloc( rows * Info.dwSize.X * sizeof(CHAR_INFO) );
+    CellSpans = malloc( rows * sizeof(CellSpan) );
+    CellAlloc = (Cells && CellSpans) ? rows : 0;
+    CellWidth = Info.dwSize.X;
+  }
+  CellMax = (rows <= CellAlloc) ? rows : 0;
+}
+
+//-----------------------------------------------------------------------------
+//   CellStart()
+// Gets the cells ready to be rendered into, starting them at the cursor if
+// there are none pending, returning FALSE if they can't be.
+//-----------------------------------------------------------------------------
+
+BOOL CellStart( void )
+{
+  int r;
+
+  SyncInfo();
+  if (InfoValid && CellRows == 0)
+  {
+    // Use as many rows as fit in the print buffer, but no more than half the
+    // buffer (so it never scrolls away completely).
+    r = BufferMax / Info.dwSize.X;
+    if (r > Info.dwSize.Y / 2)
+      r = Info.dwSize.Y / 2;
+    if (r < 1)
+      r = 1;
+    CellAllocate( r );
+    CellTop = Info.dwCursorPosition.Y;
+  }
+  return (InfoValid && CellMax != 0);
+}
+
+//-----------------------------------------------------------------------------
+//   CellRestart( x, y )
+// Writes the pending cells and starts them again at the row of (x,y),
+// returning it.
+//-----------------------------------------------------------------------------
+
+PCHAR_INFO CellRestart( int x, int y )
+{
+  Info.dwCursorPosition.X = x;
+  Info.dwCursorPosition.Y = y;
+  FlushCells();
+  CellTop = y;
+  return CellRow( 0 );
+}
+
+// Writing column x would leave cells between it and those already written
+// that aren't known (after moving the cursor).
+#define CellGap( span, x ) (!CellKnown && (span)->left <= (span)->right && \
+			    ((x) < (span)->left - 1 || (x) > (span)->right + 1))
+
+//-----------------------------------------------------------------------------
+//   CellString( lpBuffer, nLength )
+// Renders text (without escapes) into the pending cells.  Text that may
+// contain wide characters is written as text.
+//-----------------------------------------------------------------------------
+
+void CellString( LPCTSTR s, DWORD len )
+{
+  PCHAR_INFO row = NULL;
+  CellSpan*  span = NULL;
+  int	     x, y, r;
+
+  if (!CellStart())
+  {
+    Flush();
+    WriteText( s, len );
+    return;
+  }
+
+  x = Info.dwCursorPosition.X;
+  y = Info.dwCursorPosition.Y;
+  for (; len > 0; --len, ++s)
+  {
+    if (row == NULL)
+    {
+      r = y + CellScroll - CellTop;
+      row = (r < 0) ? NULL : CellRow( r );
+      if (row == NULL)
+      {
+	row = CellRestart( x, y );
+	r = 0;
+      }
+      span = CellSpans + r;
+    }
+    switch (*s)
+    {
+      case '\a':
+      continue;
+
+      case '\b':
+	if (x > 0) --x;
+      continue;
+
+      case '\r':
+	x = 0;
+      continue;
+
+      case '\t':
+	if (CellGap( span, x ))
+	{
+	  row  = CellRestart( x, y );
+	  span = CellSpans;
+	}
+	do
+	{
+	  row[x].Char.UnicodeChar = ' ';
+	  row[x].Attributes = Info.wAttributes;
+	  if (x < span->left)  span->left  = x;
+	  if (x > span->right) span->right = x;
+	} while (++x & 7 && x < CellWidth);
+	if (x < CellWidth)
+	  continue;
+      break;
+
+      case '\n':
+	BufferLine = TRUE;
+      break;
+
+      default:
+	if (*s >= 0x1100)
+	{
+	  Info.dwCursorPosition.X = x;
+	  Info.dwCursorPosition.Y = y;
+	  CursorPending = TRUE;
+	  Flush();
+	  WriteText( s, len );
+	  return;
+	}
+	if (CellGap( span, x ))
+	{
+	  row  = CellRestart( x, y );
+	  span = CellSpans;
+	}
+	row[x].Char.UnicodeChar = *s;
+	row[x].Attributes = Info.wAttributes;
+	if (x < span->left)  span->left  = x;
+	if (x > span->right) span->right = x;
+	if (++x < CellWidth)
+	  continue;
+      break;
+    }
+    // New line.
+    x = 0;
+    if (y < Info.dwSize.Y - 1)
+      ++y;
+    else
+    {
+      // Blank the new line now, while it has the attribute to be blanked with.
+      ++CellScroll;
+      ScrollAttr = Info.wAttributes;
+      CellRow( y + CellScroll - CellTop );
+    }
+    row = NULL;
+  }
+  Info.dwCursorPosition.X = x;
+  Info.dwCursorPosition.Y = y;
+  CursorPending = TRUE;
+  if (y > Info.srWindow.Bottom)
+  {
+    ShowCursor();		// as writing the text would
+    CellShow = TRUE;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   CellStringA( lpBuffer, nLength )
+// Renders narrow (ASCII) text into the pending cells.
+//-----------------------------------------------------------------------------
+
+void CellStringA( const char* s, DWORD len )
+{
+  WCHAR buf[256];
+  DWORD n, i;
+
+  for (; len > 0; s += n, len -= n)
+  {
+    n = (len < 256) ? len : 256;
+    for (i = 0; i < n; ++i)
+      buf[i] = (BYTE)s[i];
+    CellString( buf, n );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   CellErase( mode )
+// Erases the cursor's line in the pending cells, as ESC[modeK, returning
+// FALSE if it can't be (and has to be erased in the console).
+//-----------------------------------------------------------------------------
+
+BOOL CellErase( int mode )
+{
+  PCHAR_INFO row;
+  CellSpan*  span;
+  int	     r, x, left, right;
+
+  if (!CellStart())
+    return FALSE;
+  r = Info.dwCursorPosition.Y + CellScroll - CellTop;
+  if (r < 0 || (row = CellRow( r )) == NULL)
+    return FALSE;
+  switch (mode)
+  {
+    case 0:		// to end of line
+      left  = Info.dwCursorPosition.X;
+      right = Info.srWindow.Right;
+    break;
+    case 1:		// from start of line to cursor
+      left  = 0;
+      right = Info.dwCursorPosition.X;
+    break;
+    case 2:		// whole line
+      left  = 0;
+      right = CellWidth - 1;
+    break;
+    default:
+    return TRUE;
+  }
+  if (right >= CellWidth)
+    right = CellWidth - 1;
+  span = CellSpans + r;
+  if (!CellKnown && span->left <= span->right &&
+      (left > span->right + 1 || right < span->left - 1))
+    return FALSE;
+  for (x = left; x <= right; ++x)
+  {
+    row[x].Char.UnicodeChar = ' ';
+    row[x].Attributes = Info.wAttributes;
+  }
+  if (left < span->left)   span->left  = left;
+  if (right > span->right) span->right = right;
+  return TRUE;
+}
+
+// ========== Synchronized output
+//
+// Output between ESC[?2026h and ESC[?2026l is a frame, to be shown all at
+// once.  The rows of the window are read into the cells at the start of the
+// frame, so text, moving the cursor and erasing the line are all done in the
+// cells, and the frame is written with one WriteConsoleOutput at the end
+// (then the cursor and attribute are set).  Anything else, or going outside
+// the window, writes the cells and is done as usual, with the cursor hidden
+// until the end of the frame.  A frame is held until its end, or the first
+// write FrameTimeout milliseconds after it began (ANSICON_SYNC, 0 ignoring
+// frames), or the program reads the console (FlushBuffer).  If nothing else
+// is written before the next frame, it starts from the cells of the last,
+// without reading the window again.
+
+//-----------------------------------------------------------------------------
+//   BeginFrame()
+// Starts holding a frame, reading the window into the cells.
+//-----------------------------------------------------------------------------
+
+void BeginFrame( void )
+{
+  SMALL_RECT Rect;
+  COORD      size, coord;
+  int	     r;
+
+  if (Frame || FrameTimeout == 0)
+    return;
+  FlushText();
+  SyncInfo();
+  if (!InfoValid)
+    return;
+  Frame = TRUE;
+  FrameTime = GetTickCount();
+
+  r = Info.srWindow.Bottom - Info.srWindow.Top + 1;
+  if (!FrameKept || CellTop != Info.srWindow.Top || CellMax != r)
+  {
+    CellAllocate( r );
+    if (CellMax == 0)
+      return;
+    size.X  = CellWidth;
+    size.Y  = r;
+    coord.X = coord.Y = 0;
+    Rect.Left	= 0;
+    Rect.Top	= Info.srWindow.Top;
+    Rect.Right	= CellWidth - 1;
+    Rect.Bottom = Info.srWindow.Bottom;
+    if (!Con->ReadOutput( hConOut, Cells, size, coord, &Rect ) ||
+	Rect.Top != Info.srWindow.Top || Rect.Bottom != Info.srWindow.Bottom)
+      return;
+  }
+  CellTop  = Info.srWindow.Top;
+  CellRows = r;
+  while (--r >= 0)
+  {
+    CellSpans[r].left  = CellWidth;
+    CellSpans[r].right = -1;
+  }
+  CellKnown = TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   EndFrame()
+// Writes the frame, with the cursor, its attribute and its visibility.
+//-----------------------------------------------------------------------------
+
+void EndFrame( void )
+{
+  BOOL known;
+
+  if (Frame)
+  {
+    known = CellKnown;
+    Frame = FALSE;
+    Flush();
+    FrameKept = known;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   FrameHide()
+// Hides the cursor while a frame is written piecemeal.
+//-----------------------------------------------------------------------------
+
+void FrameHide( void )
+{
+  if (ConVisible && Con->SetVisible( hConOut, FALSE ))
+    ConVisible = FALSE;
+}
+
+// ========== Scrolling margins
+//
+// ESC[#;#r keeps scrolling (SU, SD, IL, DL and a line feed or wrap on the
+// bottom margin) between two rows of the screen, as for a fixed header or
+// footer.
+// The rows are moved with one ScrollConsoleScreenBuffer, clipped to the
+// margins.
+
+//-----------------------------------------------------------------------------
+//   GetMargins( top, bottom )
+// Gets the rows between which to scroll: the margins or the whole screen.
+// Returns TRUE for the margins (if they still fit).
+//-----------------------------------------------------------------------------
+
+BOOL GetMargins( int* top, int* bottom )
+{
+  *top	  = SCREEN_TOP;
+  *bottom = SCREEN_BOTTOM;
+  if (!Margins || *top + MarginBottom > *bottom)
+    return FALSE;
+  *bottom = *top + MarginBottom;
+  *top	 += MarginTop;
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   ScrollRegion( top, bottom, n )
+// Scrolls rows top to bottom up n lines (down if negative), filling the
+// lines scrolled in with the current attribute.
+//-----------------------------------------------------------------------------
+
+void ScrollRegion( int top, int bottom, int n )
+{
+  SMALL_RECT Rect, Clip;
+  COORD      Pos;
+  CHAR_INFO  CharInfo;
+  DWORD      written;
+  int	     height = bottom - top + 1;
+
+  if (n == 0 || IsBlank( top, bottom ))
+    return;
+  Pos.X = 0;
+  if (n >= height || -n >= height)
+  {
+    Pos.Y = top;
+    Con->FillChar( hConOut, ' ', height * Info.dwSize.X, Pos, &written );
+    Con->FillAttr( hConOut, Info.wAttributes, height * Info.dwSize.X, Pos,
+		   &written );
+    SetBlank( top, bottom );
+    return;
+  }
+  // Only the rows scrolled out of are filled, so scrolling up more than
+  // half leaves rows between them to be erased.
+  Clip.Left   = 0;
+  Clip.Top    = top;
+  Clip.Right  = Info.dwSize.X - 1;
+  Clip.Bottom = bottom;
+  Rect = Clip;
+  if (n > 0)
+  {
+    Rect.Top += n;
+    Pos.Y = top;
+  }
+  else
+    Pos.Y = top - n;
+  CharInfo.Char.UnicodeChar = ' ';
+  CharInfo.Attributes = Info.wAttributes;
+  Con->Scroll( hConOut, &Rect, &Clip, Pos, &CharInfo );
+  if (n > height - n)
+  {
+    Pos.Y = top + height - n;
+    Con->FillChar( hConOut, ' ', (n + n - height) * Info.dwSize.X, Pos,
+		   &written );
+    Con->FillAttr( hConOut, Info.wAttributes, (n + n - height) * Info.dwSize.X,
+		   Pos, &written );
+  }
+  BlankValid = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   MarginFeed( wrap )
+// Scrolls the margins for the text on the bottom margin.  A line feed moves
+// the cursor to the start of the bottom margin; for a line about to wrap
+// (wrap set), the cursor stays in its column on the line above, so that the
+// console's own wrap brings it back to the bottom margin.
+//-----------------------------------------------------------------------------
+
+void MarginFeed( BOOL wrap )
+{
+  COORD Pos;
+  int	top, bottom;
+
+  FlushText();
+  GetMargins( &top, &bottom );
+  ScrollRegion( top, bottom, 1 );
+  FrameKept = FALSE;
+  Pos.X = (wrap) ? Info.dwCursorPosition.X : 0;
+  Pos.Y = (wrap) ? bottom - 1 : bottom;
+  MoveCursor( Pos );
+}
+
+// ========== Parser
+//
+// The parser is the state machine of the DEC VT500 series (as described by
+// Paul Williams), so that every sequence is taken out of the text, even those
+// that aren't interpreted: CSI with private markers ("\e[?25l"),
+// intermediates and colon sub-parameters; OSC, DCS, SOS, PM and APC strings;
+// other escapes (character sets); and the 8-bit C1 forms of all of them.
+// Only OSC strings are kept (up to OSC_MAX characters), for the title; DCS
+// is not passed through, so it is ignored like the other strings.  C0
+// controls in the middle of a sequence are written, as they are executed.
+//
+// Each character has a class and each state and class a transition, the
+// action to take and the state to go to.  Only the first MAX_ARG-1 args and
+// the last are kept, and an arg stops at MAX_PARAM, so every character takes
+// the same time, however long the sequence.  Text outside of sequences
+// doesn't come here (see FindEsc).
+
+enum				// actions
+{
+  A_NONE,			// ignore the character
+  A_PRINT,			// write it
+  A_CLEAR,			// start a new sequence
+  A_COLLECT,			// keep a private marker or intermediate
+  A_PARAM,			// add a digit or separator to the args
+  A_ESC,			// interpret an escape
+  A_CSI,			// interpret a control sequence
+  A_OSC,			// start an OSC string
+  A_PUT 			// add a character to the OSC string
+};
+
+enum				// character classes
+{
+  C_CTL,			// C0 control
+  C_BEL,			// BEL (ends an OSC)
+  C_INT,			// intermediate, ' ' to '/'
+  C_DIG,			// digit
+  C_COL,			// ':'
+  C_SEM,			// ';'
+  C_PRV,			// private marker, '<' to '?'
+  C_FIN,			// final, '@' to '~', other than these:
+  C_CSI,			// '['
+  C_OSC,			// ']'
+  C_DCS,			// 'P'
+  C_SOS,			// 'X', '^' or '_' (SOS, PM or APC)
+  C_DEL,			// DEL
+  C_TXT,			// U+00A0 and above
+  // The same in every state:
+  C_CAN,			// CAN or SUB
+  C_ESC,			// ESC
+  C_X1, 			// C1 control, other than these:
+  C_8CSI,			// U+009B
+  C_8OSC,			// U+009D
+  C_8DCS,			// U+0090
+  C_8SOS,			// U+0098, U+009E or U+009F
+  C_8ST,			// U+009C
+  CLASSES
+};
+
+static const BYTE CharClass[0xA0] =
+{
+  C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_BEL,	// 00
+  C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL,
+  C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL, C_CTL,	// 10
+  C_CAN, C_CTL, C_CAN, C_ESC, C_CTL, C_CTL, C_CTL, C_CTL,
+  C_INT, C_INT, C_INT, C_INT, C_INT, C_INT, C_INT, C_INT,	// 20
+  C_INT, C_INT, C_INT, C_INT, C_INT, C_INT, C_INT, C_INT,
+  C_DIG, C_DIG, C_DIG, C_DIG, C_DIG, C_DIG, C_DIG, C_DIG,	// 30
+  C_DIG, C_DIG, C_COL, C_SEM, C_PRV, C_PRV, C_PRV, C_PRV,
+  C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN,	// 40
+  C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN,
+  C_DCS, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN,	// 50
+  C_SOS, C_FIN, C_FIN, C_CSI, C_FIN, C_OSC, C_SOS, C_SOS,
+  C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN,	// 60
+  C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN,
+  C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN,	// 70
+  C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_FIN, C_DEL,
+  C_X1,  C_X1,	C_X1,  C_X1,  C_X1,  C_X1,  C_X1,  C_X1,	// 80
+  C_X1,  C_X1,	C_X1,  C_X1,  C_X1,  C_X1,  C_X1,  C_X1,
+  C_8DCS,C_X1,	C_X1,  C_X1,  C_X1,  C_X1,  C_X1,  C_X1,	// 90
+  C_8SOS,C_X1,	C_X1,  C_8CSI,C_8ST, C_8OSC,C_8SOS,C_8SOS
+};
+
+#define T( a, s ) ((a) << 4 | (s))
+
+// The transitions of the classes that are the same in every state.
+#define ANYWHERE \
+  T( A_NONE,  S_GROUND ),	/* CAN, SUB */	\
+  T( A_CLEAR, S_ESC ),		/* ESC */	\
+  T( A_NONE,  S_GROUND ),	/* C1 */	\
+  T( A_CLEAR, S_CSI ),		/* CSI */	\
+  T( A_OSC,   S_OSC ),		/* OSC */	\
+  T( A_NONE,  S_STRING ),	/* DCS */	\
+  T( A_NONE,  S_STRING ),	/* SOS */	\
+  T( A_NONE,  S_GROUND )	/* ST */
+
+static const BYTE Transition[STATES][CLASSES] =
+{
+  { // S_GROUND (only ever given ESC or C1)
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// CTL BEL
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// INT DIG
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// COL SEM
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// PRV FIN
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// CSI OSC
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// DCS SOS
+    T( A_PRINT, S_GROUND ), T( A_PRINT, S_GROUND ),	// DEL TXT
+    ANYWHERE
+  },
+  { // S_ESC
+    T( A_PRINT, S_ESC ),    T( A_PRINT, S_ESC ),
+    T( A_COLLECT, S_ESC_INT ), T( A_ESC, S_GROUND ),
+    T( A_ESC, S_GROUND ),   T( A_ESC, S_GROUND ),
+    T( A_ESC, S_GROUND ),   T( A_ESC, S_GROUND ),
+    T( A_NONE, S_CSI ),     T( A_OSC, S_OSC ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_ESC ),     T( A_NONE, S_GROUND ),
+    ANYWHERE
+  },
+  { // S_ESC_INT
+    T( A_PRINT, S_ESC_INT ), T( A_PRINT, S_ESC_INT ),
+    T( A_COLLECT, S_ESC_INT ), T( A_ESC, S_GROUND ),
+    T( A_ESC, S_GROUND ),   T( A_ESC, S_GROUND ),
+    T( A_ESC, S_GROUND ),   T( A_ESC, S_GROUND ),
+    T( A_ESC, S_GROUND ),   T( A_ESC, S_GROUND ),
+    T( A_ESC, S_GROUND ),   T( A_ESC, S_GROUND ),
+    T( A_NONE, S_ESC_INT ), T( A_NONE, S_GROUND ),
+    ANYWHERE
+  },
+  { // S_CSI
+    T( A_PRINT, S_CSI ),    T( A_PRINT, S_CSI ),
+    T( A_COLLECT, S_CSI_INT ), T( A_PARAM, S_CSI_PARAM ),
+    T( A_PARAM, S_CSI_PARAM ), T( A_PARAM, S_CSI_PARAM ),
+    T( A_COLLECT, S_CSI_PARAM ), T( A_CSI, S_GROUND ),
+    T( A_CSI, S_GROUND ),   T( A_CSI, S_GROUND ),
+    T( A_CSI, S_GROUND ),   T( A_CSI, S_GROUND ),
+    T( A_NONE, S_CSI ),     T( A_NONE, S_GROUND ),
+    ANYWHERE
+  },
+  { // S_CSI_PARAM
+    T( A_PRINT, S_CSI_PARAM ), T( A_PRINT, S_CSI_PARAM ),
+    T( A_COLLECT, S_CSI_INT ), T( A_PARAM, S_CSI_PARAM ),
+    T( A_PARAM, S_CSI_PARAM ), T( A_PARAM, S_CSI_PARAM ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_CSI, S_GROUND ),
+    T( A_CSI, S_GROUND ),   T( A_CSI, S_GROUND ),
+    T( A_CSI, S_GROUND ),   T( A_CSI, S_GROUND ),
+    T( A_NONE, S_CSI_PARAM ), T( A_NONE, S_GROUND ),
+    ANYWHERE
+  },
+  { // S_CSI_INT
+    T( A_PRINT, S_CSI_INT ), T( A_PRINT, S_CSI_INT ),
+    T( A_COLLECT, S_CSI_INT ), T( A_NONE, S_CSI_IGNORE ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_NONE, S_CSI_IGNORE ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_CSI, S_GROUND ),
+    T( A_CSI, S_GROUND ),   T( A_CSI, S_GROUND ),
+    T( A_CSI, S_GROUND ),   T( A_CSI, S_GROUND ),
+    T( A_NONE, S_CSI_INT ), T( A_NONE, S_GROUND ),
+    ANYWHERE
+  },
+  { // S_CSI_IGNORE
+    T( A_PRINT, S_CSI_IGNORE ), T( A_PRINT, S_CSI_IGNORE ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_NONE, S_CSI_IGNORE ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_NONE, S_CSI_IGNORE ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_NONE, S_GROUND ),
+    T( A_NONE, S_GROUND ),  T( A_NONE, S_GROUND ),
+    T( A_NONE, S_GROUND ),  T( A_NONE, S_GROUND ),
+    T( A_NONE, S_CSI_IGNORE ), T( A_NONE, S_GROUND ),
+    ANYWHERE
+  },
+  { // S_OSC (leaving it interprets the string)
+    T( A_NONE, S_OSC ),     T( A_NONE, S_GROUND ),
+    T( A_PUT, S_OSC ),	    T( A_PUT, S_OSC ),
+    T( A_PUT, S_OSC ),	    T( A_PUT, S_OSC ),
+    T( A_PUT, S_OSC ),	    T( A_PUT, S_OSC ),
+    T( A_PUT, S_OSC ),	    T( A_PUT, S_OSC ),
+    T( A_PUT, S_OSC ),	    T( A_PUT, S_OSC ),
+    T( A_NONE, S_OSC ),     T( A_PUT, S_OSC ),
+    ANYWHERE
+  },
+  { // S_STRING
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    T( A_NONE, S_STRING ),  T( A_NONE, S_STRING ),
+    ANYWHERE
+  }
+};
+
+//-----------------------------------------------------------------------------
+//   Clear()
+// Starts a new sequence.
+//-----------------------------------------------------------------------------
+
+static __inline void Clear( void )
+{
+  prefix = es_inter = 0;
+  es_argc = 0;
+  es_argv[0] = 0;
+  es_sub = 0;
+  es_param = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   Param( c )
+// Adds a digit or separator to the args.
+//-----------------------------------------------------------------------------
+
+static __inline void Param( WORD c )
+{
+  es_param = TRUE;
+  if (c <= '9')
+  {
+    es_argv[es_argc] = 10 * es_argv[es_argc] + (c - '0');
+    if (es_argv[es_argc] > MAX_PARAM)
+      es_argv[es_argc] = MAX_PARAM;
+  }
+  else
+  {
+    if (es_argc < MAX_ARG-1) es_argc++;
+    es_argv[es_argc] = 0;
+    if (c == ':')
+      es_sub |= 1u << es_argc;
+    else
+      es_sub &= ~(1u << es_argc);
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   Step( c )
+// Takes the transition for the character c, returning TRUE if it should be
+// written.  The usual sequence, ESC [ args final, mostly bypasses the table:
+// ParseAndPrintString starts it and takes the args (see Args), leaving only
+// the final character.
+//-----------------------------------------------------------------------------
+
+static __inline BOOL Step( WORD c )
+{
+  BYTE t;
+
+  if ((state == S_CSI_PARAM || state == S_CSI) && c >= '@' && c <= '~')
+  {
+    state = S_GROUND;
+    if (es_param) es_argc++;
+    suffix = c;
+    InterpretEscSeq();
+    return FALSE;
+  }
+
+  t = Transition[state][(c < 0xA0) ? CharClass[c] : C_TXT];
+  if (state == S_OSC && (t & 15) != S_OSC)
+    InterpretOsc();
+  state = t & 15;
+  switch (t >> 4)
+  {
+    case A_PRINT:
+    return TRUE;
+
+    case A_CLEAR:
+      Clear();
+    break;
+
+    case A_COLLECT:
+      if (c >= '<')
+	prefix = c;
+      else
+	es_inter = (es_inter) ? INTER_MANY : c;
+    break;
+
+    case A_PARAM:
+      Param( c );
+    break;
+
+    case A_ESC:
+      // ESC 7 and ESC 8 (DECSC and DECRC) are ESC[s and ESC[u.
+      if (es_inter == 0 && (c == '7' || c == '8'))
+      {
+	suffix = (c == '7') ? 's' : 'u';
+	InterpretEscSeq();
+      }
+    break;
+
+    case A_CSI:
+      if (es_param) es_argc++;
+      suffix = c;
+      InterpretEscSeq();
+    break;
+
+    case A_OSC:
+      OscLen = 0;
+    break;
+
+    case A_PUT:
+      if (OscLen < OSC_MAX)
+	OscBuf[OscLen++] = c;
+    break;
+  }
+  return FALSE;
+}
+
+// The parser and print buffer for wide (W) and narrow ASCII (A) text.
+
+#define XCHAR	    TCHAR
+#define XUCHAR	    TCHAR
+#define XWIDE	    1
+#define XFIRST_WIDE 0x1100
+#define X(f)	    f
+#include "ansiprint.h"
+#undef XCHAR
+#undef XUCHAR
+#undef XWIDE
+#undef XFIRST_WIDE
+#undef X
+
+#define XCHAR	    char
+#define XUCHAR	    BYTE
+#define XWIDE	    0
+#define XFIRST_WIDE 0x80
+#define X(f)	    f##A
+#include "ansiprint.h"
+
+//-----------------------------------------------------------------------------
+//   FlushText()
+// Writes the buffer (or the cells) to the console and empties it.
+//-----------------------------------------------------------------------------
+
+void FlushText( void )
+{
+  if (CellMode || CellLine || CellRows != 0 || CellScroll != 0)
+  {
+    if (CellRows != 0)
+      ++Stat->flushes;
+    FlushCells();
+    CellLine = FALSE;
+  }
+  else if (nCharInBuffer != 0)
+  {
+    ++Stat->flushes;
+    if (BufferWide)
+      WriteText( ChBuffer, nCharInBuffer );
+    else
+      WriteTextA( ChBufferA, nCharInBuffer );
+    nCharInBuffer = 0;
+  }
+  BufferLine = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   FlushBuffer()
+// Writes the buffer (ending any frame) to the console and brings the
+// console's cursor, attribute and title up to date, after any queued writes.
+//-----------------------------------------------------------------------------
+
+void FlushBuffer( void )
+{
+  if (QUEUED())
+    RingDrain( &Queue );
+  LOCK();
+  Frame = FALSE;
+  Flush();
+  ApplyTitle( TRUE );
+  UNLOCK();
+}
+
+//-----------------------------------------------------------------------------
+//   Flush()
+// Writes the buffer and applies the pending cursor and attribute, within the
+// interpreter (the title waits for its time).
+//-----------------------------------------------------------------------------
+
+void Flush( void )
+{
+  LOCK();
+  FlushText();
+  ApplyPending();
+  UNLOCK();
+}
+
+//-----------------------------------------------------------------------------
+//   InvalidateInfo()
+// Forgets the shadow, when something else may have changed the console.
+//-----------------------------------------------------------------------------
+
+void InvalidateInfo( void )
+{
+  LOCK();
+  InfoValid = FALSE;
+  UNLOCK();
+}
+
+//-----------------------------------------------------------------------------
+//   ResetPalette()
+// Restores the palette, if its slots were allocated (they will be read again
+// by the next extended color).
+//-----------------------------------------------------------------------------
+
+void ResetPalette( void )
+{
+  LOCK();
+  if (PaletteInUse)
+  {
+    PaletteRestore();
+    PaletteInUse = FALSE;
+  }
+  UNLOCK();
+}
+
+//-----------------------------------------------------------------------------
+//   InCells()
+// Returns TRUE if the sequence can be done in the cells (moving the cursor
+// or erasing the line), so the text before it need not be written.
+//-----------------------------------------------------------------------------
+
+BOOL InCells( void )
+{
+  switch (suffix)
+  {
+    case 'G': case 'K':
+      return (CellMode || Frame || CellLine);
+
+    case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+    case 'H': case 'f': case 's': case 'u':
+      return (CellMode || Frame);
+  }
+  return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   UsePalette()
+// Returns TRUE if the extended colors are given slots of the palette, reading
+// it the first time (and forgetting ANSICON_PALETTE if it can't be).
+//-----------------------------------------------------------------------------
+
+BOOL UsePalette( void )
+{
+  if (PaletteMode && !PaletteInUse)
+  {
+    PaletteInUse = PaletteInit( hConOut, org_fg | (org_bold ? 8 : 0),
+				org_bg | (org_ul ? 8 : 0) );
+    PaletteMode = PaletteInUse;
+  }
+  return PaletteInUse;
+}
+
+//-----------------------------------------------------------------------------
+//   SgrColor( i )
+// Returns the console color (0 to 15) of the extended color at es_argv[i]
+// (38 or 48), or -1 if it isn't known, advancing i to its last arg.  The
+// color is in sub-parameters (38:5:n, 38:2:r:g:b or 38:2:id:r:g:b) or the
+// args that follow (38;5;n or 38;2;r;g;b).
+//-----------------------------------------------------------------------------
+
+int SgrColor( int* pi )
+{
+  int i = *pi, n, a[5], *rgb;
+
+  for (n = 0; n < 5 && i+1+n < es_argc && (es_sub & (1u << (i+1+n))); ++n)
+    a[n] = es_argv[i+1+n];
+  if (n == 0 && i+1 < es_argc)
+  {
+    // As many args as the mode has (if they're all there).
+    n = (es_argv[i+1] == 5) ? 2 : (es_argv[i+1] == 2) ? 4 : 1;
+    if (i+n >= es_argc)
+      n = es_argc - 1 - i;
+    memcpy( a, es_argv + i+1, n * sizeof(int) );
+  }
+  *pi = i + n;
+  if (n >= 2 && a[0] == 5 && a[1] < 256)
+    return (UsePalette()) ? Palette256( a[1] ) : Color256( a[1] );
+  if (n >= 4 && a[0] == 2)
+  {
+    rgb = a + n - 3;		// the last three, after any color-space id
+    return (UsePalette()) ? PaletteRGB( rgb[0], rgb[1], rgb[2] )
+			  : ColorRGB( rgb[0], rgb[1], rgb[2] );
+  }
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+//   InterpretEscSeq()
+// Interprets the last escape sequence scanned by ParseAndPrintString
+//   prefix             escape sequence private marker
+//   es_inter		escape sequence intermediate
+//   es_argc            escape sequence args count
+//   es_argv[]          escape sequence args array
+//   es_sub		escape sequence args that are sub-parameters
+//   suffix             escape sequence suffix
+//
+// for instance, with \e[33;45;1m we have
+// prefix = 0, es_inter = 0,
+// es_argc = 3, es_argv[0] = 33, es_argv[1] = 45, es_argv[2] = 1
+// suffix = 'm'
+//-----------------------------------------------------------------------------
+
+void InterpretEscSeq( void )
+{
+  int  i, top, bottom, color;
+  WORD attribut, fg_int, bg_int;
+  DWORD len, NumberOfCharsWritten;
+  COORD Pos;
+  SMALL_RECT Rect;
+  CHAR_INFO  CharInfo;
+
+  if (suffix >= '@' && suffix <= '~')
+    ++Stat->esc[suffix - '@'];
+  if (prefix == '?' && es_inter == 0 && (suffix == 'h' || suffix == 'l'))
+  {
+    for (i = 0; i < es_argc; i++)
+    {
+      switch (es_argv[i])
+      {
+	case 25:		// ESC[?25h Show (l hide) the cursor
+	  CursorShown = (suffix == 'h');
+	break;
+	case 2026:		// ESC[?2026h Begin (l end) a frame
+	  if (suffix == 'h')
+	    BeginFrame();
+	  else
+	    EndFrame();
+	break;
+      }
+    }
+    return;
+  }
+  // SGR only flushes if the attribute changes; the cursor can be moved and
+  // the line erased in the cells.
+  if (prefix == 0 && es_inter == 0 && suffix != 'm' && !InCells())
+    FlushText();
+  if (suffix != 'm')
+    FrameKept = FALSE;		// it may write to the console
+  if (prefix == 0 && es_inter == 0)	// none of these are known yet
+  {
+    SyncInfo();
+    switch (suffix)
+    {
+      case 'm':
+	if (es_argc == 0) es_argv[es_argc++] = 0;
+	for (i = 0; i < es_argc; i++)
+	{
+	  if (es_sub & (1u << i))	// qualifies the one before
+	    continue;
+	  if (es_argv[i] == 38)		// extended foreground color
+	  {
+	    color = SgrColor( &i );
+	    if (color >= 0)
+	    {
+	      foreground = color & 7;
+	      fg_bright  = (color & 8) ? FOREGROUND_INTENSITY : 0;
+	      fg_ext	 = TRUE;
+	    }
+	    continue;
+	  }
+	  if (es_argv[i] == 48)		// extended background color
+	  {
+	    color = SgrColor( &i );
+	    if (color >= 0)
+	    {
+	      background = color & 7;
+	      bg_bright  = (color & 8) ? BACKGROUND_INTENSITY : 0;
+	      bg_ext	 = TRUE;
+	    }
+	    continue;
+	  }
+	  switch (es_argv[i])
+	  {
+	    case 0:
+	      foreground = org_fg;
+	      background = org_bg;
+	      bold	 = (es_argc == 1) ? org_bold : 0;
+	      underline  = (es_argc == 1) ? org_ul   : 0;
+	      rvideo	 = 0;
+	      concealed  = 0;
+	      fg_bright  = 0;
+	      bg_bright  = 0;
+	      fg_ext	 = FALSE;
+	      bg_ext	 = FALSE;
+	    break;
+	    case  1: bold      = FOREGROUND_INTENSITY; break;
+	    case  5: /* blink */
+	    case  4: underline = BACKGROUND_INTENSITY; break;
+	    case  7: rvideo    = 1; break;
+	    case  8: concealed = 1; break;
+	    case 21: bold      = 0; break;
+	    case 25:
+	    case 24: underline = 0; break;
+	    case 27: rvideo    = 0; break;
+	    case 28: concealed = 0; break;
+	  }
+	  if (30 <= es_argv[i] && es_argv[i] <= 37)
+	    foreground = es_argv[i]-30, fg_bright = 0, fg_ext = FALSE;
+	  if (40 <= es_argv[i] && es_argv[i] <= 47)
+	    background = es_argv[i]-40, bg_bright = 0, bg_ext = FALSE;
+	}
+	fg_int = bold | fg_bright;
+	bg_int = underline | bg_bright;
+	if (PaletteInUse)
+	{
+	  // An extended color's slot is exact, so intensity would lose it; a
+	  // basic color's slot may have been given to another.
+	  if (fg_ext)
+	    fg_int = fg_bright;
+	  else
+	    PaletteBasic( foreground | (bold ? 8 : 0) );
+	  if (bg_ext)
+	    bg_int = bg_bright;
+	  else
+	    PaletteBasic( background | (underline ? 8 : 0) );
+	}
+	attribut = sgr_attr[SGRIDX( foreground, background, fg_int, bg_int,
+				    rvideo, concealed )];
+	if (attribut == Info.wAttributes && InfoValid)
+	  return;			// already set
+	if (!CellMode && !CellLine && !Frame)
+	  FlushText();		// the text before it has the old attribute
+	Info.wAttributes = attribut;
+	AttrPending = TRUE;
+      return;
+
+      case 'J':
+	if (es_argc == 0) es_argv[es_argc++] = 0; // ESC[J == ESC[0J
+	if (es_argc != 1) return;
+	switch (es_argv[0])
+	{
+	  case 0:		// ESC[0J erase from cursor to end of display
+	    if (Info.dwCursorPosition.Y > SCREEN_BOTTOM ||
+		IsBlank( Info.dwCursorPosition.Y, SCREEN_BOTTOM ))
+	      return;
+	    len = (SCREEN_BOTTOM - Info.dwCursorPosition.Y) * Info.dwSize.X
+		  + Info.dwSize.X - Info.dwCursorPosition.X - 1;
+	    Con->FillChar( hConOut, ' ', len,
+			   Info.dwCursorPosition,
+			   &NumberOfCharsWritten );
+	    Con->FillAttr( hConOut, Info.wAttributes, len,
+			   Info.dwCursorPosition,
+			   &NumberOfCharsWritten );
+	    SetBlank( Info.dwCursorPosition.Y + 1, SCREEN_BOTTOM );
+	    if (Info.dwCursorPosition.X == 0)
+	      SetBlank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y );
+	    else if (Info.wAttributes != BlankAttr)
+	      Unblank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y );
+	  return;
+
+	  case 1:		// ESC[1J erase from start to cursor.
+	    if (Info.dwCursorPosition.Y < SCREEN_TOP ||
+		IsBlank( SCREEN_TOP, Info.dwCursorPosition.Y ))
+	      return;
+	    Pos.X = 0;
+	    Pos.Y = SCREEN_TOP;
+	    len   = (Info.dwCursorPosition.Y - Pos.Y) * Info.dwSize.X
+		    + Info.dwCursorPosition.X + 1;
+	    Con->FillChar( hConOut, ' ', len, Pos,
+			   &NumberOfCharsWritten );
+	    Con->FillAttr( hConOut, Info.wAttributes, len, Pos,
+			   &NumberOfCharsWritten );
+	    SetBlank( Pos.Y, Info.dwCursorPosition.Y - 1 );
+	    if (Info.dwCursorPosition.X == Info.dwSize.X - 1)
+	      SetBlank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y );
+	    else if (Info.wAttributes != BlankAttr)
+	      Unblank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y );
+	    return;
+
+	  case 2:		// ESC[2J Clear screen and home cursor
+	    Pos.X = 0;
+	    Pos.Y = SCREEN_TOP;
+	    if (!IsBlank( SCREEN_TOP, SCREEN_BOTTOM ))
+	    {
+	      len = Info.dwSize.X * (SCREEN_BOTTOM - SCREEN_TOP + 1);
+	      Con->FillChar( hConOut, ' ', len, Pos,
+			     &NumberOfCharsWritten );
+	      Con->FillAttr( hConOut, Info.wAttributes, len, Pos,
+			     &NumberOfCharsWritten );
+	      SetBlank( SCREEN_TOP, SCREEN_BOTTOM );
+	    }
+	    MoveCursor( Pos );
+	  return;
+
+	  default:
+	  return;
+	}
+
+      case 'K':
+	if (es_argc == 0) es_argv[es_argc++] = 0; // ESC[K == ESC[0K
+	if (es_argc != 1) return;
+	if (CellMode || CellLine || Frame)
+	{
+	  if (CellErase( es_argv[0] ))
+	    return;
+	  FlushText();
+	}
+	if (IsBlank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y ))
+	  return;
+	switch (es_argv[0])
+	{
+	  case 0:		// ESC[0K Clear to end of line
+	    len = Info.srWindow.Right - Info.dwCursorPosition.X + 1;
+	    Con->FillChar( hConOut, ' ', len,
+			   Info.dwCursorPosition,
+			   &NumberOfCharsWritten );
+	    Con->FillAttr( hConOut, Info.wAttributes, len,
+			   Info.dwCursorPosition,
+			   &NumberOfCharsWritten );
+	    if (Info.dwCursorPosition.X == 0 && len >= (DWORD)Info.dwSize.X)
+	      SetBlank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y );
+	    else if (Info.wAttributes != BlankAttr)
+	      Unblank( Info.dwCursorPosition.Y, Info.dwCursorPosition.Y );
+	  return;
+
+	  case 1:		// ESC[1K Clear from start of line to cursor
+	    Pos.X = 0;
+	    Pos.Y = Info.dwCursorPosition.Y;
+	    Con->FillChar( hConOut, ' ',
+			   Info.dwCursorPosition.X + 1, Pos,
+			   &NumberOfCharsWritten );
+	    Con->FillAttr( hConOut, Info.wAttributes,
+			   Info.dwCursorPosition.X + 1, Pos,
+			   &NumberOfCharsWritten );
+	    if (Info.dwCursorPosition.X == Info.dwSize.X - 1)
+	      SetBlank( Pos.Y, Pos.Y );
+	    else if (Info.wAttributes != BlankAttr)
+	      Unblank( Pos.Y, Pos.Y );
+	  return;
+
+	  case 2:		// ESC[2K Clear whole line.
+	    Pos.X = 0;
+	    Pos.Y = Info.dwCursorPosition.Y;
+	    Con->FillChar( hConOut, ' ', Info.dwSize.X, Pos,
+			   &NumberOfCharsWritten );
+	    Con->FillAttr( hConOut, Info.wAttributes,
+			   Info.dwSize.X, Pos,
+			   &NumberOfCharsWritten );
+	    SetBlank( Pos.Y, Pos.Y );
+	  return;
+
+	  default:
+	  return;
+	}
+
+      case 'L':                 // ESC[#L Insert # blank lines.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[L == ESC[1L
+	if (es_argc != 1) return;
+	GetMargins( &top, &bottom );
+	if (Info.dwCursorPosition.Y < top || Info.dwCursorPosition.Y > bottom)
+	  return;
+	ScrollRegion( Info.dwCursorPosition.Y, bottom, -es_argv[0] );
+      return;
+
+      case 'M':                 // ESC[#M Delete # lines.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[M == ESC[1M
+	if (es_argc != 1) return;
+	GetMargins( &top, &bottom );
+	if (Info.dwCursorPosition.Y < top || Info.dwCursorPosition.Y > bottom)
+	  return;
+	ScrollRegion( Info.dwCursorPosition.Y, bottom, es_argv[0] );
+      return;
+
+      case 'S':                 // ESC[#S Scroll up # lines.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[S == ESC[1S
+	if (es_argc != 1) return;
+	GetMargins( &top, &bottom );
+	ScrollRegion( top, bottom, es_argv[0] );
+      return;
+
+      case 'T':                 // ESC[#T Scroll down # lines.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[T == ESC[1T
+	if (es_argc != 1) return;
+	GetMargins( &top, &bottom );
+	ScrollRegion( top, bottom, -es_argv[0] );
+      return;
+
+      case 'r':                 // ESC[#;#r Set the scrolling margins.
+	len = SCREEN_BOTTOM - SCREEN_TOP + 1;
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[r == ESC[1;#r
+	if (es_argc == 1) es_argv[es_argc++] = len;
+	if (es_argc != 2) return;
+	if (es_argv[0] < 1) es_argv[0] = 1;
+	if (es_argv[1] < 1 || es_argv[1] > (int)len) es_argv[1] = len;
+	if (es_argv[0] >= es_argv[1]) return;
+	MarginTop    = es_argv[0] - 1;
+	MarginBottom = es_argv[1] - 1;
+	Margins = (MarginTop != 0 || MarginBottom != (int)len - 1);
+	Pos.X = 0;
+	Pos.Y = SCREEN_TOP;
+	MoveCursor( Pos );
+      return;
+
+      case 'P':                 // ESC[#P Delete # characters.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[P == ESC[1P
+	if (es_argc != 1) return;
+	if (Info.dwCursorPosition.X + es_argv[0] > Info.dwSize.X - 1)
+	  es_argv[0] = Info.dwSize.X - Info.dwCursorPosition.X;
+	Rect.Left   = Info.dwCursorPosition.X + es_argv[0];
+	Rect.Top    = Info.dwCursorPosition.Y;
+	Rect.Right  = Info.dwSize.X - 1;
+	Rect.Bottom = Info.dwCursorPosition.Y;
+	CharInfo.Char.UnicodeChar = ' ';
+	CharInfo.Attributes = Info.wAttributes;
+	Con->Scroll( hConOut, &Rect, NULL, Info.dwCursorPosition,
+		     &CharInfo );
+	if (Info.wAttributes != BlankAttr)
+	  Unblank( Rect.Top, Rect.Top );
+      return;
+
+      case '@':                 // ESC[#@ Insert # blank characters.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[@ == ESC[1@
+	if (es_argc != 1) return;
+	if (Info.dwCursorPosition.X + es_argv[0] > Info.dwSize.X - 1)
+	  es_argv[0] = Info.dwSize.X - Info.dwCursorPosition.X;
+	Rect.Left   = Info.dwCursorPosition.X;
+	Rect.Top    = Info.dwCursorPosition.Y;
+	Rect.Right  = Info.dwSize.X - 1 - es_argv[0];
+	Rect.Bottom = Info.dwCursorPosition.Y;
+	Pos.X = Info.dwCursorPosition.X + es_argv[0];
+	Pos.Y = Info.dwCursorPosition.Y;
+	CharInfo.Char.UnicodeChar = ' ';
+	CharInfo.Attributes = Info.wAttributes;
+	Con->Scroll( hConOut, &Rect, NULL, Pos, &CharInfo );
+	if (Info.wAttributes != BlankAttr)
+	  Unblank( Rect.Top, Rect.Top );
+      return;
+
+      case 'A':                 // ESC[#A Moves cursor up # lines
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[A == ESC[1A
+	if (es_argc != 1) return;
+	Pos.Y = Info.dwCursorPosition.Y - es_argv[0];
+	if (Pos.Y < SCREEN_TOP) Pos.Y = SCREEN_TOP;
+	Pos.X = Info.dwCursorPosition.X;
+	MoveCursor( Pos );
+      return;
+
+      case 'B':                 // ESC[#B Moves cursor down # lines
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[B == ESC[1B
+	if (es_argc != 1) return;
+	Pos.Y = (es_argv[0] < SCREEN_BOTTOM - Info.dwCursorPosition.Y)
+		? Info.dwCursorPosition.Y + es_argv[0] : SCREEN_BOTTOM;
+	Pos.X = Info.dwCursorPosition.X;
+	MoveCursor( Pos );
+      return;
+
+      case 'C':                 // ESC[#C Moves cursor forward # spaces
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[C == ESC[1C
+	if (es_argc != 1) return;
+	Pos.X = (es_argv[0] < Info.dwSize.X - Info.dwCursorPosition.X)
+		? Info.dwCursorPosition.X + es_argv[0] : Info.dwSize.X - 1;
+	Pos.Y = Info.dwCursorPosition.Y;
+	MoveCursor( Pos );
+      return;
+
+      case 'D':                 // ESC[#D Moves cursor back # spaces
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[D == ESC[1D
+	if (es_argc != 1) return;
+	Pos.X = Info.dwCursorPosition.X - es_argv[0];
+	if (Pos.X < 0) Pos.X = 0;
+	Pos.Y = Info.dwCursorPosition.Y;
+	MoveCursor( Pos );
+      return;
+
+      case 'E':                 // ESC[#E Moves cursor down # lines, column 1.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[E == ESC[1E
+	if (es_argc != 1) return;
+	Pos.Y = (es_argv[0] < SCREEN_BOTTOM - Info.dwCursorPosition.Y)
+		? Info.dwCursorPosition.Y + es_argv[0] : SCREEN_BOTTOM;
+	Pos.X = 0;
+	MoveCursor( Pos );
+      return;
+
+      case 'F':                 // ESC[#F Moves cursor up # lines, column 1.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[F == ESC[1F
+	if (es_argc != 1) return;
+	Pos.Y = Info.dwCursorPosition.Y - es_argv[0];
+	if (Pos.Y < SCREEN_TOP) Pos.Y = SCREEN_TOP;
+	Pos.X = 0;
+	MoveCursor( Pos );
+      return;
+
+      case 'G':                 // ESC[#G Moves cursor column # in current row.
+	if (es_argc == 0) es_argv[es_argc++] = 1; // ESC[G == ESC[1G
+	if (es_argc != 1) return;
+	Pos.X = es_argv[0] - 1;
+	if (Pos.X >= Info.dwSize.X) Pos.X = Info.dwSize.X - 1;
+	if (Pos.X < 0) Pos.X = 0;
+	Pos.Y = Info.dwCursorPosition.Y;
+	MoveCursor( Pos );
+	// The line is (probably) being drawn over (a frame is all cells).
+	CellLine = !CellMode && !Frame;
+      return;
+
+      case 'f':                 // ESC[#;#f
+      case 'H':                 // ESC[#;#H Moves cursor to line #, column #
+	if (es_argc == 0)
+	  es_argv[es_argc++] = 1; // ESC[H == ESC[1;1H
+	if (es_argc == 1)
+	  es_argv[es_argc++] = 1; // ESC[#H == ESC[#;1H
+	if (es_argc > 2) return;
+	Pos.X = es_argv[1] - 1;
+	if (Pos.X < 0) Pos.X = 0;
+	if (Pos.X >= Info.dwSize.X) Pos.X = Info.dwSize.X - 1;
+	Pos.Y = SCREEN_TOP + es_argv[0] - 1;
+	if (Pos.Y < SCREEN_TOP) Pos.Y = SCREEN_TOP;
+	if (Pos.Y > SCREEN_BOTTOM) Pos.Y = SCREEN_BOTTOM;
+	MoveCursor( Pos );
+      return;
+
+      case 's':                 // ESC[s Saves cursor position for recall later
+	if (es_argc != 0) return;
+	SavePos = Info.dwCursorPosition;
+      return;
+
+      case 'u':                 // ESC[u Return to saved cursor position
+	if (es_argc != 0) return;
+	MoveCursor( SavePos );
+      return;
+
+      default:
+      return;
+    }
+  }
+}
+
+
+
+// ========== Narrow output
+//
+// Narrow output that is only ASCII is parsed as is.  Otherwise, UTF-8 and
+// single-byte output is converted a chunk at a time into a fixed buffer, so
+// any size of write needs no allocation.  The UTF-8 decoder keeps an
+// incomplete sequence at the end of a write for the next, in the handle's
+// context.  The map of each single-byte code page is made once and never
+// changed, since queued writes (and other threads) may still be using it.
+
+#define WIDE_CHUNK 8192 	// characters decoded at a time
+#define CP_MAPS    8		// code pages remembered
+
+WCHAR WideBuf[WIDE_CHUNK + UTF8_EXTRA];
+
+struct
+{
+  UINT	   cp;
+  SbcsMap* map; 		// NULL if it isn't single-byte
+} CpMaps[CP_MAPS];
+int CpCount;
+
+//-----------------------------------------------------------------------------
+//   CodePageMap( cp )
+// Returns the map of code page cp, or NULL if it isn't single-byte (or too
+// many code pages have been used).
+//-----------------------------------------------------------------------------
+
+const SbcsMap* CodePageMap( UINT cp )
+{
+  SbcsMap* map = NULL;
+  int	   i;
+
+  LOCK();
+  for (i = 0; i < CpCount && CpMaps[i].cp != cp; ++i) ;
+  if (i < CpCount)
+    map = CpMaps[i].map;
+  else if (CpCount < CP_MAPS)
+  {
+    map = malloc( sizeof(SbcsMap) );
+    if (map != NULL && !SbcsInit( map, cp ))
+    {
+      free( map );
+      map = NULL;
+    }
+    CpMaps[CpCount].cp	= cp;
+    CpMaps[CpCount].map = map;
+    ++CpCount;
+  }
+  UNLOCK();
+  return map;
+}
+
+//-----------------------------------------------------------------------------
+//   ParseAndPrintUtf8( hDev, lpBuffer, nNumberOfBytesToWrite )
+// Decodes lpBuffer as UTF-8 and passes it to ParseAndPrintString.
+//-----------------------------------------------------------------------------
+
+BOOL
+ParseAndPrintUtf8( HANDLE hDev,
+		   LPCSTR lpBuffer,
+		   DWORD nNumberOfBytesToWrite,
+		   LPDWORD lpNumberOfBytesWritten
+		   )
+{
+  Utf8State* st;
+  DWORD      pos, n, len, written;
+  BOOL	     rc = TRUE;
+
+  if (QUEUED())
+  {
+    Enqueue( hDev, Q_UTF8, NULL, lpBuffer, nNumberOfBytesToWrite );
+    *lpNumberOfBytesWritten = nNumberOfBytesToWrite;
+    return TRUE;
+  }
+
+  LOCK();
+  if (hDev != hConOut)
+    SwitchHandle( hDev );
+  st = &CurCtx->utf8;
+
+  if (st->npend == 0 && !CellMode &&
+      FindNonAscii( lpBuffer, nNumberOfBytesToWrite ) == nNumberOfBytesToWrite)
+  {
+    rc = ParseAndPrintStringA( hDev, lpBuffer, nNumberOfBytesToWrite,
+			       lpNumberOfBytesWritten );
+    UNLOCK();
+    return rc;
+  }
+
+  for (pos = 0; pos < nNumberOfBytesToWrite; pos += n)
+  {
+    n = nNumberOfBytesToWrite - pos;
+    if (n > WIDE_CHUNK)
+      n = WIDE_CHUNK;
+    len = Utf8Decode( st, lpBuffer + pos, n, WideBuf );
+    if (len != 0 && !ParseAndPrintString( hDev, WideBuf, len, &written ))
+      rc = FALSE;
+  }
+  UNLOCK();
+  *lpNumberOfBytesWritten = nNumberOfBytesToWrite;
+  return rc;
+}
+
+//-----------------------------------------------------------------------------
+//   ParseAndPrintSbcs( hDev, map, lpBuffer, nNumberOfBytesToWrite )
+// Widens lpBuffer with the single-byte code page map and passes it to
+// ParseAndPrintString.
+//-----------------------------------------------------------------------------
+
+BOOL
+ParseAndPrintSbcs( HANDLE hDev,
+		   const SbcsMap* map,
+		   LPCSTR lpBuffer,
+		   DWORD nNumberOfBytesToWrite,
+		   LPDWORD lpNumberOfBytesWritten
+		   )
+{
+  DWORD pos, n, written;
+  BOOL	rc = TRUE;
+
+  if (QUEUED())
+  {
+    Enqueue( hDev, Q_SBCS, map, lpBuffer, nNumberOfBytesToWrite );
+    *lpNumberOfBytesWritten = nNumberOfBytesToWrite;
+    return TRUE;
+  }
+
+  if (map->ascii && !CellMode &&
+      FindNonAscii( lpBuffer, nNumberOfBytesToWrite ) == nNumberOfBytesToWrite)
+    return ParseAndPrintStringA( hDev, lpBuffer, nNumberOfBytesToWrite,
+				 lpNumberOfBytesWritten );
+
+  LOCK();			// WideBuf is shared
+  for (pos = 0; pos < nNumberOfBytesToWrite; pos += n)
+  {
+    n = nNumberOfBytesToWrite - pos;
+    if (n > WIDE_CHUNK)
+      n = WIDE_CHUNK;
+    SbcsWiden( map, lpBuffer + pos, n, WideBuf );
+    if (!ParseAndPrintString( hDev, WideBuf, n, &written ))
+      rc = FALSE;
+  }
+  UNLOCK();
+  *lpNumberOfBytesWritten = nNumberOfBytesToWrite;
+  return rc;
+}
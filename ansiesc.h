@@ -0,0 +1,55 @@
+/*
+  ansiesc.h - Interface to the ANSI escape sequence interpreter.
+*/
+
+#ifndef ANSIESC_H
+#define ANSIESC_H
+
+#include "console.h"
+#include "widen.h"
+
+extern HANDLE hConOut;		// console currently being written
+extern DWORD  nCharInBuffer;	// characters waiting to be written
+extern BOOL   WriteBehind;	// writes are queued for a renderer thread
+
+// screen attributes
+extern WORD org_fg, org_bg, org_bold, org_ul;	// original attributes
+extern WORD foreground;
+extern WORD background;
+extern WORD bold;
+extern WORD underline;
+
+// when to flush the print buffer between writes (ANSICON_FLUSH)
+enum
+{
+  FLUSH_WRITE,			// at the end of every write
+  FLUSH_LINE,			// at the end of a write that ended a line
+  FLUSH_FULL			// only when full
+};
+
+void InitBuffer( void );
+void FlushBuffer( void );
+void InvalidateInfo( void );
+void ResetPalette( void );
+BOOL OutputPending( void );
+void StopQueue( void );
+BOOL ParseAndPrintString( HANDLE hDev,
+			  LPCVOID lpBuffer,
+			  DWORD nNumberOfBytesToWrite,
+			  LPDWORD lpNumberOfBytesWritten );
+BOOL ParseAndPrintStringA( HANDLE hDev,
+			   LPCVOID lpBuffer,
+			   DWORD nNumberOfBytesToWrite,
+			   LPDWORD lpNumberOfBytesWritten );
+BOOL ParseAndPrintUtf8( HANDLE hDev,
+			LPCSTR lpBuffer,
+			DWORD nNumberOfBytesToWrite,
+			LPDWORD lpNumberOfBytesWritten );
+const SbcsMap* CodePageMap( UINT cp );
+BOOL ParseAndPrintSbcs( HANDLE hDev,
+			const SbcsMap* map,
+			LPCSTR lpBuffer,
+			DWORD nNumberOfBytesToWrite,
+			LPDWORD lpNumberOfBytesWritten );
+
+#endif
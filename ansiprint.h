@@ -0,0 +1,427 @@
+/*
+  ansiprint.h - The parser and print buffer, for wide or narrow text.
+
+  ansiesc.c includes this once for each type of character, so that narrow
+  output that is only ASCII can be parsed and written as is, without being
+  widened first, and neither has to test which it is for each character.
+  It expects:
+
+    XCHAR	the type of character (TCHAR or char)
+    XUCHAR	the same, unsigned
+    XWIDE	1 for TCHAR, 0 for char
+    XFIRST_WIDE the first character that may not be one cell
+    X(f)	the name of f for the type (f or fA)
+*/
+
+// The print buffer for this type.
+XCHAR* X(ChBuffer);		// text waiting to be written
+DWORD  X(BufferSize);		// size of ChBuffer
+
+//-----------------------------------------------------------------------------
+//   AdvanceCursor( lpBuffer, nLength )
+// Moves the shadow cursor as the console does when writing the text (with
+// processed output and wrap at end of line).  Characters that may be wider
+// than a cell (or, for narrow text, any that aren't ASCII) leave the shadow
+// invalid.
+//-----------------------------------------------------------------------------
+
+void X(AdvanceCursor)( const XCHAR* s, DWORD len )
+{
+  DWORD x = Info.dwCursorPosition.X;
+  DWORD y = Info.dwCursorPosition.Y;
+  DWORD n;
+
+  for (;;)
+  {
+    // Runs of plain text just wrap.
+    n = X(FindCtrl)( s, len );
+    if (n != 0)
+    {
+      x += n;
+      if (x >= (DWORD)Info.dwSize.X)
+      {
+	y += x / Info.dwSize.X;
+	x %= Info.dwSize.X;
+      }
+      s += n;
+      len -= n;
+    }
+    if (len == 0)
+      break;
+    switch (*s)
+    {
+      case '\a':
+      break;
+
+      case '\b':
+	if (x > 0) --x;
+      break;
+
+      case '\r':
+	x = 0;
+      break;
+
+      case '\t':
+	x = (x | 7) + 1;
+	if (x >= Info.dwSize.X)
+	  x = 0, ++y;
+      break;
+
+      case '\n':
+	x = 0, ++y;
+      break;
+
+      default:
+	if ((XUCHAR)*s >= XFIRST_WIDE)
+	{
+	  InfoValid = BlankValid = FALSE;
+	  return;
+	}
+	if (++x == Info.dwSize.X)
+	  x = 0, ++y;
+      break;
+    }
+    ++s;
+    --len;
+  }
+  if (y >= Info.dwSize.Y)	// the buffer has scrolled
+  {
+    y = Info.dwSize.Y - 1;
+    BlankValid = FALSE;
+  }
+  else
+    Unblank( Info.dwCursorPosition.Y, y );
+  Info.dwCursorPosition.X = x;
+  Info.dwCursorPosition.Y = y;
+  ShowCursor();
+}
+
+//-----------------------------------------------------------------------------
+//   WriteText( lpBuffer, nLength )
+// Writes text to the console, advancing the shadow cursor.
+//-----------------------------------------------------------------------------
+
+void X(WriteText)( const XCHAR* s, DWORD len )
+{
+  DWORD nWritten;
+  ApplyPending();
+  FrameKept = FALSE;
+  Con->X(Write)( hConOut, s, len, &nWritten );
+  if (InfoValid)
+  {
+    X(AdvanceCursor)( s, len );
+    ConPos = Info.dwCursorPosition;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   BufferString( lpBuffer, nLength )
+// Adds text (without escapes) to the buffer, flushing it if it would exceed
+// the maximum.  Text that would fill the buffer by itself is written
+// directly.
+//-----------------------------------------------------------------------------
+
+void X(BufferString)( const XCHAR* s, DWORD len )
+{
+  if (nCharInBuffer != 0 && BufferWide != XWIDE)
+    FlushText();
+  BufferWide = XWIDE;
+  if (nCharInBuffer + len > BufferMax)
+    FlushText();
+  if (nCharInBuffer + len > X(BufferSize))
+  {
+    DWORD  size = (X(BufferSize)) ? X(BufferSize) : BUFFER_MIN;
+    XCHAR* buf;
+    while (size < nCharInBuffer + len)
+      size *= 2;
+    if (size > BufferMax)
+      size = BufferMax;
+    buf = (size >= nCharInBuffer + len)
+	  ? realloc( X(ChBuffer), size * sizeof(XCHAR) ) : NULL;
+    if (buf == NULL)
+    {
+      FlushText();
+      X(WriteText)( s, len );
+      return;
+    }
+    X(ChBuffer)   = buf;
+    X(BufferSize) = size;
+  }
+  memcpy( X(ChBuffer) + nCharInBuffer, s, len * sizeof(XCHAR) );
+  nCharInBuffer += len;
+  if (FlushMode == FLUSH_LINE && !BufferLine)
+  {
+    while (len > 0)
+      if (s[--len] == '\n')
+      {
+	BufferLine = TRUE;
+	break;
+      }
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   PrintText( lpBuffer, nLength )
+// Buffers text (without escapes), or renders it as cells.  A line being
+// drawn over is rendered as cells to its end (see CellLine), and flushed
+// there, so only its last state is drawn.
+//-----------------------------------------------------------------------------
+
+void X(PrintText)( const XCHAR* s, DWORD len )
+{
+  DWORD n;
+
+  if (CellLine)
+  {
+    for (n = 0; n < len && s[n] != '\n'; ++n)
+      ;
+    X(CellString)( s, n );
+    if (n == len)
+      return;
+    FlushText();
+    s	+= n;
+    len -= n;
+  }
+  if (CellMode || Frame)
+  {
+    X(CellString)( s, len );
+    return;
+  }
+  X(BufferString)( s, len );
+}
+
+//-----------------------------------------------------------------------------
+//   PrintString( lpBuffer, nLength )
+// Prints text (without escapes).  With scrolling margins, a line feed on
+// the bottom margin scrolls them instead, as does a line wrapping there (see
+// MarginFeed).  The cursor is followed along the text from the shadow, so
+// the console is only asked where it is when the shadow is invalid (or the
+// text has a character that may be wide).
+//-----------------------------------------------------------------------------
+
+void X(PrintString)( const XCHAR* s, DWORD len )
+{
+  DWORD i, n, cells;
+  int	x, y, top, bottom;
+
+  if (Margins)
+  {
+    if (nCharInBuffer != 0)	// the shadow is where the buffer starts
+      FlushText();
+    SyncInfo();
+  }
+  if (!Margins || !InfoValid || !GetMargins( &top, &bottom ))
+  {
+    X(PrintText)( s, len );
+    return;
+  }
+
+  x = Info.dwCursorPosition.X;
+  y = Info.dwCursorPosition.Y;
+  for (i = 0; i < len; i += n)
+  {
+    // Runs of plain text are taken up to the end of the line.
+    n = X(FindCtrl)( s + i, len - i );
+    if (n > (DWORD)(Info.dwSize.X - x))
+      n = Info.dwSize.X - x;
+    cells = n;
+    if (n == 0)
+    {
+      n = cells = 1;
+      switch (s[i])
+      {
+	case '\a':
+	continue;
+
+	case '\b':
+	  if (x > 0) --x;
+	continue;
+
+	case '\r':
+	  x = 0;
+	continue;
+
+	case '\t':
+	  cells = (x | 7) + 1 - x;
+	break;
+
+	case '\n':
+	  if (y == bottom)
+	  {
+	    X(PrintText)( s, i );
+	    MarginFeed( FALSE );
+	    s	+= i + 1;
+	    len -= i + 1;
+	    i = n = 0;
+	  }
+	  else if (y < Info.dwSize.Y - 1)
+	    ++y;
+	  x = 0;
+	continue;
+
+	default:
+	  if ((XUCHAR)s[i] < XFIRST_WIDE)
+	    break;
+	  // Write the line and read where it left the cursor.
+	  for (n = i; n < len && s[n] != '\n'; ++n)
+	    ;
+	  X(PrintText)( s, n );
+	  FlushText();
+	  SyncInfo();
+	  if (!InfoValid)
+	  {
+	    X(PrintText)( s + n, len - n );
+	    return;
+	  }
+	  x = Info.dwCursorPosition.X;
+	  y = Info.dwCursorPosition.Y;
+	  s   += n;
+	  len -= n;
+	  i = n = 0;
+	continue;
+      }
+    }
+    if (x + cells < (DWORD)Info.dwSize.X)
+    {
+      x += cells;
+      continue;
+    }
+    // This fills the line; on the bottom margin, scroll before it wraps.
+    if (y == bottom)
+    {
+      X(PrintText)( s, i );
+      MarginFeed( TRUE );
+      s   += i;
+      len -= i;
+      i = 0;
+      --y;
+    }
+    x = 0;
+    if (y < Info.dwSize.Y - 1)
+      ++y;
+  }
+  X(PrintText)( s, len );
+}
+
+//-----------------------------------------------------------------------------
+//   Args( s, len )
+// Adds the digits and semicolons at the start of s to the args of a CSI,
+// returning how many there were.  Sequences are mostly these, so they are
+// taken a run at a time, rather than through the table.
+//-----------------------------------------------------------------------------
+
+DWORD X(Args)( const XCHAR* s, DWORD len )
+{
+  DWORD i;
+  int	n = es_argc, v = es_argv[n];
+
+  for (i = 0; i < len; ++i)
+  {
+    XUCHAR c = s[i];
+    if ((XUCHAR)(c - '0') < 10)
+    {
+      v = 10 * v + (c - '0');
+      if (v > MAX_PARAM)
+	v = MAX_PARAM;
+    }
+    else if (c == ';')
+    {
+      es_argv[n] = v;
+      if (n < MAX_ARG-1) n++;
+      v = 0;
+      es_sub &= ~(1u << n);
+    }
+    else
+      break;
+  }
+  es_argv[n] = v;
+  es_argc = n;
+  if (i != 0)
+  {
+    es_param = TRUE;
+    state = S_CSI_PARAM;
+  }
+  return i;
+}
+
+//-----------------------------------------------------------------------------
+//   ParseAndPrintString(hDev, lpBuffer, nNumberOfBytesToWrite)
+// Parses the string lpBuffer, interprets the escapes sequences and prints the
+// characters in the device hDev (console).
+// Text is found a run at a time; sequences are parsed a character at a time
+// by Step.
+//-----------------------------------------------------------------------------
+
+BOOL
+X(ParseAndPrintString)( HANDLE hDev,
+			LPCVOID lpBuffer,
+			DWORD nNumberOfBytesToWrite,
+			LPDWORD lpNumberOfBytesWritten
+			)
+{
+  DWORD        i;
+  const XCHAR* s = lpBuffer;
+
+  if (QUEUED())
+  {
+    Enqueue( hDev, (XWIDE) ? Q_WIDE : Q_NARROW, NULL, lpBuffer,
+	     nNumberOfBytesToWrite * sizeof(XCHAR) );
+    *lpNumberOfBytesWritten = nNumberOfBytesToWrite;
+    return TRUE;
+  }
+
+  LOCK();
+  if (hDev != hConOut)
+    SwitchHandle( hDev );
+  else if (Frame && GetTickCount() - FrameTime >= FrameTimeout)
+    EndFrame();
+  else if (InfoValid && !Frame && GetTickCount() - InfoTime > SYNC_TIME)
+  {
+    Flush();
+    InfoValid = FALSE;
+  }
+  for (i = nNumberOfBytesToWrite; i > 0; i--, s++)
+  {
+    if (state == S_GROUND)
+    {
+      DWORD n = X(FindEsc)( s, i );
+      if (n != 0)
+      {
+	X(PrintString)( s, n );
+	s += n;
+	i -= n;
+	if (i == 0) break;
+      }
+      if (*s == '\r' && !CellMode && !CellLine && !Frame)
+      {
+	// A carriage return that doesn't end the line starts drawing over it.
+	FlushText();		// the cells start at the shadow cursor
+	CellLine = TRUE;
+      }
+      if (*s == ESC && i > 1 && s[1] == '[')
+      {
+	Clear();
+	state = S_CSI;
+	++s, --i;
+	continue;
+      }
+    }
+    else if (state == S_CSI || state == S_CSI_PARAM)
+    {
+      DWORD n = X(Args)( s, i );
+      s += n;
+      i -= n;
+      if (i == 0) break;
+    }
+    if (Step( (XUCHAR)*s ))
+      X(PrintString)( s, 1 );
+  }
+  if (!Frame &&
+      (FlushMode == FLUSH_WRITE || (FlushMode == FLUSH_LINE && BufferLine)))
+    Flush();
+  if (TitlePending)
+    ApplyTitle( FALSE );
+  UNLOCK();
+  *lpNumberOfBytesWritten = nNumberOfBytesToWrite - i;
+  return( i == 0 );
+}
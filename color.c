@@ -0,0 +1,288 @@
+/*
+  color.c - Map 256-color and RGB colors to the console's 16.
+
+  The nearest of the console's colors is found by a weighted distance (the
+  "redmean" approximation, which follows the eye far better than the plain
+  RGB distance, yet needs only integers).  The 256 indexed colors are mapped
+  once, into a table; RGB colors are remembered in a small hash table, as
+  output tends to use the same few over and over.
+
+  Alternatively (ANSICON_PALETTE), the colors are given slots of the
+  console's palette, which is rewritten to hold them (see below).
+*/
+
+#include "color.h"
+
+#define CACHE_SIZE 256		// RGB colors remembered (a power of two)
+
+// The console's default colors, in ANSI order.
+static const BYTE Palette[16][3] =
+{
+  {   0,   0,   0 }, { 128,   0,   0 }, {   0, 128,   0 }, { 128, 128,   0 },
+  {   0,   0, 128 }, { 128,   0, 128 }, {   0, 128, 128 }, { 192, 192, 192 },
+  { 128, 128, 128 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+  {   0,   0, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+};
+
+// The levels of the 6x6x6 color cube of the 256 colors.
+static const BYTE Level[6] = { 0, 95, 135, 175, 215, 255 };
+
+static BYTE  Table[256];		// console color of each indexed color
+static BOOL  TableMade;
+static DWORD CacheKey[CACHE_SIZE];	// RGB, with bit 24 set (0 if unused)
+static BYTE  CacheColor[CACHE_SIZE];
+
+
+//-----------------------------------------------------------------------------
+//   Nearest( r, g, b )
+// Returns the console color nearest to the RGB color.
+//-----------------------------------------------------------------------------
+
+static BYTE Nearest( int r, int g, int b )
+{
+  int  c, dr, dg, db, rmean, d, best = 0x7FFFFFFF;
+  BYTE color = 0;
+
+  for (c = 0; c < 16; ++c)
+  {
+    rmean = (Palette[c][0] + r) / 2;
+    dr = Palette[c][0] - r;
+    dg = Palette[c][1] - g;
+    db = Palette[c][2] - b;
+    d = (((512 + rmean) * dr * dr) >> 8) + 4 * dg * dg
+	+ (((767 - rmean) * db * db) >> 8);
+    if (d < best)
+    {
+      best  = d;
+      color = c;
+    }
+  }
+  return color;
+}
+
+
+//-----------------------------------------------------------------------------
+//   MakeTable()
+// Maps the 256 indexed colors: the first 16 are the console's own, then a
+// 6x6x6 color cube and 24 grays.
+//-----------------------------------------------------------------------------
+
+static void MakeTable( void )
+{
+  int n, v;
+
+  for (n = 0; n < 16; ++n)
+    Table[n] = n;
+  for (n = 16; n < 232; ++n)
+    Table[n] = Nearest( Level[(n - 16) / 36], Level[(n - 16) / 6 % 6],
+			Level[(n - 16) % 6] );
+  for (n = 232; n < 256; ++n)
+  {
+    v = 8 + (n - 232) * 10;
+    Table[n] = Nearest( v, v, v );
+  }
+  TableMade = TRUE;
+}
+
+
+//-----------------------------------------------------------------------------
+//   Color256( n )
+// Returns the console color of indexed color n (0 to 255).
+//-----------------------------------------------------------------------------
+
+BYTE Color256( int n )
+{
+  if (!TableMade)
+    MakeTable();
+  return Table[n & 255];
+}
+
+
+//-----------------------------------------------------------------------------
+//   ColorRGB( r, g, b )
+// Returns the console color of the RGB color (each component being limited
+// to 255).
+//-----------------------------------------------------------------------------
+
+BYTE ColorRGB( int r, int g, int b )
+{
+  DWORD key, h;
+
+  if (r > 255) r = 255;
+  if (g > 255) g = 255;
+  if (b > 255) b = 255;
+  key = 0x1000000 | (r << 16) | (g << 8) | b;
+  h = (key * 2654435761u) >> 24 & (CACHE_SIZE - 1);
+  if (CacheKey[h] != key)
+  {
+    CacheColor[h] = Nearest( r, g, b );
+    CacheKey[h]   = key;
+  }
+  return CacheColor[h];
+}
+
+
+// ========== Palette allocation
+//
+// The sixteen slots of the palette are a cache of the colors in use.  A
+// color already in the palette takes its slot; otherwise it replaces the
+// color least recently used, recoloring whatever text still has that one.
+// The slots of the original foreground and background are never replaced,
+// since they color most of the screen, and a basic color takes its own slot
+// back.  The palette is written as the console is brought up to date, and
+// the original is written back at the end.
+
+#define PINNED 0xFFFFFFFF	// when a slot never to be replaced was used
+
+// The index in the palette of an ANSI color (and the reverse).
+#define SLOT( c ) ((((c) & 1) << 2) | ((c) & 2) | (((c) & 4) >> 2) | ((c) & 8))
+
+static HANDLE	SlotCon;		// the console whose palette is used
+static COLORREF Original[16];		// its palette to begin with, ANSI order
+static COLORREF Slot[16];		// and now
+static DWORD	Used[16];		// when each color was last used
+static DWORD	Clock;
+static BOOL	SlotPending;		// Slot is yet to be written
+static BOOL	SlotWritten;		// Slot has been written
+
+
+static void Touch( int c )
+{
+  if (Used[c] != PINNED)
+    Used[c] = ++Clock;
+}
+
+
+//-----------------------------------------------------------------------------
+//   PaletteInit( hCon, fg, bg )
+// Reads the palette of hCon, to be allocated with the colors fg and bg kept.
+// Returns FALSE if it can't be read.
+//-----------------------------------------------------------------------------
+
+BOOL PaletteInit( HANDLE hCon, int fg, int bg )
+{
+  COLORREF table[16];
+  int	   c;
+
+  if (!Con->GetPalette( hCon, table ))
+    return FALSE;
+  for (c = 0; c < 16; ++c)
+  {
+    Original[c] = Slot[c] = table[SLOT( c )];
+    Used[c] = 0;
+  }
+  Used[fg] = Used[bg] = PINNED;
+  Clock = 0;
+  SlotPending = SlotWritten = FALSE;
+  SlotCon = hCon;
+  return TRUE;
+}
+
+
+//-----------------------------------------------------------------------------
+//   PaletteRGB( r, g, b )
+// Returns the slot (ANSI order) of the RGB color, replacing the color least
+// recently used if it isn't in the palette.
+//-----------------------------------------------------------------------------
+
+int PaletteRGB( int r, int g, int b )
+{
+  COLORREF rgb;
+  int	   c, lru;
+
+  if (r > 255) r = 255;
+  if (g > 255) g = 255;
+  if (b > 255) b = 255;
+  rgb = RGB( r, g, b );
+  for (c = 0; c < 16 && Slot[c] != rgb; ++c) ;
+  if (c == 16)
+  {
+    // Of the colors never used, the bright ones go first.
+    for (c = lru = 15; c >= 0; --c)
+      if (Used[c] < Used[lru])
+	lru = c;
+    c = lru;
+    Slot[c] = rgb;
+    SlotPending = TRUE;
+  }
+  Touch( c );
+  return c;
+}
+
+
+//-----------------------------------------------------------------------------
+//   Palette256( n )
+// Returns the slot of indexed color n (0 to 255).
+//-----------------------------------------------------------------------------
+
+int Palette256( int n )
+{
+  n &= 255;
+  if (n < 16)
+    return PaletteBasic( n );
+  if (n < 232)
+  {
+    n -= 16;
+    return PaletteRGB( Level[n / 36], Level[n / 6 % 6], Level[n % 6] );
+  }
+  n = 8 + (n - 232) * 10;
+  return PaletteRGB( n, n, n );
+}
+
+
+//-----------------------------------------------------------------------------
+//   PaletteBasic( c )
+// Returns slot c, with its original color back.
+//-----------------------------------------------------------------------------
+
+int PaletteBasic( int c )
+{
+  if (Slot[c] != Original[c])
+  {
+    Slot[c] = Original[c];
+    SlotPending = TRUE;
+  }
+  Touch( c );
+  return c;
+}
+
+
+//-----------------------------------------------------------------------------
+//   PaletteApply()
+// Writes the palette, if it has changed.
+//-----------------------------------------------------------------------------
+
+void PaletteApply( void )
+{
+  COLORREF table[16];
+  int	   c;
+
+  if (SlotPending)
+  {
+    SlotPending = FALSE;
+    for (c = 0; c < 16; ++c)
+      table[SLOT( c )] = Slot[c];
+    if (Con->SetPalette( SlotCon, table ))
+      SlotWritten = TRUE;
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+//   PaletteRestore()
+// Writes the original palette back, if it was ever changed.
+//-----------------------------------------------------------------------------
+
+void PaletteRestore( void )
+{
+  COLORREF table[16];
+  int	   c;
+
+  if (SlotWritten)
+  {
+    for (c = 0; c < 16; ++c)
+      table[SLOT( c )] = Original[c];
+    Con->SetPalette( SlotCon, table );
+  }
+  SlotPending = SlotWritten = FALSE;
+}
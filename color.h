@@ -0,0 +1,24 @@
+/*
+  color.h - Map 256-color and RGB colors to the console's 16.
+*/
+
+#ifndef COLOR_H
+#define COLOR_H
+
+#include "console.h"
+
+// The colors returned are ANSI's: 0 to 7 are black, red, green, yellow,
+// blue, magenta, cyan and white; 8 to 15 are their bright versions.
+BYTE Color256( int n );
+BYTE ColorRGB( int r, int g, int b );
+
+// Allocating the slots of the console's palette (ANSICON_PALETTE), the colors
+// returned are slots (in the same order), holding the color asked for.
+BOOL PaletteInit( HANDLE hCon, int fg, int bg );
+int  PaletteRGB( int r, int g, int b );
+int  Palette256( int n );
+int  PaletteBasic( int c );
+void PaletteApply( void );
+void PaletteRestore( void );
+
+#endif
@@ -0,0 +1,157 @@
+/*
+  console.h - Console backend used by the escape sequence interpreter.
+
+  Every console call made by the interpreter goes through a ConsoleFn table,
+  so the same parser can drive the real Win32 console (wincon.c) or an
+  in-memory console (memcon.c).  The latter builds on any platform, so the
+  definitions of the few Win32 types it needs are provided here when
+  <windows.h> is not available.
+*/
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#ifdef _WIN32
+
+#ifndef UNICODE
+#define UNICODE
+#define _UNICODE
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#else
+
+#include <stddef.h>
+#include <strings.h>
+
+#define stricmp strcasecmp
+
+typedef int		BOOL;
+typedef unsigned char	BYTE;
+typedef unsigned short	WORD;
+typedef unsigned int	DWORD, UINT;
+typedef unsigned long long ULONGLONG;
+typedef short		SHORT;
+typedef unsigned short	WCHAR;
+typedef WCHAR		TCHAR, *LPTSTR, *LPWSTR;
+typedef const WCHAR*	LPCWSTR;
+typedef const char*	LPCSTR;
+typedef const TCHAR*	LPCTSTR;
+typedef void*		HANDLE;
+typedef void*		LPVOID;
+typedef const void*	LPCVOID;
+typedef DWORD*		LPDWORD;
+typedef DWORD		COLORREF;
+
+#define TRUE  1
+#define FALSE 0
+#define INVALID_HANDLE_VALUE ((HANDLE)(ptrdiff_t)-1)
+#define CP_UTF8 65001
+#define RGB( r, g, b ) ((COLORREF)((r) | ((g) << 8) | ((b) << 16)))
+
+typedef struct { SHORT X, Y; } COORD, *PCOORD;
+typedef struct { SHORT Left, Top, Right, Bottom; } SMALL_RECT, *PSMALL_RECT;
+
+typedef struct
+{
+  union
+  {
+    WCHAR UnicodeChar;
+    char  AsciiChar;
+  } Char;
+  WORD Attributes;
+} CHAR_INFO, *PCHAR_INFO;
+
+typedef struct
+{
+  COORD      dwSize;
+  COORD      dwCursorPosition;
+  WORD	     wAttributes;
+  SMALL_RECT srWindow;
+  COORD      dwMaximumWindowSize;
+} CONSOLE_SCREEN_BUFFER_INFO, *PCONSOLE_SCREEN_BUFFER_INFO;
+
+#define FOREGROUND_BLUE      0x0001
+#define FOREGROUND_GREEN     0x0002
+#define FOREGROUND_RED	     0x0004
+#define FOREGROUND_INTENSITY 0x0008
+#define BACKGROUND_BLUE      0x0010
+#define BACKGROUND_GREEN     0x0020
+#define BACKGROUND_RED	     0x0040
+#define BACKGROUND_INTENSITY 0x0080
+
+DWORD GetTickCount( void );	// provided by memcon.c
+
+#endif
+
+
+// The console functions used by the interpreter.  They have the same meaning
+// (and the same arguments, less the unused ones) as their Win32 namesakes.
+typedef struct
+{
+  BOOL (*Write)( HANDLE, LPCWSTR, DWORD, LPDWORD ); // WriteConsoleW
+  BOOL (*WriteA)( HANDLE, LPCSTR, DWORD, LPDWORD ); // WriteConsoleA
+  BOOL (*WriteOutput)( HANDLE, const CHAR_INFO*, COORD, COORD, PSMALL_RECT );
+  BOOL (*FillChar)( HANDLE, WCHAR, DWORD, COORD, LPDWORD );
+  BOOL (*FillAttr)( HANDLE, WORD, DWORD, COORD, LPDWORD );
+  BOOL (*Scroll)( HANDLE, const SMALL_RECT*, const SMALL_RECT*, COORD,
+		  const CHAR_INFO* );
+  BOOL (*SetCursor)( HANDLE, COORD );
+  BOOL (*SetAttr)( HANDLE, WORD );
+  BOOL (*GetInfo)( HANDLE, PCONSOLE_SCREEN_BUFFER_INFO );
+  BOOL (*SetTitle)( HANDLE, LPCWSTR );	// the handle is for the backend
+  BOOL (*ReadOutput)( HANDLE, PCHAR_INFO, COORD, COORD, PSMALL_RECT );
+  BOOL (*SetVisible)( HANDLE, BOOL );	// SetConsoleCursorInfo's bVisible
+  BOOL (*GetPalette)( HANDLE, COLORREF* );	// the 16 colors of the
+  BOOL (*SetPalette)( HANDLE, const COLORREF* ); // attributes (ColorTable)
+} ConsoleFn, *PConsoleFn;
+
+extern PConsoleFn Con;		// the backend currently in use
+
+#ifdef _WIN32
+extern ConsoleFn WinCon;	// the real console
+#endif
+
+
+// ========== In-memory console
+
+enum
+{
+  MC_WRITE,
+  MC_WRITEA,
+  MC_WRITEOUTPUT,
+  MC_FILLCHAR,
+  MC_FILLATTR,
+  MC_SCROLL,
+  MC_SETCURSOR,
+  MC_SETATTR,
+  MC_GETINFO,
+  MC_SETTITLE,
+  MC_READOUTPUT,
+  MC_SETVISIBLE,
+  MC_GETPALETTE,
+  MC_SETPALETTE,
+  MC_CALLS
+};
+
+typedef struct
+{
+  CONSOLE_SCREEN_BUFFER_INFO info;	// geometry, cursor and attribute
+  PCHAR_INFO cell;			// dwSize.X * dwSize.Y cells
+  int	     top;			// row of cell at the top of the buffer
+  BOOL	     visible;			// the cursor is shown
+  COLORREF   palette[16];		// the colors of the attributes
+  DWORD calls[MC_CALLS];		// number of calls to each function
+  DWORD cells;				// number of cells touched by the calls
+} MemCon, *PMemCon;
+
+extern ConsoleFn MemConFn;	// the backend; handles are PMemCon
+
+PMemCon MemCon_Create( int width, int height, int wwidth, int wheight,
+		       WORD attr );
+void	MemCon_Destroy( PMemCon );
+void	MemCon_Reset( PMemCon );
+DWORD	MemCon_Calls( PMemCon );
+
+#endif
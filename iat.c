@@ -0,0 +1,213 @@
+/*
+  iat.c - Find and patch the functions a module imports.
+
+  Hooking a function replaces its address in the import address table (IAT)
+  of every module that imports it.  Each address in the tables is looked up
+  in a hash of the addresses to replace, rather than compared with each of
+  them, and the protection of a table's page is changed once for all the
+  addresses in it, rather than for every one.
+
+  The headers are read by offset, since <windows.h> only has the structures
+  of the platform's own images (and isn't always available).
+*/
+
+#include <string.h>
+#include "iat.h"
+
+// Offsets in the headers.
+#define DOS_LFANEW	0x3C	// e_lfanew (the NT headers)
+#define NT_MAGIC	24	// OptionalHeader.Magic
+#define NT_IMAGESIZE	80	// OptionalHeader.SizeOfImage
+#define NT_DIRCOUNT32	116	// OptionalHeader.NumberOfRvaAndSizes
+#define NT_DIRCOUNT64	132	//  in PE32+
+#define NT_IMPORT32	128	// OptionalHeader.DataDirectory[1]
+#define NT_IMPORT64	144	//  in PE32+
+
+#define MAGIC_PE32	0x10B
+#define MAGIC_PE64	0x20B
+
+// IMAGE_IMPORT_DESCRIPTOR
+#define ID_LOOKUP	0	// OriginalFirstThunk
+#define ID_NAME 	12
+#define ID_FIRST	16	// FirstThunk
+#define ID_SIZE 	20
+
+#define U16( p, o ) (*(const WORD*)((const BYTE*)(p) + (o)))
+#define U32( p, o ) (*(const DWORD*)((const BYTE*)(p) + (o)))
+
+#define PAGE_OF( p ) ((BYTE*)((ULONG_PTR)(p) & ~(ULONG_PTR)(IAT_PAGE - 1)))
+
+
+//-----------------------------------------------------------------------------
+//   ImportTables( base, libs, fn, arg )
+// Calls fn for the import address table of each library in the NULL-
+// terminated list libs (or every library, if libs is NULL) imported by the
+// module at base.
+// Returns FALSE if it isn't a module (or fn returned FALSE).
+//-----------------------------------------------------------------------------
+
+BOOL ImportTables( LPCVOID base, const LPCSTR* libs, ImportFn fn, LPVOID arg )
+{
+  const BYTE*  image = base;
+  const BYTE*  nt;
+  const BYTE*  desc;
+  DWORD        size, rva, dir;
+  ImportTable  it;
+
+  if (U16( image, 0 ) != 0x5A4D)			// "MZ"
+    return FALSE;
+  nt = image + U32( image, DOS_LFANEW );
+  if (U32( nt, 0 ) != 0x4550)				// "PE\0\0"
+    return FALSE;
+  switch (U16( nt, NT_MAGIC ))
+  {
+    case MAGIC_PE32:
+      it.size = 4;
+      dir = (U32( nt, NT_DIRCOUNT32 ) > 1) ? NT_IMPORT32 : 0;
+    break;
+    case MAGIC_PE64:
+      it.size = 8;
+      dir = (U32( nt, NT_DIRCOUNT64 ) > 1) ? NT_IMPORT64 : 0;
+    break;
+    default:
+      return FALSE;
+  }
+  size = U32( nt, NT_IMAGESIZE );
+  rva  = (dir) ? U32( nt, dir ) : 0;
+  if (rva == 0)
+    return TRUE;			// nothing imported
+
+  for (desc = image + rva;
+       desc + ID_SIZE <= image + size && U32( desc, ID_NAME ) != 0;
+       desc += ID_SIZE)
+  {
+    if (U32( desc, ID_NAME ) >= size || U32( desc, ID_FIRST ) >= size ||
+	U32( desc, ID_LOOKUP ) >= size)
+      continue;
+    it.name = (LPCSTR)(image + U32( desc, ID_NAME ));
+    it.lib  = -1;
+    if (libs != NULL)
+    {
+      for (it.lib = 0; libs[it.lib]; ++it.lib)
+	if (stricmp( it.name, libs[it.lib] ) == 0)
+	  break;
+      if (libs[it.lib] == NULL)
+	continue;
+    }
+    it.first  = (LPVOID)(image + U32( desc, ID_FIRST ));
+    it.lookup = (U32( desc, ID_LOOKUP ) != 0)
+		? image + U32( desc, ID_LOOKUP ) : NULL;
+    if (!fn( &it, arg ))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   ImportEntry( it, table, i )
+// Returns entry i of table, the address or lookup table of it.
+//-----------------------------------------------------------------------------
+
+ULONG_PTR ImportEntry( const ImportTable* it, LPCVOID table, DWORD i )
+{
+  if (it->size == 4)
+    return ((const DWORD*)table)[i];
+  return ((const ULONG_PTR*)table)[i];
+}
+
+
+// ========== Address map
+
+static DWORD Hash( ULONG_PTR addr )
+{
+  // Functions are aligned, so the low bits say little.
+  return (DWORD)((addr >> 4) ^ (addr >> 20)) * 2654435761u
+	 >> 16 & (ADDR_SLOTS - 1);
+}
+
+//-----------------------------------------------------------------------------
+//   AddrAdd( map, from, to )
+// Has from replaced with to (ignored if from is 0).  Returns FALSE if the map
+// is full.
+//-----------------------------------------------------------------------------
+
+BOOL AddrAdd( AddrMap* map, ULONG_PTR from, ULONG_PTR to )
+{
+  DWORD h, n;
+
+  if (from == 0)
+    return TRUE;
+  for (h = Hash( from ), n = 0; n < ADDR_SLOTS;
+       h = (h + 1) & (ADDR_SLOTS - 1), ++n)
+  {
+    if (map->from[h] == 0 || map->from[h] == from)
+    {
+      map->from[h] = from;
+      map->to[h]   = to;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   AddrFind( map, from )
+// Returns the replacement of from, or 0 if it has none.
+//-----------------------------------------------------------------------------
+
+ULONG_PTR AddrFind( const AddrMap* map, ULONG_PTR from )
+{
+  DWORD h, n;
+
+  for (h = Hash( from ), n = 0; n < ADDR_SLOTS && map->from[h] != 0;
+       h = (h + 1) & (ADDR_SLOTS - 1), ++n)
+  {
+    if (map->from[h] == from)
+      return map->to[h];
+  }
+  return 0;
+}
+
+
+// ========== Patching
+
+//-----------------------------------------------------------------------------
+//   PatchImports( it, map, protect )
+// Replaces the addresses of the import address table that are in map, using
+// protect to make each page of the table writable while it's patched.
+// Returns the number replaced, or -1 if a page couldn't be made writable.
+//-----------------------------------------------------------------------------
+
+int PatchImports( const ImportTable* it, const AddrMap* map,
+		  ProtectFn protect )
+{
+  BYTE*     entry;
+  BYTE*     page = NULL;
+  ULONG_PTR addr, to;
+  DWORD     prot = 0, dummy;
+  int	    n = 0;
+
+  for (entry = it->first; (addr = ImportEntry( it, entry, 0 )) != 0;
+       entry += it->size)
+  {
+    to = AddrFind( map, addr );
+    if (to == 0)
+      continue;
+    if (PAGE_OF( entry ) != page)
+    {
+      if (page != NULL)
+	protect( page, IAT_PAGE, prot, &dummy );
+      page = PAGE_OF( entry );
+      if (!protect( page, IAT_PAGE, PAGE_READWRITE, &prot ))
+	return -1;
+    }
+    if (it->size == 4)
+      *(DWORD*)entry = (DWORD)to;
+    else
+      *(ULONG_PTR*)entry = to;
+    ++n;
+  }
+  if (page != NULL)
+    protect( page, IAT_PAGE, prot, &dummy );
+  return n;
+}
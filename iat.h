@@ -0,0 +1,56 @@
+/*
+  iat.h - Find and patch the functions a module imports.
+
+  The import tables are read from a module as it is loaded (addressed by
+  RVA): a module of the process or, to measure it without Windows, a PE file
+  laid out by the caller.  PE32 and PE32+ are both read, whatever the
+  platform.
+*/
+
+#ifndef IAT_H
+#define IAT_H
+
+#include "console.h"
+
+#ifndef _WIN32
+typedef size_t ULONG_PTR;
+
+#define PAGE_READWRITE 0x04
+#endif
+
+#define IAT_PAGE 4096		// the unit of protection
+
+// The import address table of a library.
+typedef struct
+{
+  LPCSTR  name; 		// the library's name
+  int	  lib;			// its index in those looked for (-1 if all)
+  LPVOID  first;		// the table (FirstThunk), ending with 0
+  LPCVOID lookup;		// its names (OriginalFirstThunk), or NULL
+  DWORD   size; 		// the size of an entry (4 or 8)
+} ImportTable;
+
+// Called for each table, returning FALSE to stop.
+typedef BOOL (*ImportFn)( const ImportTable*, LPVOID );
+
+// Changes the protection of memory, as VirtualProtect.
+typedef BOOL (*ProtectFn)( LPVOID, size_t, DWORD, LPDWORD );
+
+// Addresses and their replacements, hashed.
+#define ADDR_SLOTS 128		// a power of two, over twice the addresses
+
+typedef struct
+{
+  ULONG_PTR from[ADDR_SLOTS];	// 0 if the slot is unused
+  ULONG_PTR to[ADDR_SLOTS];
+} AddrMap;
+
+BOOL	  ImportTables( LPCVOID base, const LPCSTR* libs, ImportFn fn,
+			LPVOID arg );
+ULONG_PTR ImportEntry( const ImportTable* it, LPCVOID table, DWORD i );
+BOOL	  AddrAdd( AddrMap* map, ULONG_PTR from, ULONG_PTR to );
+ULONG_PTR AddrFind( const AddrMap* map, ULONG_PTR from );
+int	  PatchImports( const ImportTable* it, const AddrMap* map,
+			ProtectFn protect );
+
+#endif
@@ -0,0 +1,407 @@
+/*
+  iatbench.c - Measure hooking the imports of a module.
+
+  Each PE file is laid out as it would be loaded and its imports are given
+  addresses of their own, made from the names of the library and function.
+  The functions ANSI.c hooks are then hooked and restored, REPEAT thousand
+  times, first as ANSICON used to (comparing every address of the tables with
+  every hook, and changing the protection for each one it patches), then as
+  iat.c does.  Both must patch the same addresses, or the file is reported
+  as failed.
+
+  The time is that of hooking and restoring once (the time for a process is
+  that of its modules added together).  The last two columns are the calls
+  that would be made to the system: a VirtualQuery, two VirtualProtects and
+  a WriteProcessMemory for each address before; two VirtualProtects for
+  each page of a table now.
+
+  iatbench [-nREPEAT] file...
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iat.h"
+
+#ifdef _WIN32
+static double Now( void )
+{
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter( &c );
+  QueryPerformanceFrequency( &f );
+  return (double)c.QuadPart / f.QuadPart;
+}
+#else
+#include <time.h>
+static double Now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+#define U16( p, o ) (*(const WORD*)((const BYTE*)(p) + (o)))
+#define U32( p, o ) (*(const DWORD*)((const BYTE*)(p) + (o)))
+
+// The libraries and functions hooked by ANSI.c (kernel32 coming first).
+static const LPCSTR APIs[] =
+{
+  "kernel32.dll",
+  "API-MS-Win-Core-Console-L1-1-0.dll",
+  "API-MS-Win-Core-ProcessThreads-L1-1-0.dll",
+  "API-MS-Win-Core-ProcessEnvironment-L1-1-0.dll",
+  "API-MS-Win-Core-LibraryLoader-L1-1-0.dll",
+  "API-MS-Win-Core-File-L1-1-0.dll",
+  NULL
+};
+
+static const struct
+{
+  int	 lib;
+  LPCSTR name;
+} HookName[] =
+{
+  { 2, "CreateProcessA" },		{ 2, "CreateProcessW" },
+  { 3, "GetEnvironmentVariableA" },	{ 3, "GetEnvironmentVariableW" },
+  { 4, "LoadLibraryA" },		{ 4, "LoadLibraryW" },
+  { 4, "LoadLibraryExA" },		{ 4, "LoadLibraryExW" },
+  { 1, "WriteConsoleA" },		{ 1, "WriteConsoleW" },
+  { 5, "WriteFile" },			{ 1, "ReadConsoleA" },
+  { 1, "ReadConsoleW" },		{ 5, "ReadFile" },
+  { 0, "SetConsoleCursorPosition" },	{ 0, "SetConsoleTextAttribute" },
+  { 0, "SetConsoleScreenBufferSize" },	{ 0, "SetConsoleWindowInfo" },
+  { 0, "GetConsoleScreenBufferInfo" },	{ 1, "SetConsoleMode" },
+  { 2, "ExitProcess" },
+};
+#define HOOKS (sizeof(HookName) / sizeof(*HookName))
+
+// The addresses of the hooks, as HookFn.
+static struct
+{
+  ULONG_PTR newfunc, oldfunc, apifunc;
+} Hook[HOOKS];
+
+static AddrMap HookMap, RestoreKernel, RestoreAPI;
+
+static DWORD Repeat = 10;
+static BYTE* Image;		// the file being measured, as loaded
+static DWORD ImageSize;
+static DWORD Tables, Entries;	// import tables of the APIs, and their size
+static DWORD Calls;		// system calls that would have been made
+static int   Patched;		// addresses patched
+
+
+//-----------------------------------------------------------------------------
+//   Fake( lib, name )
+// Returns the address given to the function name of the library lib.
+//-----------------------------------------------------------------------------
+
+static ULONG_PTR Fake( LPCSTR lib, LPCSTR name )
+{
+  DWORD h = 2166136261u;	// FNV-1a
+
+  for (; *lib; ++lib)
+    h = (h ^ (BYTE)(*lib | 0x20)) * 16777619;	// case doesn't matter
+  h = (h ^ '!') * 16777619;
+  for (; *name; ++name)
+    h = (h ^ (BYTE)*name) * 16777619;
+  return (h & 0x7FFFFFF0) | 0x10000;
+}
+
+//-----------------------------------------------------------------------------
+//   Load( name )
+// Reads the file name and lays it out as it would be loaded, into Image.
+// Returns FALSE if it can't.
+//-----------------------------------------------------------------------------
+
+static BOOL Load( const char* name )
+{
+  FILE* f;
+  BYTE* data;
+  long	size;
+  DWORD nt, sec, n, va, vsize, raw, rsize;
+
+  f = fopen( name, "rb" );
+  if (f == NULL)
+  {
+    perror( name );
+    return FALSE;
+  }
+  fseek( f, 0, SEEK_END );
+  size = ftell( f );
+  rewind( f );
+  data = malloc( size );
+  Image = NULL;
+  if (data != NULL && fread( data, 1, size, f ) == size && size >= 64 &&
+      U16( data, 0 ) == 0x5A4D &&
+      (nt = U32( data, 0x3C )) <= size - 248 && U32( data, nt ) == 0x4550)
+  {
+    ImageSize = U32( data, nt + 80 );		// SizeOfImage
+    if (ImageSize != 0 && ImageSize < 0x10000000)
+      Image = calloc( ImageSize, 1 );
+    if (Image != NULL)
+    {
+      n = U32( data, nt + 84 );			// SizeOfHeaders
+      memcpy( Image, data, (n < ImageSize) ? n : ImageSize );
+      sec = nt + 24 + U16( data, nt + 20 );	// SizeOfOptionalHeader
+      for (n = U16( data, nt + 6 ); n > 0 && sec + 40 <= size; --n)
+      {
+	vsize = U32( data, sec + 8 );
+	va    = U32( data, sec + 12 );
+	rsize = U32( data, sec + 16 );
+	raw   = U32( data, sec + 20 );
+	if (rsize > vsize && vsize != 0)
+	  rsize = vsize;
+	if (raw < size && rsize <= size - raw &&
+	    va < ImageSize && rsize <= ImageSize - va)
+	  memcpy( Image + va, data + raw, rsize );
+	sec += 40;
+      }
+    }
+  }
+  fclose( f );
+  free( data );
+  if (Image == NULL)
+    fprintf( stderr, "%s: not a PE file\n", name );
+  return (Image != NULL);
+}
+
+//-----------------------------------------------------------------------------
+//   Bind( it, arg )
+// Gives each import of the table its address.
+//-----------------------------------------------------------------------------
+
+static BOOL Bind( const ImportTable* it, LPVOID arg )
+{
+  LPCVOID   lookup = (it->lookup) ? it->lookup : it->first;
+  ULONG_PTR v, ordinal;
+  char	    name[16];
+  LPCSTR    fn;
+  DWORD     i;
+
+  ordinal = (ULONG_PTR)1 << (it->size * 8 - 1);
+  for (i = 0; (v = ImportEntry( it, lookup, i )) != 0; ++i)
+  {
+    if (v & ordinal)
+    {
+      sprintf( name, "#%u", (unsigned)(v & 0xFFFF) );
+      fn = name;
+    }
+    else if (v + 2 < ImageSize)
+      fn = (LPCSTR)Image + v + 2;		// past the hint
+    else
+      fn = "";
+    v = Fake( it->name, fn );
+    if (it->size == 4)
+      ((DWORD*)it->first)[i] = (DWORD)v;
+    else
+      ((ULONG_PTR*)it->first)[i] = v;
+  }
+  return TRUE;
+}
+
+
+// ========== Hooking
+
+// The calls are only counted.
+static BOOL Protect( LPVOID addr, size_t size, DWORD prot, LPDWORD old )
+{
+  ++Calls;
+  *old = prot;
+  return TRUE;
+}
+
+// Patch the table as HookAPIOneMod used to.
+static BOOL LinearTable( const ImportTable* it, LPVOID restore )
+{
+  BYTE*     entry;
+  ULONG_PTR addr, patch;
+  unsigned  h;
+
+  for (entry = it->first; ImportEntry( it, entry, 0 ) != 0;
+       entry += it->size)
+  {
+    for (h = 0; h < HOOKS; ++h)
+    {
+      addr  = ImportEntry( it, entry, 0 );
+      patch = 0;
+      if (*(BOOL*)restore)
+      {
+	if (addr == Hook[h].newfunc)
+	  patch = (it->lib == 0) ? Hook[h].oldfunc : Hook[h].apifunc;
+      }
+      else if (addr == Hook[h].oldfunc || addr == Hook[h].apifunc)
+	patch = Hook[h].newfunc;
+      if (patch)
+      {
+	Calls += 4;
+	++Patched;
+	if (it->size == 4)
+	  *(DWORD*)entry = (DWORD)patch;
+	else
+	  *(ULONG_PTR*)entry = patch;
+      }
+    }
+  }
+  return TRUE;
+}
+
+// Patch the table as HookAPIOneMod does.
+static BOOL HashedTable( const ImportTable* it, LPVOID restore )
+{
+  const AddrMap* map;
+
+  map = (!*(BOOL*)restore) ? &HookMap
+	: (it->lib == 0)   ? &RestoreKernel
+			   : &RestoreAPI;
+  Patched += PatchImports( it, map, Protect );
+  return TRUE;
+}
+
+// Count the tables of the APIs and their entries.
+static BOOL CountTable( const ImportTable* it, LPVOID arg )
+{
+  DWORD i;
+
+  for (i = 0; ImportEntry( it, it->first, i ) != 0; ++i) ;
+  ++Tables;
+  Entries += i;
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   Time( fn, calls, patched )
+// Hooks and restores with fn Repeat thousand times, returning the
+// nanoseconds each took, with the calls made and the addresses patched.
+//-----------------------------------------------------------------------------
+
+static double Time( ImportFn fn, DWORD* calls, int* patched )
+{
+  DWORD  r;
+  BOOL	 restore;
+  double t;
+
+  Calls = 0;
+  Patched = 0;
+  t = Now();
+  for (r = 0; r < Repeat * 1000; ++r)
+  {
+    restore = FALSE;
+    ImportTables( Image, APIs, fn, &restore );
+    restore = TRUE;
+    ImportTables( Image, APIs, fn, &restore );
+  }
+  t = Now() - t;
+  *calls   = Calls / (Repeat * 1000);
+  *patched = Patched / (Repeat * 1000);
+  return t * 1e9 / (Repeat * 1000);
+}
+
+//-----------------------------------------------------------------------------
+//   Check( fn, hooked, set )
+// Returns TRUE if hooking with fn gives hooked (or sets hooked to it) and
+// restoring gives the image back.
+//-----------------------------------------------------------------------------
+
+static BOOL Check( ImportFn fn, BYTE* hooked, BOOL set )
+{
+  BYTE* bound;
+  BOOL	restore, ok;
+
+  bound = malloc( ImageSize );
+  if (bound == NULL)
+    return FALSE;
+  memcpy( bound, Image, ImageSize );
+  restore = FALSE;
+  ImportTables( Image, APIs, fn, &restore );
+  if (set)
+    memcpy( hooked, Image, ImageSize );
+  ok = (memcmp( hooked, Image, ImageSize ) == 0);
+  restore = TRUE;
+  ImportTables( Image, APIs, fn, &restore );
+  ok &= (memcmp( bound, Image, ImageSize ) == 0);
+  free( bound );
+  return ok;
+}
+
+
+int main( int argc, char* argv[] )
+{
+  BYTE*    hooked;
+  double   tl, th, sl = 0, sh = 0;
+  DWORD    cl, ch, scl = 0, sch = 0;
+  int	   pl, ph, failed = 0, files = 0, i;
+  unsigned h;
+  char*    name;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+  {
+    if (argv[i][1] == 'n' && atoi( argv[i] + 2 ) > 0)
+      Repeat = atoi( argv[i] + 2 );
+    else
+      break;
+  }
+  if (i == argc || argv[i][0] == '-')
+  {
+    fprintf( stderr, "iatbench [-nREPEAT] file...\n" );
+    return 1;
+  }
+
+  for (h = 0; h < HOOKS; ++h)
+  {
+    Hook[h].oldfunc = Fake( APIs[0], HookName[h].name );
+    Hook[h].apifunc = Fake( APIs[HookName[h].lib], HookName[h].name );
+    Hook[h].newfunc = Fake( "ANSI32.dll", HookName[h].name );
+    if (!AddrAdd( &HookMap, Hook[h].oldfunc, Hook[h].newfunc ) ||
+	!AddrAdd( &HookMap, Hook[h].apifunc, Hook[h].newfunc ) ||
+	!AddrAdd( &RestoreKernel, Hook[h].newfunc, Hook[h].oldfunc ) ||
+	!AddrAdd( &RestoreAPI, Hook[h].newfunc, Hook[h].apifunc ))
+    {
+      fprintf( stderr, "iatbench: the maps are full (ADDR_SLOTS)\n" );
+      return 1;
+    }
+  }
+
+  printf( "%-24s %6s %7s %6s %10s %10s %6s %6s\n", "file", "tables",
+	  "entries", "hooked", "linear ns", "hashed ns", "linear", "hashed" );
+  for (; i < argc; ++i)
+  {
+    if (!Load( argv[i] ))
+    {
+      ++failed;
+      continue;
+    }
+    // Show only the file's name.
+    for (name = argv[i] + strlen( argv[i] );
+	 name > argv[i] && name[-1] != '/' && name[-1] != '\\'; --name) ;
+    ImportTables( Image, NULL, Bind, NULL );
+    Tables = Entries = 0;
+    ImportTables( Image, APIs, CountTable, NULL );
+
+    hooked = malloc( ImageSize );
+    if (hooked == NULL ||
+	!Check( LinearTable, hooked, TRUE ) ||
+	!Check( HashedTable, hooked, FALSE ))
+    {
+      printf( "%-24s FAILED: hooked differently\n", name );
+      ++failed;
+    }
+    else
+    {
+      tl = Time( LinearTable, &cl, &pl );
+      th = Time( HashedTable, &ch, &ph );
+      printf( "%-24s %6lu %7lu %6d %10.0f %10.0f %6lu %6lu\n", name,
+	      (unsigned long)Tables, (unsigned long)Entries, ph / 2, tl, th,
+	      (unsigned long)cl, (unsigned long)ch );
+      sl += tl, sh += th, scl += cl, sch += ch;
+      ++files;
+    }
+    free( hooked );
+    free( Image );
+  }
+  if (files > 1)
+    printf( "%-24s %6s %7s %6s %10.0f %10.0f %6lu %6lu\n", "total", "", "", "",
+	    sl, sh, (unsigned long)scl, (unsigned long)sch );
+  return (failed != 0);
+}
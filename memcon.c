@@ -0,0 +1,552 @@
+/*
+  memcon.c - In-memory console.
+
+  A reference implementation of the console functions used by the escape
+  sequence interpreter, operating on a buffer of cells instead of a real
+  console.  It follows the behaviour of the Windows console with processed
+  output and wrap at end of line enabled: LF is a new line, CR returns to the
+  first column, BS stops at the first column, TAB is filled with spaces to the
+  next multiple of eight and writing past the bottom scrolls the buffer up.
+  The window follows the cursor, as it does when the console is written to.
+
+  Every call is counted, along with the number of cells it touched, so the
+  cost of a sequence of output can be measured without Windows.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "console.h"
+
+#ifndef _WIN32
+#include <time.h>
+
+DWORD GetTickCount( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+#endif
+
+// The rows are circular, so scrolling the whole buffer up is just a matter of
+// moving the first row.
+#define CELL( mc, x, y ) ((mc)->cell[((y) + (mc)->top) % (mc)->info.dwSize.Y \
+				      * (mc)->info.dwSize.X + (x)])
+
+
+// The console's default colors, in the order of the attributes.
+static const COLORREF DefaultPalette[16] =
+{
+  RGB(   0,   0,   0 ), RGB(   0,   0, 128 ), RGB(   0, 128,   0 ),
+  RGB(   0, 128, 128 ), RGB( 128,   0,   0 ), RGB( 128,   0, 128 ),
+  RGB( 128, 128,   0 ), RGB( 192, 192, 192 ), RGB( 128, 128, 128 ),
+  RGB(   0,   0, 255 ), RGB(   0, 255,   0 ), RGB(   0, 255, 255 ),
+  RGB( 255,   0,   0 ), RGB( 255,   0, 255 ), RGB( 255, 255,   0 ),
+  RGB( 255, 255, 255 )
+};
+
+
+// Scroll the window vertically so it contains the cursor.
+static void ShowCursor( PMemCon mc )
+{
+  SMALL_RECT* w = &mc->info.srWindow;
+  SHORT y = mc->info.dwCursorPosition.Y;
+
+  if (y > w->Bottom)
+  {
+    w->Top   += y - w->Bottom;
+    w->Bottom = y;
+  }
+  else if (y < w->Top)
+  {
+    w->Bottom -= w->Top - y;
+    w->Top     = y;
+  }
+}
+
+
+static void FillCells( PCHAR_INFO ci, DWORD len, WCHAR ch, WORD attr )
+{
+  while (len-- > 0)
+  {
+    ci->Char.UnicodeChar = ch;
+    ci->Attributes = attr;
+    ++ci;
+  }
+}
+
+
+static void NewLine( PMemCon mc )
+{
+  COORD* cur = &mc->info.dwCursorPosition;
+
+  cur->X = 0;
+  if (++cur->Y == mc->info.dwSize.Y)
+  {
+    if (++mc->top == mc->info.dwSize.Y)
+      mc->top = 0;
+    --cur->Y;
+    FillCells( &CELL( mc, 0, cur->Y ), mc->info.dwSize.X,
+	       ' ', mc->info.wAttributes );
+    mc->cells += mc->info.dwSize.X;
+  }
+}
+
+
+static void Put( PMemCon mc, LPCWSTR lpBuffer, DWORD nLength )
+{
+  COORD*     cur = &mc->info.dwCursorPosition;
+  PCHAR_INFO row = &CELL( mc, 0, cur->Y );
+  WORD	     attr = mc->info.wAttributes;
+  int	     width = mc->info.dwSize.X;
+  int	     x = cur->X;
+  WCHAR      c;
+  DWORD      n;
+
+  mc->cells += nLength;
+  for (n = 0; n < nLength; ++n)
+  {
+    c = lpBuffer[n];
+    if (c >= ' ' || (c != '\a' && c != '\b' && c != '\t' && c != '\r' &&
+		     c != '\n'))
+    {
+      row[x].Char.UnicodeChar = c;
+      row[x].Attributes = attr;
+      if (++x < width)
+	continue;
+      c = '\n';
+    }
+    switch (c)
+    {
+      case '\b':
+	if (x > 0)
+	  --x;
+      break;
+
+      case '\t':
+	do
+	{
+	  row[x].Char.UnicodeChar = ' ';
+	  row[x].Attributes = attr;
+	} while (++x & 7 && x < width);
+	if (x < width)
+	  break;
+	// fall through
+
+      case '\n':
+	cur->X = x;
+	NewLine( mc );
+	row = &CELL( mc, 0, cur->Y );
+	x = 0;
+      break;
+
+      case '\r':
+	x = 0;
+      break;
+    }
+  }
+  cur->X = x;
+  ShowCursor( mc );
+}
+
+
+static BOOL MC_Write( HANDLE hCon, LPCWSTR lpBuffer, DWORD nLength,
+		      LPDWORD lpWritten )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_WRITE];
+  Put( mc, lpBuffer, nLength );
+  if (lpWritten)
+    *lpWritten = nLength;
+  return TRUE;
+}
+
+
+// The narrow text is taken to be Latin-1.
+static BOOL MC_WriteA( HANDLE hCon, LPCSTR lpBuffer, DWORD nLength,
+		       LPDWORD lpWritten )
+{
+  PMemCon mc = hCon;
+  WCHAR   buf[512];
+  DWORD   pos, n, i;
+
+  ++mc->calls[MC_WRITEA];
+  for (pos = 0; pos < nLength; pos += n)
+  {
+    n = (nLength - pos < 512) ? nLength - pos : 512;
+    for (i = 0; i < n; ++i)
+      buf[i] = (BYTE)lpBuffer[pos + i];
+    Put( mc, buf, n );
+  }
+  if (lpWritten)
+    *lpWritten = nLength;
+  return TRUE;
+}
+
+
+// Intersect r with c, returning FALSE if the result is empty.
+static BOOL Clip( SMALL_RECT* r, const SMALL_RECT* c )
+{
+  if (r->Left	< c->Left)   r->Left   = c->Left;
+  if (r->Top	< c->Top)    r->Top    = c->Top;
+  if (r->Right	> c->Right)  r->Right  = c->Right;
+  if (r->Bottom > c->Bottom) r->Bottom = c->Bottom;
+  return (r->Left <= r->Right && r->Top <= r->Bottom);
+}
+
+
+static BOOL MC_WriteOutput( HANDLE hCon, const CHAR_INFO* lpBuffer,
+			    COORD size, COORD coord, PSMALL_RECT lpRegion )
+{
+  PMemCon    mc = hCon;
+  SMALL_RECT buf, r;
+  int	     y;
+
+  ++mc->calls[MC_WRITEOUTPUT];
+  buf.Left  = buf.Top = 0;
+  buf.Right  = mc->info.dwSize.X - 1;
+  buf.Bottom = mc->info.dwSize.Y - 1;
+  r = *lpRegion;
+  if (r.Right - r.Left > size.X - 1 - coord.X)
+    r.Right = r.Left + size.X - 1 - coord.X;
+  if (r.Bottom - r.Top > size.Y - 1 - coord.Y)
+    r.Bottom = r.Top + size.Y - 1 - coord.Y;
+  if (!Clip( &r, &buf ))
+    return FALSE;
+  coord.X += r.Left - lpRegion->Left;
+  coord.Y += r.Top  - lpRegion->Top;
+  for (y = r.Top; y <= r.Bottom; ++y)
+    memcpy( &CELL( mc, r.Left, y ),
+	    lpBuffer + (coord.Y + y - r.Top) * size.X + coord.X,
+	    (r.Right - r.Left + 1) * sizeof(CHAR_INFO) );
+  mc->cells += (r.Right - r.Left + 1) * (r.Bottom - r.Top + 1);
+  *lpRegion = r;
+  return TRUE;
+}
+
+
+// Return the number of cells from pos to the end of the buffer, or 0 if pos
+// is outside the buffer.
+static DWORD CellsFrom( PMemCon mc, COORD pos )
+{
+  if (pos.X < 0 || pos.X >= mc->info.dwSize.X ||
+      pos.Y < 0 || pos.Y >= mc->info.dwSize.Y)
+    return 0;
+  return (mc->info.dwSize.Y - pos.Y) * mc->info.dwSize.X - pos.X;
+}
+
+
+// Fill nLength cells from pos, wrapping at the end of each row, with the
+// character (if attr is NULL) or the attribute.
+static DWORD Fill( PMemCon mc, WCHAR ch, const WORD* attr, DWORD nLength,
+		   COORD pos )
+{
+  DWORD      max = CellsFrom( mc, pos ), n, len;
+  PCHAR_INFO ci;
+
+  if (nLength > max)
+    nLength = max;
+  mc->cells += nLength;
+  for (len = nLength; len > 0;)
+  {
+    n = mc->info.dwSize.X - pos.X;
+    if (n > len)
+      n = len;
+    for (ci = &CELL( mc, pos.X, pos.Y ); n > 0; --n, --len, ++ci)
+    {
+      if (attr)
+	ci->Attributes = *attr;
+      else
+	ci->Char.UnicodeChar = ch;
+    }
+    pos.X = 0;
+    ++pos.Y;
+  }
+  return nLength;
+}
+
+
+static BOOL MC_FillChar( HANDLE hCon, WCHAR ch, DWORD nLength, COORD pos,
+			 LPDWORD lpWritten )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_FILLCHAR];
+  *lpWritten = Fill( mc, ch, NULL, nLength, pos );
+  return (CellsFrom( mc, pos ) != 0);
+}
+
+
+static BOOL MC_FillAttr( HANDLE hCon, WORD attr, DWORD nLength, COORD pos,
+			 LPDWORD lpWritten )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_FILLATTR];
+  *lpWritten = Fill( mc, 0, &attr, nLength, pos );
+  return (CellsFrom( mc, pos ) != 0);
+}
+
+
+static BOOL MC_Scroll( HANDLE hCon, const SMALL_RECT* lpScroll,
+		       const SMALL_RECT* lpClip, COORD dest,
+		       const CHAR_INFO* lpFill )
+{
+  PMemCon    mc = hCon;
+  SMALL_RECT buf, src, clip, dst;
+  PCHAR_INFO tmp;
+  int	     w, h, x, y;
+
+  ++mc->calls[MC_SCROLL];
+  buf.Left  = buf.Top = 0;
+  buf.Right  = mc->info.dwSize.X - 1;
+  buf.Bottom = mc->info.dwSize.Y - 1;
+
+  // Clip the source to the buffer, moving the destination to match.
+  src = *lpScroll;
+  if (!Clip( &src, &buf ))
+    return FALSE;
+  dest.X += src.Left - lpScroll->Left;
+  dest.Y += src.Top  - lpScroll->Top;
+  clip = buf;
+  if (lpClip && !Clip( &clip, lpClip ))
+    return FALSE;
+
+  w = src.Right - src.Left + 1;
+  h = src.Bottom - src.Top + 1;
+  tmp = malloc( w * h * sizeof(CHAR_INFO) );
+  if (tmp == NULL)
+    return FALSE;
+  for (y = 0; y < h; ++y)
+    memcpy( tmp + y * w, &CELL( mc, src.Left, src.Top + y ),
+	    w * sizeof(CHAR_INFO) );
+
+  // Fill the source, then copy to the destination, both within the clip.
+  if (Clip( &src, &clip ))
+  {
+    for (y = src.Top; y <= src.Bottom; ++y)
+      FillCells( &CELL( mc, src.Left, y ), src.Right - src.Left + 1,
+		 lpFill->Char.UnicodeChar, lpFill->Attributes );
+    mc->cells += (src.Right - src.Left + 1) * (src.Bottom - src.Top + 1);
+  }
+  dst.Left   = dest.X;
+  dst.Top    = dest.Y;
+  dst.Right  = dest.X + w - 1;
+  dst.Bottom = dest.Y + h - 1;
+  if (Clip( &dst, &clip ))
+  {
+    for (y = dst.Top; y <= dst.Bottom; ++y)
+    {
+      x = dst.Left;
+      memcpy( &CELL( mc, x, y ), tmp + (y - dest.Y) * w + (x - dest.X),
+	      (dst.Right - x + 1) * sizeof(CHAR_INFO) );
+    }
+    mc->cells += (dst.Right - dst.Left + 1) * (dst.Bottom - dst.Top + 1);
+  }
+  free( tmp );
+  return TRUE;
+}
+
+
+static BOOL MC_SetCursor( HANDLE hCon, COORD pos )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_SETCURSOR];
+  if (CellsFrom( mc, pos ) == 0)
+    return FALSE;
+  mc->info.dwCursorPosition = pos;
+  ShowCursor( mc );
+  return TRUE;
+}
+
+
+static BOOL MC_SetAttr( HANDLE hCon, WORD attr )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_SETATTR];
+  mc->info.wAttributes = attr;
+  return TRUE;
+}
+
+
+static BOOL MC_GetInfo( HANDLE hCon, PCONSOLE_SCREEN_BUFFER_INFO pcsbi )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_GETINFO];
+  *pcsbi = mc->info;
+  return TRUE;
+}
+
+
+static BOOL MC_SetTitle( HANDLE hCon, LPCWSTR lpTitle )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_SETTITLE];
+  return TRUE;
+}
+
+
+static BOOL MC_ReadOutput( HANDLE hCon, PCHAR_INFO lpBuffer, COORD size,
+			   COORD coord, PSMALL_RECT lpRegion )
+{
+  PMemCon    mc = hCon;
+  SMALL_RECT buf, r;
+  int	     y;
+
+  ++mc->calls[MC_READOUTPUT];
+  buf.Left  = buf.Top = 0;
+  buf.Right  = mc->info.dwSize.X - 1;
+  buf.Bottom = mc->info.dwSize.Y - 1;
+  r = *lpRegion;
+  if (r.Right - r.Left > size.X - 1 - coord.X)
+    r.Right = r.Left + size.X - 1 - coord.X;
+  if (r.Bottom - r.Top > size.Y - 1 - coord.Y)
+    r.Bottom = r.Top + size.Y - 1 - coord.Y;
+  if (!Clip( &r, &buf ))
+    return FALSE;
+  coord.X += r.Left - lpRegion->Left;
+  coord.Y += r.Top  - lpRegion->Top;
+  for (y = r.Top; y <= r.Bottom; ++y)
+    memcpy( lpBuffer + (coord.Y + y - r.Top) * size.X + coord.X,
+	    &CELL( mc, r.Left, y ),
+	    (r.Right - r.Left + 1) * sizeof(CHAR_INFO) );
+  mc->cells += (r.Right - r.Left + 1) * (r.Bottom - r.Top + 1);
+  *lpRegion = r;
+  return TRUE;
+}
+
+
+static BOOL MC_SetVisible( HANDLE hCon, BOOL bVisible )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_SETVISIBLE];
+  mc->visible = bVisible;
+  return TRUE;
+}
+
+
+static BOOL MC_GetPalette( HANDLE hCon, COLORREF* lpPalette )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_GETPALETTE];
+  memcpy( lpPalette, mc->palette, sizeof(mc->palette) );
+  return TRUE;
+}
+
+
+// Changing the palette redraws every cell of the window.
+static BOOL MC_SetPalette( HANDLE hCon, const COLORREF* lpPalette )
+{
+  PMemCon mc = hCon;
+
+  ++mc->calls[MC_SETPALETTE];
+  memcpy( mc->palette, lpPalette, sizeof(mc->palette) );
+  mc->cells += (mc->info.srWindow.Right - mc->info.srWindow.Left + 1)
+	       * (mc->info.srWindow.Bottom - mc->info.srWindow.Top + 1);
+  return TRUE;
+}
+
+
+ConsoleFn MemConFn =
+{
+  MC_Write,
+  MC_WriteA,
+  MC_WriteOutput,
+  MC_FillChar,
+  MC_FillAttr,
+  MC_Scroll,
+  MC_SetCursor,
+  MC_SetAttr,
+  MC_GetInfo,
+  MC_SetTitle,
+  MC_ReadOutput,
+  MC_SetVisible,
+  MC_GetPalette,
+  MC_SetPalette
+};
+
+
+//-----------------------------------------------------------------------------
+//   MemCon_Create()
+// Create a console with a buffer of width by height cells and a window of
+// wwidth by wheight, using attr as the current attribute.
+// Return NULL if there is not enough memory.
+//-----------------------------------------------------------------------------
+
+PMemCon MemCon_Create( int width, int height, int wwidth, int wheight,
+		       WORD attr )
+{
+  PMemCon mc;
+
+  mc = calloc( 1, sizeof(MemCon) );
+  if (mc == NULL)
+    return NULL;
+  mc->cell = malloc( width * height * sizeof(CHAR_INFO) );
+  if (mc->cell == NULL)
+  {
+    free( mc );
+    return NULL;
+  }
+  if (wwidth > width)	wwidth	= width;
+  if (wheight > height) wheight = height;
+  mc->info.dwSize.X = width;
+  mc->info.dwSize.Y = height;
+  mc->info.dwMaximumWindowSize.X = wwidth;
+  mc->info.dwMaximumWindowSize.Y = wheight;
+  mc->info.wAttributes = attr;
+  MemCon_Reset( mc );
+  return mc;
+}
+
+
+void MemCon_Destroy( PMemCon mc )
+{
+  if (mc)
+  {
+    free( mc->cell );
+    free( mc );
+  }
+}
+
+
+//-----------------------------------------------------------------------------
+//   MemCon_Reset()
+// Clear the buffer to the current attribute, home the cursor and window,
+// restore the default palette and zero the counters.
+//-----------------------------------------------------------------------------
+
+void MemCon_Reset( PMemCon mc )
+{
+  FillCells( mc->cell, mc->info.dwSize.X * mc->info.dwSize.Y,
+	     ' ', mc->info.wAttributes );
+  mc->top = 0;
+  mc->visible = TRUE;
+  mc->info.dwCursorPosition.X = 0;
+  mc->info.dwCursorPosition.Y = 0;
+  mc->info.srWindow.Left   = 0;
+  mc->info.srWindow.Top    = 0;
+  mc->info.srWindow.Right  = mc->info.dwMaximumWindowSize.X - 1;
+  mc->info.srWindow.Bottom = mc->info.dwMaximumWindowSize.Y - 1;
+  memcpy( mc->palette, DefaultPalette, sizeof(mc->palette) );
+  memset( mc->calls, 0, sizeof(mc->calls) );
+  mc->cells = 0;
+}
+
+
+// Total number of console calls made.
+DWORD MemCon_Calls( PMemCon mc )
+{
+  DWORD n = 0;
+  int	i;
+
+  for (i = 0; i < MC_CALLS; ++i)
+    n += mc->calls[i];
+  return n;
+}
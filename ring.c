@@ -0,0 +1,375 @@
+/*
+  ring.c - A ring buffer of writes, consumed by a thread of its own.
+
+  Writers reserve their space by moving the head with a compare-and-swap,
+  then fill it in and commit it by setting its len last; the consumer stops
+  at a record not yet committed and clears the len of everything it consumes.
+  The tail is only moved by the thread.  Each side only signals the other
+  when it knows it's asleep, and a waiting writer is only woken once half the
+  ring is free, so a busy ring makes no system calls.
+
+  Each write is its header and data, padded to RING_ALIGN bytes; a write too
+  big for a quarter of the ring is added in pieces, each with its own header
+  (all but the last having `more' set).  A write never wraps around the end
+  of the ring: the rest of the ring is skipped instead, so the consumer
+  always sees the data in one piece.
+
+  Only writers that must wait for room or write in pieces take the put lock.
+  While one holds it, the others take it too, so pieces stay together; one
+  that reserved its space just as the lock was taken pads it out instead.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sched.h>
+#endif
+#include "ring.h"
+
+#define RING_ALIGN    32	// at least the size of RingRec
+#define RING_ROUND( n ) (((n) + RING_ALIGN - 1) & ~(RING_ALIGN - 1))
+#define RING_MIN      64	// smallest ring, in KB
+#define RING_SKIP     0xFFFFFFFF // len of a header that skips to the start
+#define RING_PAD      0xFFFF	// more of a header that is not a write
+
+#define BARRIER() __sync_synchronize()
+
+
+// ========== Threads
+
+#ifdef _WIN32
+#define LockInit( l ) InitializeCriticalSection( l )
+#define Lock( l )     EnterCriticalSection( l )
+#define Unlock( l )   LeaveCriticalSection( l )
+#define Pause()       SwitchToThread()
+
+static void EventInit( RingEvent* e )
+{
+  *e = CreateEvent( NULL, FALSE, FALSE, NULL );
+}
+
+static void EventSet( RingEvent* e )
+{
+  SetEvent( *e );
+}
+
+static void EventWait( RingEvent* e )
+{
+  WaitForSingleObject( *e, INFINITE );
+}
+#else
+#define LockInit( l ) pthread_mutex_init( l, NULL )
+#define Lock( l )     pthread_mutex_lock( l )
+#define Unlock( l )   pthread_mutex_unlock( l )
+#define Pause()       sched_yield()
+
+static void EventInit( RingEvent* e )
+{
+  pthread_mutex_init( &e->m, NULL );
+  pthread_cond_init( &e->c, NULL );
+  e->set = 0;
+}
+
+static void EventSet( RingEvent* e )
+{
+  pthread_mutex_lock( &e->m );
+  e->set = 1;
+  pthread_cond_signal( &e->c );
+  pthread_mutex_unlock( &e->m );
+}
+
+static void EventWait( RingEvent* e )
+{
+  pthread_mutex_lock( &e->m );
+  while (!e->set)
+    pthread_cond_wait( &e->c, &e->m );
+  e->set = 0;
+  pthread_mutex_unlock( &e->m );
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+//   WaitRoom( r, room )
+// Waits until the ring has room bytes free (its size waits for it to empty).
+// Must hold the put lock.
+//-----------------------------------------------------------------------------
+
+static void WaitRoom( Ring* r, DWORD room )
+{
+  while (r->size - (r->head - r->tail) < room)
+  {
+    r->waiting = TRUE;
+    BARRIER();
+    if (r->size - (r->head - r->tail) < room)
+      EventWait( &r->room );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   Reserve( r, n, wait )
+// Reserves room for a record of n bytes, skipping the end of the ring if it
+// won't fit, and returns its header.  If there's no room, waits for it (which
+// must hold the put lock) or returns NULL.
+//-----------------------------------------------------------------------------
+
+static RingRec* Reserve( Ring* r, DWORD n, BOOL wait )
+{
+  DWORD head, need, pos, skip;
+
+  need = RING_ALIGN + RING_ROUND( n );
+  for (;;)
+  {
+    head = r->head;
+    pos  = head & (r->size - 1);
+    skip = (pos + need > r->size) ? r->size - pos : 0;
+    if (r->size - (head - r->tail) < skip + need)
+    {
+      if (!wait)
+	return NULL;
+      WaitRoom( r, skip + need );
+    }
+    else if (__sync_bool_compare_and_swap( &r->head, head, head+skip+need ))
+      break;
+  }
+  if (skip)
+  {
+    ((RingRec*)(r->buf + pos))->len = RING_SKIP;
+    pos = 0;
+  }
+  return (RingRec*)(r->buf + pos);
+}
+
+//-----------------------------------------------------------------------------
+//   Commit( r, q, rec, data, n, more )
+// Fills in the reserved record q with n bytes of data and lets the thread
+// have it.  If more is RING_PAD, the record is only padding.
+//-----------------------------------------------------------------------------
+
+static void Commit( Ring* r, RingRec* q, const RingRec* rec, const char* data,
+		    DWORD n, WORD more )
+{
+  RingRec hdr = *rec;
+
+  hdr.more = more;
+  hdr.len  = 0;
+  *q = hdr;
+  if (more != RING_PAD)
+    memcpy( (char*)q + RING_ALIGN, data, n );
+  BARRIER();
+  q->len = n;
+  BARRIER();
+  if (r->sleeping)
+  {
+    r->sleeping = FALSE;
+    EventSet( &r->data );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   RingPut( r, rec, data )
+// Adds a write (of rec->len bytes) to the ring.
+//-----------------------------------------------------------------------------
+
+void RingPut( Ring* r, const RingRec* rec, LPCVOID data )
+{
+  const char* s = data;
+  RingRec*    q;
+  DWORD       len, n;
+
+  if (rec->len == 0)
+    return;
+  if (rec->len <= r->size / 4 && !r->hold)
+  {
+    q = Reserve( r, rec->len, FALSE );
+    if (q != NULL)
+    {
+      // The swap is a barrier, so if the lock was taken before it, this
+      // sees it (and the record may be between pieces).
+      if (!r->hold)
+      {
+	Commit( r, q, rec, s, rec->len, 0 );
+	return;
+      }
+      Commit( r, q, rec, s, rec->len, RING_PAD );
+    }
+  }
+
+  Lock( &r->put );
+  r->hold = TRUE;
+  BARRIER();
+  for (len = rec->len; len != 0; len -= n, s += n)
+  {
+    n = (len > r->size / 4) ? r->size / 4 : len;
+    q = Reserve( r, n, TRUE );
+    Commit( r, q, rec, s, n, (len > n) );
+  }
+  r->hold = FALSE;
+  Unlock( &r->put );
+}
+
+//-----------------------------------------------------------------------------
+//   RingDrain( r )
+// Waits until the thread has consumed everything in the ring.
+//-----------------------------------------------------------------------------
+
+void RingDrain( Ring* r )
+{
+  Lock( &r->put );
+  WaitRoom( r, r->size );
+  Unlock( &r->put );
+}
+
+//-----------------------------------------------------------------------------
+//   Consume( r, wait )
+// Consumes everything in the ring, waiting for records still being written
+// (or stopping at them, if wait is FALSE).  Must hold the take lock.
+//-----------------------------------------------------------------------------
+
+static void Consume( Ring* r, BOOL wait )
+{
+  RingRec* q;
+  DWORD    tail, pos, len, span, i;
+
+  while ((tail = r->tail) != r->head)
+  {
+    pos = tail & (r->size - 1);
+    q	= (RingRec*)(r->buf + pos);
+    len = q->len;
+    if (len == 0)
+    {
+      if (!wait)
+	break;
+      Pause();
+      continue;
+    }
+    BARRIER();
+    if (len == RING_SKIP)
+      span = r->size - pos;
+    else
+    {
+      span = RING_ALIGN + RING_ROUND( len );
+      if (q->more != RING_PAD)
+	r->consume( q, (const char*)q + RING_ALIGN );
+    }
+    // A later header may land anywhere in the span.
+    for (i = 0; i < span; i += RING_ALIGN)
+      ((RingRec*)((char*)q + i))->len = 0;
+    BARRIER();
+    r->tail = tail + span;
+    BARRIER();
+    if (r->waiting && r->head - r->tail <= r->size / 2)
+    {
+      r->waiting = FALSE;
+      EventSet( &r->room );
+    }
+  }
+  if (r->waiting)
+  {
+    r->waiting = FALSE;
+    EventSet( &r->room );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   RingMain( r )
+// The thread: consumes the ring as it fills, until stopped.
+//-----------------------------------------------------------------------------
+
+#ifdef _WIN32
+static DWORD WINAPI RingMain( LPVOID arg )
+#else
+static void* RingMain( void* arg )
+#endif
+{
+  Ring* r = arg;
+
+  for (;;)
+  {
+    if (RingEmpty( r ))
+    {
+      if (r->idle)
+	r->idle();
+      r->sleeping = TRUE;
+      BARRIER();
+      if (RingEmpty( r ) && r->running)
+	EventWait( &r->data );
+      r->sleeping = FALSE;
+    }
+    Lock( &r->take );
+    if (!r->running)
+    {
+      Unlock( &r->take );
+      break;
+    }
+    Consume( r, TRUE );
+    Unlock( &r->take );
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+//   RingInit( r, kb )
+// Starts the thread, with a ring of kb kilobytes (rounded up to a power of
+// two, at least RING_MIN).  The consumer must already be set.
+//-----------------------------------------------------------------------------
+
+BOOL RingInit( Ring* r, DWORD kb )
+{
+  for (r->size = RING_MIN * 1024; r->size < kb * 1024; r->size <<= 1) ;
+  r->buf = calloc( 1, r->size );	// every len is zero
+  if (r->buf == NULL)
+    return FALSE;
+  r->head = r->tail = 0;
+  r->hold = FALSE;
+  EventInit( &r->data );
+  EventInit( &r->room );
+  LockInit( &r->put );
+  LockInit( &r->take );
+  r->running = TRUE;
+#ifdef _WIN32
+  {
+    HANDLE hThread = CreateThread( NULL, 0, RingMain, r, 0, &r->thread );
+    if (hThread == NULL)
+      return (r->running = FALSE);
+    CloseHandle( hThread );
+  }
+#else
+  if (pthread_create( &r->thread, NULL, RingMain, r ) != 0)
+    return (r->running = FALSE);
+  pthread_detach( r->thread );
+#endif
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   RingStop( r )
+// Consumes what remains in the ring on this thread and stops the ring's.
+// Used when the process exits, in which case the thread may already be gone
+// (as may a writer, so a record it never committed ends the ring).
+//-----------------------------------------------------------------------------
+
+void RingStop( Ring* r )
+{
+  if (!r->running)
+    return;
+  Lock( &r->take );
+  r->running = FALSE;
+  Consume( r, FALSE );
+  Unlock( &r->take );
+  EventSet( &r->data );
+}
+
+//-----------------------------------------------------------------------------
+//   RingThreadIs( r )
+// Returns TRUE if this is the ring's thread.
+//-----------------------------------------------------------------------------
+
+BOOL RingThreadIs( Ring* r )
+{
+#ifdef _WIN32
+  return (GetCurrentThreadId() == r->thread);
+#else
+  return pthread_equal( pthread_self(), r->thread );
+#endif
+}
@@ -0,0 +1,70 @@
+/*
+  ring.h - A ring buffer of writes, consumed by a thread of its own.
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include "console.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// The header of a write in the ring.  Everything but len and more is up to
+// the user.
+typedef struct
+{
+  HANDLE      h;		// the handle written to
+  const void* arg;		// anything else the consumer needs
+  ULONGLONG   time;		// when it was written
+  WORD	      kind;		// what sort of write it is
+  WORD	      more;		// the write continues in the next record
+  DWORD       len;		// bytes of data
+} RingRec;
+
+#ifdef _WIN32
+typedef HANDLE		 RingEvent;
+typedef CRITICAL_SECTION RingLock;
+typedef DWORD		 RingThread;
+#else
+typedef struct
+{
+  pthread_mutex_t m;
+  pthread_cond_t  c;
+  int		  set;
+} RingEvent;
+typedef pthread_mutex_t  RingLock;
+typedef pthread_t	 RingThread;
+#endif
+
+typedef struct Ring Ring;
+struct Ring
+{
+  // Given to RingInit.
+  void (*consume)( const RingRec* rec, const char* data );
+  void (*idle)( void ); 	// called when the ring empties (may be NULL)
+
+  char* 	 buf;
+  DWORD 	 size;		// a power of two
+  volatile DWORD head;		// bytes ever added
+  volatile DWORD tail;		// bytes ever consumed
+  volatile BOOL  running;	// the thread is consuming
+  volatile BOOL  sleeping;	// the thread waits for data
+  volatile BOOL  waiting;	// a writer waits for room
+  volatile BOOL  hold;		// a writer holds the put lock
+  RingEvent	 data, room;
+  RingLock	 put;		// writers that wait or write in pieces
+  RingLock	 take;		// so does the thread with RingStop
+  RingThread	 thread;
+};
+
+BOOL RingInit( Ring* r, DWORD kb );
+void RingPut( Ring* r, const RingRec* rec, LPCVOID data );
+void RingDrain( Ring* r );
+void RingStop( Ring* r );
+BOOL RingThreadIs( Ring* r );
+
+#define RingEmpty( r ) ((r)->head == (r)->tail)
+
+#endif
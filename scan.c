@@ -0,0 +1,335 @@
+/*
+  scan.c - Find the characters of interest to the interpreter.
+
+  Most output is plain text, so finding the next escape (or the next character
+  that does more than advance the cursor) quickly is what matters.  There are
+  versions for wide and narrow text.  AVX2 is used if the processor has it,
+  SSE2 if the compiler targets it, otherwise a simple loop.
+
+  Wide text may also have the 8-bit (C1) controls, U+0080 to U+009F, which
+  start sequences of their own (U+009B is CSI); narrow text is only ASCII.
+  Carriage returns followed by something other than a new line are found
+  with the escapes, since they start drawing over the line.
+*/
+
+#include "scan.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && __GNUC__ >= 5 && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#define ESC '\x1B'
+
+// ESC, CR (followed by other than LF) or a C1 control, at s[i].
+#define IsCR( s, i, len ) ((s)[i] == '\r' && (i) + 1 < (len) && \
+			   (s)[(i)+1] != '\n')
+#define IsEsc( s, i, len ) ((s)[i] == ESC || (WORD)((s)[i] - 0x80) < 0x20 || \
+			    IsCR( s, i, len ))
+#define IsEscA( s, i, len ) ((s)[i] == ESC || IsCR( s, i, len ))
+
+// Characters that only advance the cursor one cell are from space to before
+// the first of the (potentially) wide characters.
+#define FIRST_WIDE 0x1100
+#define IsCtrl( c ) ((WORD)((c) - ' ') >= FIRST_WIDE - ' ')
+
+// Narrow text is only known to be ASCII.
+#define IsCtrlA( c ) ((BYTE)((c) - ' ') >= 0x80 - ' ')
+
+
+#ifdef HAVE_AVX2
+static int avx2 = -1;
+
+static int HasAVX2( void )
+{
+  if (avx2 < 0)
+  {
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports( "avx2" ) != 0;
+  }
+  return avx2;
+}
+
+__attribute__((target("avx2")))
+static DWORD FindEscAVX2( LPCTSTR s, DWORD len )
+{
+  // C1 is an unsigned compare, biased as in FindCtrlAVX2.
+  const __m256i esc  = _mm256_set1_epi16( ESC );
+  const __m256i cr   = _mm256_set1_epi16( '\r' );
+  const __m256i lf   = _mm256_set1_epi16( '\n' );
+  const __m256i c1   = _mm256_set1_epi16( 0x80 );
+  const __m256i bias = _mm256_set1_epi16( (short)0x8000 );
+  const __m256i lim  = _mm256_set1_epi16( (short)(0x20 ^ 0x8000) );
+  DWORD i;
+
+  for (i = 0; i + 16 < len; i += 16)
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*)(s + i) );
+    __m256i n = _mm256_loadu_si256( (const __m256i*)(s + i + 1) );
+    __m256i c = _mm256_xor_si256( _mm256_sub_epi16( v, c1 ), bias );
+    __m256i r = _mm256_andnot_si256( _mm256_cmpeq_epi16( n, lf ),
+				      _mm256_cmpeq_epi16( v, cr ) );
+    DWORD   m;
+    r = _mm256_or_si256( r, _mm256_cmpeq_epi16( v, esc ) );
+    m = _mm256_movemask_epi8( _mm256_or_si256( r,
+					       _mm256_cmpgt_epi16( lim, c ) ) );
+    if (m)
+      return i + (__builtin_ctz( m ) >> 1);
+  }
+  for (; i < len; ++i)
+    if (IsEsc( s, i, len ))
+      break;
+  return i;
+}
+
+__attribute__((target("avx2")))
+static DWORD FindEscAAVX2( const char* s, DWORD len )
+{
+  const __m256i esc = _mm256_set1_epi8( ESC );
+  const __m256i cr  = _mm256_set1_epi8( '\r' );
+  const __m256i lf  = _mm256_set1_epi8( '\n' );
+  DWORD i;
+
+  for (i = 0; i + 32 < len; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*)(s + i) );
+    __m256i n = _mm256_loadu_si256( (const __m256i*)(s + i + 1) );
+    __m256i r = _mm256_andnot_si256( _mm256_cmpeq_epi8( n, lf ),
+				     _mm256_cmpeq_epi8( v, cr ) );
+    DWORD   m = _mm256_movemask_epi8( _mm256_or_si256(
+				      _mm256_cmpeq_epi8( v, esc ), r ) );
+    if (m)
+      return i + __builtin_ctz( m );
+  }
+  for (; i < len; ++i)
+    if (IsEscA( s, i, len ))
+      break;
+  return i;
+}
+
+__attribute__((target("avx2")))
+static DWORD FindCtrlAVX2( LPCTSTR s, DWORD len )
+{
+  // Unsigned compare by biasing: c is plain when (c - ' ') ^ 0x8000 is less
+  // than (FIRST_WIDE - ' ') ^ 0x8000 as a signed number.
+  const __m256i sp   = _mm256_set1_epi16( ' ' );
+  const __m256i bias = _mm256_set1_epi16( (short)0x8000 );
+  const __m256i lim  = _mm256_set1_epi16( (short)((FIRST_WIDE - ' ') ^ 0x8000) );
+  DWORD i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*)(s + i) );
+    v = _mm256_xor_si256( _mm256_sub_epi16( v, sp ), bias );
+    DWORD m = ~_mm256_movemask_epi8( _mm256_cmpgt_epi16( lim, v ) );
+    if (m)
+      return i + (__builtin_ctz( m ) >> 1);
+  }
+  for (; i < len; ++i)
+    if (IsCtrl( s[i] ))
+      break;
+  return i;
+}
+
+__attribute__((target("avx2")))
+static DWORD FindCtrlAAVX2( const char* s, DWORD len )
+{
+  // Plain characters are those greater than 0x1F as signed bytes.
+  const __m256i us = _mm256_set1_epi8( ' ' - 1 );
+  DWORD i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*)(s + i) );
+    DWORD   m = ~_mm256_movemask_epi8( _mm256_cmpgt_epi8( v, us ) );
+    if (m)
+      return i + __builtin_ctz( m );
+  }
+  for (; i < len; ++i)
+    if (IsCtrlA( s[i] ))
+      break;
+  return i;
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+//   FindEsc( s, len )
+// Returns the index of the first ESC, C1 control or CR followed by other than
+// LF in s, or len if there isn't one.
+//-----------------------------------------------------------------------------
+
+DWORD FindEsc( LPCTSTR s, DWORD len )
+{
+  DWORD i = 0;
+
+#ifdef HAVE_AVX2
+  if (HasAVX2())
+    return FindEscAVX2( s, len );
+#endif
+#ifdef __SSE2__
+  {
+    const __m128i esc  = _mm_set1_epi16( ESC );
+    const __m128i cr   = _mm_set1_epi16( '\r' );
+    const __m128i lf   = _mm_set1_epi16( '\n' );
+    const __m128i c1   = _mm_set1_epi16( 0x80 );
+    const __m128i bias = _mm_set1_epi16( (short)0x8000 );
+    const __m128i lim  = _mm_set1_epi16( (short)(0x20 ^ 0x8000) );
+    for (; i + 8 < len; i += 8)
+    {
+      __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+      __m128i n = _mm_loadu_si128( (const __m128i*)(s + i + 1) );
+      __m128i c = _mm_xor_si128( _mm_sub_epi16( v, c1 ), bias );
+      __m128i r = _mm_andnot_si128( _mm_cmpeq_epi16( n, lf ),
+				    _mm_cmpeq_epi16( v, cr ) );
+      int     m;
+      r = _mm_or_si128( r, _mm_cmpeq_epi16( v, esc ) );
+      m = _mm_movemask_epi8( _mm_or_si128( r, _mm_cmpgt_epi16( lim, c ) ) );
+      if (m)
+	return i + (__builtin_ctz( m ) >> 1);
+    }
+  }
+#endif
+  for (; i < len; ++i)
+    if (IsEsc( s, i, len ))
+      break;
+  return i;
+}
+
+
+//-----------------------------------------------------------------------------
+//   FindEscA( s, len )
+// Returns the index of the first ESC or CR followed by other than LF in the
+// narrow string s, or len if there isn't one.
+//-----------------------------------------------------------------------------
+
+DWORD FindEscA( const char* s, DWORD len )
+{
+  DWORD i = 0;
+
+#ifdef HAVE_AVX2
+  if (HasAVX2())
+    return FindEscAAVX2( s, len );
+#endif
+#ifdef __SSE2__
+  {
+    const __m128i esc = _mm_set1_epi8( ESC );
+    const __m128i cr  = _mm_set1_epi8( '\r' );
+    const __m128i lf  = _mm_set1_epi8( '\n' );
+    for (; i + 16 < len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+      __m128i n = _mm_loadu_si128( (const __m128i*)(s + i + 1) );
+      __m128i r = _mm_andnot_si128( _mm_cmpeq_epi8( n, lf ),
+				    _mm_cmpeq_epi8( v, cr ) );
+      int     m = _mm_movemask_epi8( _mm_or_si128( r,
+						   _mm_cmpeq_epi8( v, esc ) ) );
+      if (m)
+	return i + __builtin_ctz( m );
+    }
+  }
+#endif
+  for (; i < len; ++i)
+    if (IsEscA( s, i, len ))
+      break;
+  return i;
+}
+
+
+//-----------------------------------------------------------------------------
+//   FindCtrl( s, len )
+// Returns the index of the first character in s that does something other
+// than advance the cursor one cell (a control character or one that may be
+// wide), or len if there isn't one.
+//-----------------------------------------------------------------------------
+
+DWORD FindCtrl( LPCTSTR s, DWORD len )
+{
+  DWORD i = 0;
+
+#ifdef HAVE_AVX2
+  if (HasAVX2())
+    return FindCtrlAVX2( s, len );
+#endif
+#ifdef __SSE2__
+  {
+    const __m128i sp   = _mm_set1_epi16( ' ' );
+    const __m128i bias = _mm_set1_epi16( (short)0x8000 );
+    const __m128i lim  = _mm_set1_epi16( (short)((FIRST_WIDE - ' ') ^ 0x8000) );
+    for (; i + 8 <= len; i += 8)
+    {
+      __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+      v = _mm_xor_si128( _mm_sub_epi16( v, sp ), bias );
+      int m = ~_mm_movemask_epi8( _mm_cmpgt_epi16( lim, v ) ) & 0xFFFF;
+      if (m)
+	return i + (__builtin_ctz( m ) >> 1);
+    }
+  }
+#endif
+  for (; i < len; ++i)
+    if (IsCtrl( s[i] ))
+      break;
+  return i;
+}
+
+
+//-----------------------------------------------------------------------------
+//   FindCtrlA( s, len )
+// Returns the index of the first character in the narrow string s that is
+// not ASCII, or is a control character, or len if there isn't one.
+//-----------------------------------------------------------------------------
+
+DWORD FindCtrlA( const char* s, DWORD len )
+{
+  DWORD i = 0;
+
+#ifdef HAVE_AVX2
+  if (HasAVX2())
+    return FindCtrlAAVX2( s, len );
+#endif
+#ifdef __SSE2__
+  {
+    const __m128i us = _mm_set1_epi8( ' ' - 1 );
+    for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+      int m = ~_mm_movemask_epi8( _mm_cmpgt_epi8( v, us ) ) & 0xFFFF;
+      if (m)
+	return i + __builtin_ctz( m );
+    }
+  }
+#endif
+  for (; i < len; ++i)
+    if (IsCtrlA( s[i] ))
+      break;
+  return i;
+}
+
+
+//-----------------------------------------------------------------------------
+//   FindNonAscii( s, len )
+// Returns the index of the first byte in s that is not ASCII, or len if
+// there isn't one.
+//-----------------------------------------------------------------------------
+
+DWORD FindNonAscii( const char* s, DWORD len )
+{
+  DWORD i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16)
+  {
+    int m = _mm_movemask_epi8( _mm_loadu_si128( (const __m128i*)(s + i) ) );
+    if (m)
+      return i + __builtin_ctz( m );
+  }
+#endif
+  for (; i < len; ++i)
+    if ((BYTE)s[i] >= 0x80)
+      break;
+  return i;
+}
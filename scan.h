@@ -0,0 +1,16 @@
+/*
+  scan.h - Find the characters of interest to the interpreter.
+*/
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "console.h"
+
+DWORD FindEsc( LPCTSTR s, DWORD len );
+DWORD FindEscA( const char* s, DWORD len );
+DWORD FindCtrl( LPCTSTR s, DWORD len );
+DWORD FindCtrlA( const char* s, DWORD len );
+DWORD FindNonAscii( const char* s, DWORD len );
+
+#endif
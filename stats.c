@@ -0,0 +1,314 @@
+/*
+  stats.c - Counters and console call latencies of the interpreter.
+
+  The console calls are counted (and timed) by a backend that wraps the real
+  one, so nothing changes when StatInit isn't called.  Without Windows (or if
+  the shared memory can't be made), the counters are kept in a local block.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+static Stats	  Local;
+Stats*		  Stat = &Local;
+static PConsoleFn Inner;		// the backend being counted
+
+#ifdef _WIN32
+#define LLU "I64u"		// msvcrt doesn't know %llu
+#else
+#define LLU "llu"
+#endif
+
+static const char* const CallName[MC_CALLS] =
+{
+  "Write", "WriteA", "WriteOutput", "FillChar", "FillAttr", "Scroll",
+  "SetCursor", "SetAttr", "GetInfo", "SetTitle", "ReadOutput", "SetVisible",
+  "GetPalette", "SetPalette"
+};
+
+
+// ========== Timing
+
+#ifdef _WIN32
+static double NsPerTick;
+
+static ULONGLONG Ticks( void )
+{
+  LARGE_INTEGER c;
+  QueryPerformanceCounter( &c );
+  return c.QuadPart;
+}
+
+#define TICKS_NS( t ) ((ULONGLONG)((t) * NsPerTick))
+#else
+static ULONGLONG Ticks( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define TICKS_NS( t ) (t)
+#endif
+
+static int Bucket( ULONGLONG ns )
+{
+  int e, b;
+
+  if (ns < 4)
+    return (int)ns;
+  e = 63 - __builtin_clzll( ns );
+  b = (e - 1) * 4 + (int)((ns >> (e - 2)) & 3);
+  return (b < STAT_BUCKETS) ? b : STAT_BUCKETS - 1;
+}
+
+// The lowest latency in bucket b.
+static ULONGLONG BucketLow( int b )
+{
+  if (b < 4)
+    return b;
+  return (ULONGLONG)(4 + b % 4) << (b / 4 - 1);
+}
+
+// Counts a call, timing it if a reader wants it.
+#define COUNT( c, call ) \
+  if (!Stat->timing) \
+  { \
+    ++Stat->calls[c]; \
+    return call; \
+  } \
+  else \
+  { \
+    ULONGLONG t = Ticks(); \
+    BOOL      rc = call; \
+    t = TICKS_NS( Ticks() - t ); \
+    ++Stat->calls[c]; \
+    ++Stat->hist[c][Bucket( t )]; \
+    return rc; \
+  }
+
+
+// ========== Counting backend
+
+static BOOL SC_Write( HANDLE hCon, LPCWSTR lpBuffer, DWORD nLength,
+		      LPDWORD lpWritten )
+{
+  COUNT( MC_WRITE, Inner->Write( hCon, lpBuffer, nLength, lpWritten ) )
+}
+
+
+static BOOL SC_WriteA( HANDLE hCon, LPCSTR lpBuffer, DWORD nLength,
+		       LPDWORD lpWritten )
+{
+  COUNT( MC_WRITEA, Inner->WriteA( hCon, lpBuffer, nLength, lpWritten ) )
+}
+
+
+static BOOL SC_WriteOutput( HANDLE hCon, const CHAR_INFO* lpBuffer,
+			    COORD size, COORD coord, PSMALL_RECT lpRegion )
+{
+  COUNT( MC_WRITEOUTPUT,
+	 Inner->WriteOutput( hCon, lpBuffer, size, coord, lpRegion ) )
+}
+
+
+static BOOL SC_FillChar( HANDLE hCon, WCHAR ch, DWORD nLength, COORD pos,
+			 LPDWORD lpWritten )
+{
+  COUNT( MC_FILLCHAR, Inner->FillChar( hCon, ch, nLength, pos, lpWritten ) )
+}
+
+
+static BOOL SC_FillAttr( HANDLE hCon, WORD attr, DWORD nLength, COORD pos,
+			 LPDWORD lpWritten )
+{
+  COUNT( MC_FILLATTR, Inner->FillAttr( hCon, attr, nLength, pos, lpWritten ) )
+}
+
+
+static BOOL SC_Scroll( HANDLE hCon, const SMALL_RECT* lpScroll,
+		       const SMALL_RECT* lpClip, COORD dest,
+		       const CHAR_INFO* lpFill )
+{
+  COUNT( MC_SCROLL, Inner->Scroll( hCon, lpScroll, lpClip, dest, lpFill ) )
+}
+
+
+static BOOL SC_SetCursor( HANDLE hCon, COORD pos )
+{
+  COUNT( MC_SETCURSOR, Inner->SetCursor( hCon, pos ) )
+}
+
+
+static BOOL SC_SetAttr( HANDLE hCon, WORD attr )
+{
+  COUNT( MC_SETATTR, Inner->SetAttr( hCon, attr ) )
+}
+
+
+static BOOL SC_GetInfo( HANDLE hCon, PCONSOLE_SCREEN_BUFFER_INFO pcsbi )
+{
+  COUNT( MC_GETINFO, Inner->GetInfo( hCon, pcsbi ) )
+}
+
+
+static BOOL SC_SetTitle( HANDLE hCon, LPCWSTR lpTitle )
+{
+  COUNT( MC_SETTITLE, Inner->SetTitle( hCon, lpTitle ) )
+}
+
+
+static BOOL SC_ReadOutput( HANDLE hCon, PCHAR_INFO lpBuffer, COORD size,
+			   COORD coord, PSMALL_RECT lpRegion )
+{
+  COUNT( MC_READOUTPUT, Inner->ReadOutput( hCon, lpBuffer, size, coord,
+					   lpRegion ) )
+}
+
+
+static BOOL SC_SetVisible( HANDLE hCon, BOOL bVisible )
+{
+  COUNT( MC_SETVISIBLE, Inner->SetVisible( hCon, bVisible ) )
+}
+
+
+static BOOL SC_GetPalette( HANDLE hCon, COLORREF* lpPalette )
+{
+  COUNT( MC_GETPALETTE, Inner->GetPalette( hCon, lpPalette ) )
+}
+
+
+static BOOL SC_SetPalette( HANDLE hCon, const COLORREF* lpPalette )
+{
+  COUNT( MC_SETPALETTE, Inner->SetPalette( hCon, lpPalette ) )
+}
+
+
+static ConsoleFn StatCon =
+{
+  SC_Write,
+  SC_WriteA,
+  SC_WriteOutput,
+  SC_FillChar,
+  SC_FillAttr,
+  SC_Scroll,
+  SC_SetCursor,
+  SC_SetAttr,
+  SC_GetInfo,
+  SC_SetTitle,
+  SC_ReadOutput,
+  SC_SetVisible,
+  SC_GetPalette,
+  SC_SetPalette
+};
+
+
+//-----------------------------------------------------------------------------
+//   StatInit()
+// Makes the shared block and starts counting the calls of the current
+// backend.
+//-----------------------------------------------------------------------------
+
+void StatInit( void )
+{
+#ifdef _WIN32
+  LARGE_INTEGER f;
+  char	 name[32];
+  HANDLE map;
+  Stats* s;
+
+  QueryPerformanceFrequency( &f );
+  NsPerTick = 1e9 / f.QuadPart;
+
+  sprintf( name, STATS_NAME "%lu", GetCurrentProcessId() );
+  map = CreateFileMappingA( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			    0, sizeof(Stats), name );
+  if (map != NULL)
+  {
+    // The mapping stays open until the process ends.
+    s = MapViewOfFile( map, FILE_MAP_WRITE, 0, 0, sizeof(Stats) );
+    if (s != NULL)
+      Stat = s;
+  }
+  Stat->pid = GetCurrentProcessId();
+#else
+  Stat->pid = getpid();
+#endif
+  Stat->version = STATS_VERSION;
+  Stat->size	= sizeof(Stats);
+  if (getenv( "ANSICON_STATS" ) != NULL)
+    Stat->timing = TRUE;	// StatDump will read them
+
+  Inner = Con;
+  Con = &StatCon;
+}
+
+//-----------------------------------------------------------------------------
+//   StatReport( f )
+// Writes the counters, and the percentiles of the latencies, to f.
+//-----------------------------------------------------------------------------
+
+void StatReport( FILE* f )
+{
+  static const double pct[] = { 0.5, 0.9, 0.99, 1 };
+  ULONGLONG n, sum;
+  int	    c, b, p;
+
+  fprintf( f, "ANSICON statistics for process %lu\n", (unsigned long)Stat->pid );
+  fprintf( f, "  writes %" LLU ", bytes %" LLU ", flushes %" LLU "\n",
+	   Stat->writes, Stat->bytes, Stat->flushes );
+  fprintf( f, "  sequences:" );
+  for (c = 0; c < 64; ++c)
+    if (Stat->esc[c])
+      fprintf( f, " %c %" LLU, '@' + c, Stat->esc[c] );
+  fprintf( f, "\n  %-12s %10s %10s %10s %10s %10s\n",
+	   "call", "count", "p50 us", "p90 us", "p99 us", "max us" );
+  for (c = 0; c < MC_CALLS; ++c)
+  {
+    if (Stat->calls[c] == 0)
+      continue;
+    fprintf( f, "  %-12s %10" LLU, CallName[c], Stat->calls[c] );
+    for (n = 0, b = 0; b < STAT_BUCKETS; ++b)
+      n += Stat->hist[c][b];
+    for (p = 0; n != 0 && p < 4; ++p)
+    {
+      sum = 0;
+      for (b = 0; b < STAT_BUCKETS - 1; ++b)
+      {
+	sum += Stat->hist[c][b];
+	if (sum >= pct[p] * n)
+	  break;
+      }
+      // Report the top of the bucket.
+      fprintf( f, " %10.2f", BucketLow( b + 1 ) / 1e3 );
+    }
+    fprintf( f, "\n" );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   StatDump()
+// Appends the report to the file named by ANSICON_STATS, if it's set.
+//-----------------------------------------------------------------------------
+
+void StatDump( void )
+{
+  char* name = getenv( "ANSICON_STATS" );
+  FILE* f;
+
+  if (name != NULL && *name != '\0')
+  {
+    f = fopen( name, "a" );
+    if (f != NULL)
+    {
+      StatReport( f );
+      fclose( f );
+    }
+  }
+}
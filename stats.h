@@ -0,0 +1,50 @@
+/*
+  stats.h - Counters and console call latencies of the interpreter.
+
+  The counters are kept in a block of shared memory named "ANSICON_Stats_"
+  followed by the process id (in decimal), so another process can read them
+  while the program runs.  The block starts with STATS_VERSION and its size,
+  to be checked by the reader.  Timing the console calls is only done while
+  a reader has set `timing'; counting is always done.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "console.h"
+
+#define STATS_VERSION 4
+#define STATS_NAME    "ANSICON_Stats_"
+
+// Latencies are in nanoseconds, in buckets of four per power of two: the
+// bucket of n is n itself for n < 4, otherwise the top two bits after the
+// leading one, plus four times the position of that one (less one).
+#define STAT_BUCKETS  128
+
+typedef struct
+{
+  DWORD 	 version;		// STATS_VERSION
+  DWORD 	 size;			// sizeof(Stats)
+  DWORD 	 pid;
+  volatile DWORD timing;		// set to time the console calls
+  ULONGLONG	 writes;		// hooked writes
+  ULONGLONG	 bytes; 		// characters written by them
+  ULONGLONG	 flushes;		// times the print buffer was written
+  ULONGLONG	 esc[64];		// sequences by final byte, from '@'
+  ULONGLONG	 calls[MC_CALLS];	// console calls, by MC_ index
+  DWORD 	 hist[MC_CALLS][STAT_BUCKETS];	// timed calls by latency
+} Stats;
+
+extern Stats* Stat;
+
+// Count a hooked write of n characters.  The hooks aren't serialized, so
+// writes from several threads at once may be missed (the other counters are
+// kept under the interpreter's lock).
+#define STAT_WRITE( n ) (++Stat->writes, Stat->bytes += (n))
+
+void StatInit( void );
+void StatReport( FILE* f );
+void StatDump( void );
+
+#endif
@@ -0,0 +1,312 @@
+/*
+  trace.c - Record what programs write, to replay it later.
+
+  Setting ANSICON_TRACE records every write to a console with processed
+  output (before it is interpreted) in the file named by its value followed
+  by "-", the process id and ".trace".  The writes are copied into a ring
+  (ring.c), whose thread encodes them and writes the file, so a program is
+  only slowed down by the copy.  The format is described in trace.h; it is
+  replayed by ansibench.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "ring.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define TRACE_RING 1024 	// KB
+
+BOOL	  Tracing;
+Ring	  Trace;
+FILE*	  TraceFile;
+ULONGLONG TraceLast;		// time of the last write recorded
+UINT	  TraceCp;		// code page last recorded (by the ring's thread)
+
+
+//-----------------------------------------------------------------------------
+//   Micro()
+// Returns the time in microseconds.
+//-----------------------------------------------------------------------------
+
+static ULONGLONG Micro( void )
+{
+#ifdef _WIN32
+  static LARGE_INTEGER f;
+  LARGE_INTEGER c;
+  if (f.QuadPart == 0)
+    QueryPerformanceFrequency( &f );
+  QueryPerformanceCounter( &c );
+  return (ULONGLONG)(c.QuadPart * (1e6 / f.QuadPart));
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+//   Leb( buf, n )
+// Encodes n in buf, returning the number of bytes.
+//-----------------------------------------------------------------------------
+
+static int Leb( BYTE* buf, ULONGLONG n )
+{
+  int i = 0;
+
+  while (n >= 0x80)
+  {
+    buf[i++] = (BYTE)n | 0x80;
+    n >>= 7;
+  }
+  buf[i++] = (BYTE)n;
+  return i;
+}
+
+
+// ========== Recording
+
+//-----------------------------------------------------------------------------
+//   Record( q, data )
+// Writes a record to the trace (on the ring's thread).  A narrow write
+// carries its code page as its arg, recorded before it if it has changed.
+//-----------------------------------------------------------------------------
+
+static void Record( const RingRec* q, const char* data )
+{
+  BYTE	hdr[32];
+  int	n = 0;
+  UINT	cp;
+
+  cp = (UINT)(size_t)q->arg;
+  if (q->kind != TRACE_W && cp != TraceCp)
+  {
+    TraceCp = cp;
+    hdr[n++] = TRACE_CP;
+    n += Leb( hdr + n, cp );
+  }
+  hdr[n++] = (BYTE)q->kind | ((q->more) ? TRACE_MORE : 0);
+  n += Leb( hdr + n, (size_t)q->h );
+  // Writes from different threads may be added out of order.
+  n += Leb( hdr + n, (q->time > TraceLast) ? q->time - TraceLast : 0 );
+  if (q->time > TraceLast)
+    TraceLast = q->time;
+  n += Leb( hdr + n, q->len );
+  fwrite( hdr, 1, n, TraceFile );
+  fwrite( data, 1, q->len, TraceFile );
+}
+
+//-----------------------------------------------------------------------------
+//   Idle()
+// Writes out what's been recorded while there's nothing else to do.
+//-----------------------------------------------------------------------------
+
+static void Idle( void )
+{
+  fflush( TraceFile );
+}
+
+//-----------------------------------------------------------------------------
+//   TraceInit()
+// Starts recording, if ANSICON_TRACE is set.
+//-----------------------------------------------------------------------------
+
+void TraceInit( void )
+{
+  char* env = getenv( "ANSICON_TRACE" );
+  char* name;
+  BYTE	hdr[16];
+  DWORD pid;
+  int	n;
+
+  if (env == NULL || *env == '\0')
+    return;
+#ifdef _WIN32
+  pid = GetCurrentProcessId();
+#else
+  pid = getpid();
+#endif
+  name = malloc( strlen( env ) + 20 );
+  if (name == NULL)
+    return;
+  sprintf( name, "%s-%lu.trace", env, (unsigned long)pid );
+  TraceFile = fopen( name, "wb" );
+  free( name );
+  if (TraceFile == NULL)
+    return;
+  n = Leb( hdr, pid );
+  fwrite( TRACE_MAGIC, 1, 8, TraceFile );
+  fwrite( hdr, 1, n, TraceFile );
+
+  TraceLast = Micro();
+  Trace.consume = Record;
+  Trace.idle	= Idle;
+  Tracing = RingInit( &Trace, TRACE_RING );
+  if (!Tracing)
+    fclose( TraceFile );
+}
+
+//-----------------------------------------------------------------------------
+//   TraceWrite( type, h, cp, buf, len )
+// Records a write of len bytes to h (made in code page cp, if narrow).
+//-----------------------------------------------------------------------------
+
+void TraceWrite( int type, HANDLE h, UINT cp, LPCVOID buf, DWORD len )
+{
+  RingRec rec;
+
+  rec.h    = h;
+  rec.arg  = (const void*)(size_t)cp;
+  rec.time = Micro();
+  rec.kind = type;
+  rec.len  = len;
+  RingPut( &Trace, &rec, buf );
+}
+
+//-----------------------------------------------------------------------------
+//   TraceFlush()
+// Writes out everything recorded so far.
+//-----------------------------------------------------------------------------
+
+void TraceFlush( void )
+{
+  if (Tracing)
+  {
+    RingDrain( &Trace );
+    fflush( TraceFile );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   TraceStop()
+// Writes out everything and closes the trace.
+//-----------------------------------------------------------------------------
+
+void TraceStop( void )
+{
+  if (Tracing)
+  {
+    Tracing = FALSE;
+    RingStop( &Trace );
+    fclose( TraceFile );
+  }
+}
+
+
+// ========== Reading
+
+//-----------------------------------------------------------------------------
+//   Uleb( tr, n )
+// Decodes a number, returning FALSE if the trace ends first.
+//-----------------------------------------------------------------------------
+
+static BOOL Uleb( TraceReader* tr, ULONGLONG* n )
+{
+  int shift;
+
+  *n = 0;
+  for (shift = 0; tr->p < tr->end && shift < 64; shift += 7)
+  {
+    *n |= (ULONGLONG)(*tr->p & 0x7F) << shift;
+    if (!(*tr->p++ & 0x80))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   TraceOpen( tr, data, size )
+// Starts reading the trace in data, returning FALSE if it isn't one.
+//-----------------------------------------------------------------------------
+
+BOOL TraceOpen( TraceReader* tr, LPCVOID data, DWORD size )
+{
+  ULONGLONG pid;
+
+  memset( tr, 0, sizeof(*tr) );
+  if (size < 8 || memcmp( data, TRACE_MAGIC, 8 ) != 0)
+    return FALSE;
+  tr->p   = (const BYTE*)data + 8;
+  tr->end = (const BYTE*)data + size;
+  if (!Uleb( tr, &pid ))
+    return FALSE;
+  tr->pid = (DWORD)pid;
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   TraceNext( tr, ev )
+// Reads the next write, returning FALSE at the end of the trace (or if it's
+// been cut short).  A write recorded in pieces is joined back together.
+//-----------------------------------------------------------------------------
+
+BOOL TraceNext( TraceReader* tr, TraceEvent* ev )
+{
+  ULONGLONG n, delta, len;
+  DWORD     joined = 0;
+  int	    type;
+  BYTE*     buf;
+
+  while (tr->p < tr->end)
+  {
+    type = *tr->p++;
+    if (type == TRACE_CP)
+    {
+      if (!Uleb( tr, &n ))
+	return FALSE;
+      tr->cp = (UINT)n;
+      continue;
+    }
+    if ((type & ~TRACE_MORE) > TRACE_FILE ||
+	!Uleb( tr, &ev->handle ) || !Uleb( tr, &delta ) || !Uleb( tr, &len ) ||
+	len > (ULONGLONG)(tr->end - tr->p))
+      return FALSE;
+    tr->time += delta;
+    if (joined == 0)
+    {
+      ev->time = tr->time;
+      ev->type = type & ~TRACE_MORE;
+      ev->cp   = tr->cp;
+    }
+    if ((type & TRACE_MORE) || joined != 0)
+    {
+      if (joined + len > tr->max)
+      {
+	buf = realloc( tr->buf, joined + (DWORD)len );
+	if (buf == NULL)
+	  return FALSE;
+	tr->buf = buf;
+	tr->max = joined + (DWORD)len;
+      }
+      memcpy( tr->buf + joined, tr->p, len );
+      joined += (DWORD)len;
+      tr->p += len;
+      if (type & TRACE_MORE)
+	continue;
+      ev->data = tr->buf;
+      ev->len  = joined;
+      return TRUE;
+    }
+    ev->data = tr->p;
+    ev->len  = (DWORD)len;
+    tr->p += len;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+//   TraceClose( tr )
+// Frees what the reader allocated.
+//-----------------------------------------------------------------------------
+
+void TraceClose( TraceReader* tr )
+{
+  free( tr->buf );
+  tr->buf = NULL;
+}
@@ -0,0 +1,64 @@
+/*
+  trace.h - Record what programs write, to replay it later.
+
+  A trace starts with TRACE_MAGIC and the process id.  Each record then
+  starts with a byte of its type (TRACE_A, TRACE_W or TRACE_FILE, the
+  function that was called, with TRACE_MORE set if the write continues in
+  the next record; or TRACE_CP), followed by unsigned numbers in LEB128 (7
+  bits a byte, least significant first, the top bit set on all but the
+  last byte):
+
+	TRACE_CP:   the output code page of the A and File writes that follow;
+	otherwise:  the handle, microseconds since the previous write, the
+		    number of bytes and the bytes themselves (UTF-16LE for W).
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "console.h"
+
+#define TRACE_MAGIC "ANSITRC1"
+
+enum
+{
+  TRACE_A,			// WriteConsoleA
+  TRACE_W,			// WriteConsoleW
+  TRACE_FILE,			// WriteFile
+  TRACE_CP,			// code page
+  TRACE_MORE = 0x80
+};
+
+extern BOOL Tracing;		// ANSICON_TRACE is recording
+
+void TraceInit( void );
+void TraceWrite( int type, HANDLE h, UINT cp, LPCVOID buf, DWORD len );
+void TraceFlush( void );
+void TraceStop( void );
+
+// Reading a trace held in memory.
+typedef struct
+{
+  const BYTE* p, * end;
+  DWORD 	pid;
+  UINT		cp;		// the current code page
+  ULONGLONG	time;		// of the last write
+  BYTE* 	buf;		// joins the records of a write
+  DWORD 	max;
+} TraceReader;
+
+typedef struct
+{
+  int	      type;		// TRACE_A, TRACE_W or TRACE_FILE
+  UINT	      cp;		// the code page (for A and File)
+  ULONGLONG   handle;
+  ULONGLONG   time;		// microseconds since the start
+  const BYTE* data;
+  DWORD       len;		// bytes
+} TraceEvent;
+
+BOOL TraceOpen( TraceReader* tr, LPCVOID data, DWORD size );
+BOOL TraceNext( TraceReader* tr, TraceEvent* ev );
+void TraceClose( TraceReader* tr );
+
+#endif
@@ -0,0 +1,226 @@
+/*
+  widen.c - Convert narrow output to UTF-16 for the interpreter.
+
+  UTF-8 is decoded here rather than by MultiByteToWideChar, so that the
+  output can be converted a piece at a time into a fixed buffer, and a
+  sequence split between two writes is still decoded correctly.  Runs of
+  ASCII (most output) are widened 16 bytes at a time with SSE2.  Invalid
+  bytes become U+FFFD, as MultiByteToWideChar does.
+
+  Single-byte code pages (437, 850, 1252, ...) are widened through a table of
+  the 256 characters, made when the code page changes.  The bytes that
+  become C1 controls (U+0080 to U+009F: those 1252 leaves undefined, or all
+  of them in Latin-1) become U+FFFD instead, so a stray byte is printed,
+  rather than starting a sequence that swallows the rest of the output; C1
+  controls are only taken from UTF-16 and UTF-8.
+*/
+
+#include <string.h>
+#include "widen.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define BAD 0xFFFD
+
+
+//-----------------------------------------------------------------------------
+//   WidenAscii( s, len, w )
+// Widens the ASCII characters at the start of s, returning how many.
+//-----------------------------------------------------------------------------
+
+static DWORD WidenAscii( const BYTE* s, DWORD len, LPWSTR w )
+{
+  DWORD i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+    int     m = _mm_movemask_epi8( v );
+    if (m)
+    {
+      m = __builtin_ctz( m );
+      while (m--)
+	w[i] = s[i], ++i;
+      return i;
+    }
+    _mm_storeu_si128( (__m128i*)(w + i),     _mm_unpacklo_epi8( v, zero ) );
+    _mm_storeu_si128( (__m128i*)(w + i + 8), _mm_unpackhi_epi8( v, zero ) );
+  }
+#endif
+  for (; i < len && s[i] < 0x80; ++i)
+    w[i] = s[i];
+  return i;
+}
+
+
+//-----------------------------------------------------------------------------
+//   Decode( s, end, w )
+// Decodes the UTF-8 from s to end into w, stopping early only at a sequence
+// that is incomplete (but valid so far).  Returns where it stopped and
+// advances w past the characters written.
+//-----------------------------------------------------------------------------
+
+static const BYTE* Decode( const BYTE* s, const BYTE* end, LPWSTR* pw )
+{
+  LPWSTR   w = *pw;
+  unsigned c, min;
+  int	   n, i;
+
+  while (s < end)
+  {
+    c = *s;
+    if (c < 0x80)
+    {
+      n = WidenAscii( s, end - s, w );
+      s += n;
+      w += n;
+      continue;
+    }
+    if	    (c < 0xC2) n = 0;
+    else if (c < 0xE0) n = 1, c &= 0x1F, min = 0x80;
+    else if (c < 0xF0) n = 2, c &= 0x0F, min = 0x800;
+    else if (c < 0xF5) n = 3, c &= 0x07, min = 0x10000;
+    else	       n = 0;
+    for (i = 1; i <= n && s + i < end && (s[i] & 0xC0) == 0x80; ++i)
+      c = (c << 6) | (s[i] & 0x3F);
+    if (i <= n && s + i == end)
+      break;				// incomplete
+    if (n == 0 || i <= n || c < min || (c >= 0xD800 && c < 0xE000)
+	|| c > 0x10FFFF)
+    {
+      *w++ = BAD;
+      ++s;
+      continue;
+    }
+    s += n + 1;
+    if (c >= 0x10000)
+    {
+      c -= 0x10000;
+      *w++ = 0xD800 | (c >> 10);
+      *w++ = 0xDC00 | (c & 0x3FF);
+    }
+    else
+      *w++ = c;
+  }
+  *pw = w;
+  return s;
+}
+
+
+//-----------------------------------------------------------------------------
+//   Utf8Decode( st, s, len, w )
+// Decodes len bytes of UTF-8 into w, which must have room for len +
+// UTF8_EXTRA characters, returning the number of characters.  An incomplete
+// sequence at the end is kept in st for next time.
+//-----------------------------------------------------------------------------
+
+DWORD Utf8Decode( Utf8State* st, const char* str, DWORD len, LPWSTR w )
+{
+  const BYTE* s = (const BYTE*)str;
+  const BYTE* end = s + len;
+  const BYTE* stop;
+  LPWSTR      start = w;
+  BYTE	      tmp[8];
+  int	      n, k;
+
+  if (st->npend)
+  {
+    // Decode the pending bytes with enough of the new ones to complete them.
+    memcpy( tmp, st->pend, st->npend );
+    n = (len < 4) ? len : 4;
+    memcpy( tmp + st->npend, s, n );
+    stop = Decode( tmp, tmp + st->npend + n, &w );
+    k = stop - tmp;
+    if (k < st->npend)		// still incomplete, so len < 4
+    {
+      memcpy( st->pend + st->npend, s, len );
+      st->npend += len;
+      return w - start;
+    }
+    s += k - st->npend;
+    st->npend = 0;
+  }
+
+  stop = Decode( s, end, &w );
+  st->npend = end - stop;
+  memcpy( st->pend, stop, st->npend );
+  return w - start;
+}
+
+
+//-----------------------------------------------------------------------------
+//   SbcsInit( m, cp )
+// Makes the map for code page cp, returning FALSE if it isn't a single-byte
+// code page.  Without Windows, only ISO-8859-1 (28591) and Windows-1252 are
+// known.
+//-----------------------------------------------------------------------------
+
+#ifndef _WIN32
+// Windows-1252 from 0x80 to 0x9F (as MultiByteToWideChar has it); the rest
+// is Latin-1.
+static const WCHAR Cp1252[32] =
+{
+  0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+  0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+  0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+  0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+#endif
+
+BOOL SbcsInit( SbcsMap* m, UINT cp )
+{
+  char bytes[256];
+  int  i;
+
+  for (i = 0; i < 256; ++i)
+    bytes[i] = i;
+#ifdef _WIN32
+  {
+    CPINFO info;
+    if (!GetCPInfo( cp, &info ) || info.MaxCharSize != 1 ||
+	MultiByteToWideChar( cp, 0, bytes, 256, m->map, 256 ) != 256)
+      return FALSE;
+  }
+#else
+  if (cp != 28591 && cp != 1252)
+    return FALSE;
+  for (i = 0; i < 256; ++i)
+    m->map[i] = (BYTE)bytes[i];
+  if (cp == 1252)
+    memcpy( m->map + 0x80, Cp1252, sizeof(Cp1252) );
+#endif
+  for (i = 0; i < 256; ++i)
+    if (m->map[i] >= 0x80 && m->map[i] < 0xA0)
+      m->map[i] = 0xFFFD;
+  m->cp = cp;
+  m->ascii = TRUE;
+  for (i = 0; i < 0x80; ++i)
+    if (m->map[i] != i)
+      m->ascii = FALSE;
+  return TRUE;
+}
+
+
+//-----------------------------------------------------------------------------
+//   SbcsWiden( m, s, len, w )
+// Widens len bytes into w using the map.
+//-----------------------------------------------------------------------------
+
+DWORD SbcsWiden( const SbcsMap* m, const char* str, DWORD len, LPWSTR w )
+{
+  const BYTE* s = (const BYTE*)str;
+  DWORD i = 0;
+
+  while (i < len)
+  {
+    if (m->ascii)
+      i += WidenAscii( s + i, len - i, w + i );
+    for (; i < len && (s[i] >= 0x80 || !m->ascii); ++i)
+      w[i] = m->map[s[i]];
+  }
+  return len;
+}
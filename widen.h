@@ -0,0 +1,35 @@
+/*
+  widen.h - Convert narrow output to UTF-16 for the interpreter.
+*/
+
+#ifndef WIDEN_H
+#define WIDEN_H
+
+#include "console.h"
+
+// A UTF-8 sequence may be split across writes, so the bytes of an
+// incomplete one are kept until the next.
+typedef struct
+{
+  BYTE pend[4]; 		// bytes of an incomplete sequence
+  int  npend;			// number of them
+} Utf8State;
+
+// Utf8Decode may produce this many more characters than bytes given it
+// (from the pending bytes of the previous call).
+#define UTF8_EXTRA 3
+
+DWORD Utf8Decode( Utf8State* st, const char* s, DWORD len, LPWSTR w );
+
+// The character of each byte of a single-byte code page.
+typedef struct
+{
+  UINT	cp;			// the code page
+  BOOL	ascii;			// bytes below 0x80 are ASCII
+  WCHAR map[256];
+} SbcsMap;
+
+BOOL  SbcsInit( SbcsMap* m, UINT cp );
+DWORD SbcsWiden( const SbcsMap* m, const char* s, DWORD len, LPWSTR w );
+
+#endif
@@ -0,0 +1,181 @@
+/*
+  wincon.c - Console backend for the real Win32 console.
+
+  The functions are wrapped rather than used directly, since the API uses
+  the WINAPI calling convention and has arguments the interpreter never uses.
+*/
+
+#include <string.h>
+#include "console.h"
+
+
+// The palette is only available from Vista, so the functions are found at
+// run time (and the structure is our own, for older headers).
+typedef struct
+{
+  ULONG      cbSize;
+  COORD      dwSize;
+  COORD      dwCursorPosition;
+  WORD	     wAttributes;
+  SMALL_RECT srWindow;
+  COORD      dwMaximumWindowSize;
+  WORD	     wPopupAttributes;
+  BOOL	     bFullscreenSupported;
+  COLORREF   ColorTable[16];
+} InfoEx;
+
+typedef BOOL (WINAPI *PInfoEx)( HANDLE, InfoEx* );
+
+static PInfoEx GetInfoEx, SetInfoEx;
+static BOOL    InfoExFound;
+
+static BOOL FindInfoEx( void )
+{
+  HMODULE kernel;
+
+  if (!InfoExFound)
+  {
+    kernel = GetModuleHandleA( "kernel32.dll" );
+    GetInfoEx = (PInfoEx)GetProcAddress( kernel,
+					 "GetConsoleScreenBufferInfoEx" );
+    SetInfoEx = (PInfoEx)GetProcAddress( kernel,
+					 "SetConsoleScreenBufferInfoEx" );
+    InfoExFound = TRUE;
+  }
+  return (GetInfoEx != NULL && SetInfoEx != NULL);
+}
+
+
+static BOOL WC_Write( HANDLE hCon, LPCWSTR lpBuffer, DWORD nLength,
+		      LPDWORD lpWritten )
+{
+  return WriteConsoleW( hCon, lpBuffer, nLength, lpWritten, NULL );
+}
+
+
+static BOOL WC_WriteA( HANDLE hCon, LPCSTR lpBuffer, DWORD nLength,
+		       LPDWORD lpWritten )
+{
+  return WriteConsoleA( hCon, lpBuffer, nLength, lpWritten, NULL );
+}
+
+
+static BOOL WC_WriteOutput( HANDLE hCon, const CHAR_INFO* lpBuffer,
+			    COORD size, COORD coord, PSMALL_RECT lpRegion )
+{
+  return WriteConsoleOutputW( hCon, lpBuffer, size, coord, lpRegion );
+}
+
+
+static BOOL WC_FillChar( HANDLE hCon, WCHAR ch, DWORD nLength, COORD pos,
+			 LPDWORD lpWritten )
+{
+  return FillConsoleOutputCharacterW( hCon, ch, nLength, pos, lpWritten );
+}
+
+
+static BOOL WC_FillAttr( HANDLE hCon, WORD attr, DWORD nLength, COORD pos,
+			 LPDWORD lpWritten )
+{
+  return FillConsoleOutputAttribute( hCon, attr, nLength, pos, lpWritten );
+}
+
+
+static BOOL WC_Scroll( HANDLE hCon, const SMALL_RECT* lpScroll,
+		       const SMALL_RECT* lpClip, COORD dest,
+		       const CHAR_INFO* lpFill )
+{
+  return ScrollConsoleScreenBufferW( hCon, lpScroll, lpClip, dest, lpFill );
+}
+
+
+static BOOL WC_SetCursor( HANDLE hCon, COORD pos )
+{
+  return SetConsoleCursorPosition( hCon, pos );
+}
+
+
+static BOOL WC_SetAttr( HANDLE hCon, WORD attr )
+{
+  return SetConsoleTextAttribute( hCon, attr );
+}
+
+
+static BOOL WC_GetInfo( HANDLE hCon, PCONSOLE_SCREEN_BUFFER_INFO pcsbi )
+{
+  return GetConsoleScreenBufferInfo( hCon, pcsbi );
+}
+
+
+static BOOL WC_SetTitle( HANDLE hCon, LPCWSTR lpTitle )
+{
+  return SetConsoleTitleW( lpTitle );
+}
+
+
+static BOOL WC_ReadOutput( HANDLE hCon, PCHAR_INFO lpBuffer, COORD size,
+			   COORD coord, PSMALL_RECT lpRegion )
+{
+  return ReadConsoleOutputW( hCon, lpBuffer, size, coord, lpRegion );
+}
+
+
+static BOOL WC_SetVisible( HANDLE hCon, BOOL bVisible )
+{
+  CONSOLE_CURSOR_INFO cci;
+
+  if (!GetConsoleCursorInfo( hCon, &cci ))
+    return FALSE;
+  cci.bVisible = bVisible;
+  return SetConsoleCursorInfo( hCon, &cci );
+}
+
+
+static BOOL WC_GetPalette( HANDLE hCon, COLORREF* lpPalette )
+{
+  InfoEx csbix;
+
+  if (!FindInfoEx())
+    return FALSE;
+  csbix.cbSize = sizeof(csbix);
+  if (!GetInfoEx( hCon, &csbix ))
+    return FALSE;
+  memcpy( lpPalette, csbix.ColorTable, sizeof(csbix.ColorTable) );
+  return TRUE;
+}
+
+
+static BOOL WC_SetPalette( HANDLE hCon, const COLORREF* lpPalette )
+{
+  InfoEx csbix;
+
+  if (!FindInfoEx())
+    return FALSE;
+  csbix.cbSize = sizeof(csbix);
+  if (!GetInfoEx( hCon, &csbix ))
+    return FALSE;
+  memcpy( csbix.ColorTable, lpPalette, sizeof(csbix.ColorTable) );
+  // The window is set exclusive of its right and bottom, yet read inclusive.
+  ++csbix.srWindow.Right;
+  ++csbix.srWindow.Bottom;
+  return SetInfoEx( hCon, &csbix );
+}
+
+
+ConsoleFn WinCon =
+{
+  WC_Write,
+  WC_WriteA,
+  WC_WriteOutput,
+  WC_FillChar,
+  WC_FillAttr,
+  WC_Scroll,
+  WC_SetCursor,
+  WC_SetAttr,
+  WC_GetInfo,
+  WC_SetTitle,
+  WC_ReadOutput,
+  WC_SetVisible,
+  WC_GetPalette,
+  WC_SetPalette
+};